@@ -25,6 +25,58 @@
     - chips/m6522.h
     - chips/mem.h
 
+    ## The IEC Serial Bus
+
+    The drive is connected to the C64 through a shared byte with the state
+    of the IEC bus lines (C1541_IECPORT_*): a bit is set while the line
+    is pulled low by any device. The drive's own outputs are in
+    c1541_t.iec_out, the system is expected to merge them with its own
+    outputs into the shared byte after each tick.
+
+    The serial bus lines are wired to VIA1 like on the real drive:
+
+    - PB0: DATA IN
+    - PB1: DATA OUT
+    - PB2: CLK IN
+    - PB3: CLK OUT
+    - PB4: ATN acknowledge, DATA is pulled low while ATN and this bit
+      differ, so that the drive answers ATN even before the DOS does
+    - PB5..PB6: device address jumpers (always device 8)
+    - PB7 and CA1: ATN IN
+
+    ## Idle Drive
+
+    An attached but unused drive spends all its time in the DOS idle loop
+    waiting for the C64 to send a command. When the drive CPU reaches the
+    idle loop with ATN released and the motor off, the drive is suspended,
+    and c1541_tick() returns immediately until any IEC bus line changes.
+    This skips the VIA timers too, which is harmless for the DOS, but may
+    confuse programs uploaded to the drive, which however never run the
+    DOS idle loop.
+
+    ## Disc Images
+
+    c1541_insert_disc() accepts D64 images (35 or 40 tracks, with or
+    without the error info block) and G64 images. The image data is not
+    copied: the drive reads and writes it in place, so the caller can map
+    the image file in memory and get changes saved into it.
+
+    The drive hardware only sees the GCR encoded bitstream under the head.
+    G64 images already contain it, while D64 images only contain the
+    sectors, so each track is GCR encoded the first time the head reads
+    it, with the standard 1541 format. The C1541_TRACK_CACHE_SIZE last
+    used tracks are kept encoded, and tracks the drive wrote into are
+    decoded back into the image when they are evicted from the cache, when
+    the spindle motor is turned off, and by c1541_flush_disc() and
+    c1541_remove_disc().
+
+    The disc is emulated at the byte level: every 26 to 32 cycles,
+    depending on the bit rate selected with VIA2 PB5..PB6, the next byte
+    passes under the head. It is latched into VIA2 PA, or replaced with
+    the VIA2 PA output when CB2 selects write mode, and BYTE READY pulses
+    CA1 and sets the CPU overflow flag if CA2 enables it. Two 0xFF bytes
+    in a row are reported as SYNC on PB7.
+
     ## zlib/libpng license
 
     Copyright (c) 2019 Andre Weissflog
@@ -59,29 +111,69 @@ extern "C" {
 #define C1541_IECPORT_ATN   (1<<4)
 
 #define C1541_FREQUENCY (1000000)
+#define C1541_IDLE_PC (0xEC9B)          // DOS idle loop, waiting for commands
+
+#define C1541_MAX_HALF_TRACKS (84)      // head positions, half track 0 is track 1
+#define C1541_MAX_TRACK_SIZE (7928)     // max GCR bytes in a track (from the G64 format)
+#define C1541_TRACK_CACHE_SIZE (4)      // GCR encoded tracks kept at the same time
 
 // config params for c1541_init()
 typedef struct {
     // pointer to a shared byte with IEC serial bus line state
     uint8_t* iec_port;
-    // rom images
+    // rom images, not copied: they must stay valid as long as the instance is used
     struct {
         chips_range_t c000_dfff;
         chips_range_t e000_ffff;
     } roms;
 } c1541_desc_t;
 
+// a GCR encoded track
+typedef struct {
+    bool valid;
+    bool dirty;                 // written by the drive, must be saved into the image
+    uint8_t half_track;
+    uint16_t len;               // 0 if there is nothing recorded there
+    uint32_t used;              // last access, for the LRU eviction
+    uint8_t data[C1541_MAX_TRACK_SIZE];
+} c1541_track_t;
+
+// the disc in the drive, and the mechanics around it
+typedef struct {
+    uint8_t* image;             // D64 or G64 image, NULL if there is no disc
+    size_t image_size;
+    bool g64;
+    uint8_t num_tracks;         // D64 tracks, or G64 half tracks
+    uint8_t half_track;         // head position
+    uint8_t phase;              // stepper motor phase (VIA2 PB0..1)
+    bool motor;                 // spindle motor on
+    uint8_t countdown;          // ticks until the next byte is under the head
+    uint16_t pos;               // offset of the next byte in the track
+    uint8_t data;               // last byte read from the disc
+    uint8_t prev;               // the byte before, to detect SYNC
+    bool sync;                  // SYNC mark under the head
+    bool byte_ready;            // a byte was read or written in the last tick
+    int8_t cur;                 // cache entry of the track under the head, -1 if not looked up yet
+    uint32_t lru;               // cache access counter
+    c1541_track_t cache[C1541_TRACK_CACHE_SIZE];
+} c1541_disc_t;
+
 // 1541 emulator state
 typedef struct {
     uint64_t pins;
-    uint8_t* iec;
+    uint8_t* iec;           // shared IEC bus state
+    uint8_t iec_out;        // IEC lines pulled low by the drive
+    uint8_t sleep_iec;      // IEC bus state when the drive went idle
+    bool sleeping;          // drive is idle until the IEC bus changes
     m6502_t cpu;
     m6522_t via_1;
     m6522_t via_2;
     bool valid;
+    const uint8_t* rom_c000;    // ROM images, from c1541_desc_t
+    const uint8_t* rom_e000;
     mem_t mem;
     uint8_t ram[0x0800];
-    uint8_t rom[0x4000];
+    c1541_disc_t disc;
 } c1541_t;
 
 // initialize a new c1541_t instance
@@ -92,14 +184,18 @@ void c1541_discard(c1541_t* sys);
 void c1541_reset(c1541_t* sys);
 // tick a c1541_t instance forward
 void c1541_tick(c1541_t* sys);
-// insert a disc image file (.d64)
-void c1541_insert_disc(c1541_t* sys, chips_range_t data);
-// remove current disc
+// insert a disc image (.d64 or .g64), used in place and updated when the drive writes, returns false if the format is unknown
+bool c1541_insert_disc(c1541_t* sys, chips_range_t data);
+// remove current disc, saving pending writes into the image
 void c1541_remove_disc(c1541_t* sys);
+// save the tracks written by the drive into the disc image
+void c1541_flush_disc(c1541_t* sys);
+// fix up the internal pointers after a c1541_t was copied to a new location
+void c1541_relocate(c1541_t* sys, uint8_t* iec_port);
 // prepare a c1541_t snapshot for saving
-void c1541_snapshot_onsave(c1541_t* snapshot, void* base);
+void c1541_snapshot_onsave(c1541_t* snapshot);
 // prepare a c1541_t snapshot for loading
-void c1541_snapshot_onload(c1541_t* snapshot, c1541_t* sys, void* base);
+void c1541_snapshot_onload(c1541_t* snapshot, c1541_t* sys);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -113,17 +209,41 @@ void c1541_snapshot_onload(c1541_t* snapshot, c1541_t* sys, void* base);
     #define CHIPS_ASSERT(c) assert(c)
 #endif
 
+#define _C1541_IEC_UNKNOWN (0xFF)
+#define _C1541_D64_TRACKS (35)
+#define _C1541_D64_SIZE (174848)                // 35 tracks, 683 sectors
+#define _C1541_D64_SIZE_40 (196608)             // 40 tracks, 768 sectors
+#define _C1541_G64_HEADER_SIZE (12)
+#define _C1541_SECTOR_GCR_SIZE (5+10+9+5+325)   // SYNC, header, gap, SYNC, data, before the gap between sectors
+
+static const uint8_t _c1541_gcr_enc[16] = {
+    0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17,
+    0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15,
+};
+
+/* map the RAM and ROM of sys into mem, which is either sys->mem or a snapshot
+   about to be copied into sys
+*/
+static void _c1541_init_memory_map(c1541_t* sys, mem_t* mem) {
+    mem_init(mem);
+    mem_map_ram(mem, 0, 0x0000, 0x0800, sys->ram);
+    mem_map_ram(mem, 0, 0x0800, 0x0800, sys->ram);  // mirror
+    mem_map_rom(mem, 0, 0xC000, 0x2000, sys->rom_c000);
+    mem_map_rom(mem, 0, 0xE000, 0x2000, sys->rom_e000);
+}
+
 void c1541_init(c1541_t* sys, const c1541_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
 
     memset(sys, 0, sizeof(c1541_t));
     sys->valid = true;
+    sys->iec = desc->iec_port;
 
-    // copy ROM images
+    // ROM images are shared, not copied
     CHIPS_ASSERT(desc->roms.c000_dfff.ptr && (0x2000 == desc->roms.c000_dfff.size));
     CHIPS_ASSERT(desc->roms.e000_ffff.ptr && (0x2000 == desc->roms.e000_ffff.size));
-    memcpy(&sys->rom[0x0000], desc->roms.c000_dfff.ptr, 0x2000);
-    memcpy(&sys->rom[0x2000], desc->roms.e000_ffff.ptr, 0x2000);
+    sys->rom_c000 = (const uint8_t*) desc->roms.c000_dfff.ptr;
+    sys->rom_e000 = (const uint8_t*) desc->roms.e000_ffff.ptr;
 
     // initialize the hardware
     m6502_desc_t cpu_desc;
@@ -132,10 +252,11 @@ void c1541_init(c1541_t* sys, const c1541_desc_t* desc) {
     m6522_init(&sys->via_1);
     m6522_init(&sys->via_2);
 
-    // setup memory map
-    mem_init(&sys->mem);
-    mem_map_ram(&sys->mem, 0, 0x0000, 0x0800, sys->ram);
-    mem_map_rom(&sys->mem, 0, 0xC000, 0x4000, sys->rom);
+    _c1541_init_memory_map(sys, &sys->mem);
+
+    // the head starts over the directory track
+    sys->disc.half_track = (18-1)*2;
+    sys->disc.cur = -1;
 }
 
 void c1541_discard(c1541_t* sys) {
@@ -143,52 +264,492 @@ void c1541_discard(c1541_t* sys) {
     sys->valid = false;
 }
 
+/* D64 geometry, tracks start at 1 like in the DOS */
+static int _c1541_d64_sectors(int track) {
+    return (track <= 17) ? 21 : (track <= 24) ? 19 : (track <= 30) ? 18 : 17;
+}
+
+static uint16_t _c1541_d64_track_size(int track) {
+    return (track <= 17) ? 7692 : (track <= 24) ? 7142 : (track <= 30) ? 6666 : 6250;
+}
+
+static size_t _c1541_d64_offset(int track, int sector) {
+    size_t sectors = 0;
+    for (int t = 1; t < track; t++) {
+        sectors += _c1541_d64_sectors(t);
+    }
+    return (sectors + sector) * 256;
+}
+
+static uint32_t _c1541_rd32(const uint8_t* p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+/* GCR encode 4 bytes into 5 */
+static void _c1541_gcr_encode(const uint8_t* in, uint8_t* out) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 4; i++) {
+        bits = (bits << 10) | (_c1541_gcr_enc[in[i] >> 4] << 5) | _c1541_gcr_enc[in[i] & 15];
+    }
+    for (int i = 4; i >= 0; i--) {
+        out[i] = bits & 0xFF;
+        bits >>= 8;
+    }
+}
+
+/* GCR decode 5 bytes into 4, returns false on invalid codes */
+static bool _c1541_gcr_decode(const uint8_t* in, uint8_t* out) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 5; i++) {
+        bits = (bits << 8) | in[i];
+    }
+    for (int i = 3; i >= 0; i--) {
+        uint8_t nibbles[2];
+        for (int n = 1; n >= 0; n--) {
+            const uint8_t code = bits & 0x1F;
+            bits >>= 5;
+            int val = 0;
+            while ((val < 16) && (_c1541_gcr_enc[val] != code)) {
+                val++;
+            }
+            if (val == 16) {
+                return false;
+            }
+            nibbles[n] = val;
+        }
+        out[i] = (nibbles[0] << 4) | nibbles[1];
+    }
+    return true;
+}
+
+/* GCR encode the sectors of a D64 track, with the usual 1541 layout */
+static uint16_t _c1541_d64_encode(const c1541_disc_t* d, int track, uint8_t* out) {
+    const int num_sectors = _c1541_d64_sectors(track);
+    const uint16_t size = _c1541_d64_track_size(track);
+    const uint8_t* bam = d->image + _c1541_d64_offset(18, 0);
+    const uint8_t id1 = bam[0xA2];
+    const uint8_t id2 = bam[0xA3];
+    const int gap = (size - num_sectors * _C1541_SECTOR_GCR_SIZE) / num_sectors;
+    uint8_t* p = out;
+    for (int sector = 0; sector < num_sectors; sector++) {
+        const uint8_t* data = d->image + _c1541_d64_offset(track, sector);
+        uint8_t hdr[8] = { 0x08, sector ^ track ^ id2 ^ id1, sector, track, id2, id1, 0x0F, 0x0F };
+        uint8_t blk[260];
+        memset(p, 0xFF, 5); p += 5;
+        _c1541_gcr_encode(hdr, p); p += 5;
+        _c1541_gcr_encode(hdr+4, p); p += 5;
+        memset(p, 0x55, 9); p += 9;
+        memset(p, 0xFF, 5); p += 5;
+        blk[0] = 0x07;
+        blk[257] = 0;
+        for (int i = 0; i < 256; i++) {
+            blk[1+i] = data[i];
+            blk[257] ^= data[i];
+        }
+        blk[258] = blk[259] = 0;
+        for (int i = 0; i < 260; i += 4) {
+            _c1541_gcr_encode(blk+i, p); p += 5;
+        }
+        memset(p, 0x55, gap); p += gap;
+    }
+    memset(p, 0x55, size - (p - out));
+    return size;
+}
+
+/* decode the sectors found in a GCR track back into the D64 image */
+static void _c1541_d64_decode(c1541_disc_t* d, int track, const c1541_track_t* t) {
+    const int num_sectors = _c1541_d64_sectors(track);
+    uint8_t gcr[325];
+    uint8_t hdr[8];
+    uint8_t blk[260];
+    int sector = -1;
+    // walk the track once, plus the longest block after the last SYNC
+    for (int i = 1; i < (t->len + 325); i++) {
+        if ((t->data[(i-1) % t->len] != 0xFF) || (t->data[i % t->len] == 0xFF)) {
+            continue;
+        }
+        // a block starts after a SYNC
+        for (int j = 0; j < 325; j++) {
+            gcr[j] = t->data[(i+j) % t->len];
+        }
+        if (_c1541_gcr_decode(gcr, hdr) && (hdr[0] == 0x08)) {
+            _c1541_gcr_decode(gcr+5, hdr+4);
+            sector = (hdr[3] == track) && (hdr[2] < num_sectors) ? hdr[2] : -1;
+        }
+        else if ((sector != -1) && (hdr[0] == 0x07)) {
+            bool ok = true;
+            for (int j = 0; ok && (j < 65); j++) {
+                ok = _c1541_gcr_decode(gcr + j*5, blk + j*4);
+            }
+            if (ok) {
+                memcpy(d->image + _c1541_d64_offset(track, sector), blk+1, 256);
+            }
+            sector = -1;
+        }
+    }
+}
+
+/* offset of a G64 track in the image, 0 if there is no track data */
+static uint32_t _c1541_g64_track(const c1541_disc_t* d, int half_track) {
+    if (half_track >= d->num_tracks) {
+        return 0;
+    }
+    const uint32_t offset = _c1541_rd32(d->image + _C1541_G64_HEADER_SIZE + half_track*4);
+    if ((offset == 0) || ((offset + 2) > d->image_size)) {
+        return 0;
+    }
+    const uint16_t len = d->image[offset] | (d->image[offset+1] << 8);
+    if ((len > C1541_MAX_TRACK_SIZE) || ((offset + 2 + len) > d->image_size)) {
+        return 0;
+    }
+    return offset;
+}
+
+static void _c1541_track_load(c1541_disc_t* d, c1541_track_t* t, int half_track) {
+    t->valid = true;
+    t->dirty = false;
+    t->half_track = half_track;
+    t->len = 0;
+    if (d->g64) {
+        const uint32_t offset = _c1541_g64_track(d, half_track);
+        if (offset) {
+            t->len = d->image[offset] | (d->image[offset+1] << 8);
+            memcpy(t->data, d->image + offset + 2, t->len);
+        }
+    }
+    else if (!(half_track & 1) && ((half_track/2) < d->num_tracks)) {
+        // a D64 has nothing between tracks
+        t->len = _c1541_d64_encode(d, half_track/2 + 1, t->data);
+    }
+}
+
+static void _c1541_track_save(c1541_disc_t* d, c1541_track_t* t) {
+    if (t->valid && t->dirty) {
+        if (d->g64) {
+            memcpy(d->image + _c1541_g64_track(d, t->half_track) + 2, t->data, t->len);
+        }
+        else {
+            _c1541_d64_decode(d, t->half_track/2 + 1, t);
+        }
+        t->dirty = false;
+    }
+}
+
+/* the track under the head, GCR encoded the first time it's needed */
+static c1541_track_t* _c1541_track(c1541_disc_t* d) {
+    if (d->cur < 0) {
+        int victim = 0;
+        for (int i = 0; i < C1541_TRACK_CACHE_SIZE; i++) {
+            c1541_track_t* t = &d->cache[i];
+            if (t->valid && (t->half_track == d->half_track)) {
+                d->cur = i;
+                break;
+            }
+            if (!t->valid || (d->cache[victim].valid && (t->used < d->cache[victim].used))) {
+                victim = i;
+            }
+        }
+        if (d->cur < 0) {
+            _c1541_track_save(d, &d->cache[victim]);
+            _c1541_track_load(d, &d->cache[victim], d->half_track);
+            d->cur = victim;
+        }
+    }
+    c1541_track_t* t = &d->cache[d->cur];
+    t->used = ++d->lru;
+    return t;
+}
+
+/* turn the disc and move the head, as set by the VIA2 outputs of the
+   last tick, returns true when BYTE READY goes active
+*/
+static bool _c1541_disc_tick(c1541_disc_t* d, uint8_t pb, uint8_t pa, bool write) {
+    // the stepper motor moves the head by half a track for each phase
+    // step, the direction depends on the order of the phases
+    const uint8_t phase = pb & 3;
+    if (phase != d->phase) {
+        if ((phase == ((d->phase + 1) & 3)) && (d->half_track < (C1541_MAX_HALF_TRACKS-1))) {
+            d->half_track++;
+            d->cur = -1;
+        }
+        else if ((phase == ((d->phase - 1) & 3)) && (d->half_track > 0)) {
+            d->half_track--;
+            d->cur = -1;
+        }
+        d->phase = phase;
+    }
+    const bool motor = 0 != (pb & (1<<2));
+    if (motor != d->motor) {
+        d->motor = motor;
+        d->countdown = 1;
+        if (!motor && d->image) {
+            // the DOS is done with the disc
+            for (int i = 0; i < C1541_TRACK_CACHE_SIZE; i++) {
+                _c1541_track_save(d, &d->cache[i]);
+            }
+        }
+    }
+    if (!motor || !d->image || (--d->countdown > 0)) {
+        return false;
+    }
+    // bit rate zone 3 (the outer tracks) is 26 cycles per byte, zone 0 is 32
+    d->countdown = 32 - 2*((pb >> 5) & 3);
+    c1541_track_t* t = _c1541_track(d);
+    if (t->len == 0) {
+        d->sync = false;
+        return false;
+    }
+    if (d->pos >= t->len) {
+        d->pos = 0;
+    }
+    uint8_t b;
+    if (write) {
+        b = pa;
+        t->data[d->pos] = b;
+        t->dirty = true;
+        d->sync = false;
+    }
+    else {
+        b = t->data[d->pos];
+        d->sync = (b == 0xFF) && (d->prev == 0xFF);
+        d->data = b;
+    }
+    d->prev = b;
+    d->pos++;
+    return !d->sync;
+}
+
 void c1541_reset(c1541_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     sys->pins |= M6502_RES;
+    sys->iec_out = 0;
+    sys->sleeping = false;
     m6522_reset(&sys->via_1);
     m6522_reset(&sys->via_2);
 }
 
 void c1541_tick(c1541_t* sys) {
-    uint64_t pins = sys->pins;
+    const uint8_t iec = *sys->iec;
+    if (sys->sleeping) {
+        // the bus state to watch is only known after the system merged
+        // the last drive outputs into it
+        if (sys->sleep_iec == _C1541_IEC_UNKNOWN) {
+            sys->sleep_iec = iec;
+        }
+        if (iec == sys->sleep_iec) {
+            return;
+        }
+        sys->sleeping = false;
+    }
 
+    uint64_t pins = sys->pins;
     pins = m6502_tick(&sys->cpu, pins);
     const uint16_t addr = M6502_GET_ADDR(pins);
 
-    if (pins & M6502_RW) {
-        M6502_SET_DATA(pins, mem_rd(&sys->mem, addr));
+    // those pins are set each tick by the VIAs
+    pins &= ~(M6502_IRQ|M6502_NMI);
+
+    /* address decoding:
+
+        0000..07FF: 2 KB RAM (mirrored at 0800..0FFF)
+        1800..1BFF: VIA1 (serial bus), registers mirrored
+        1C00..1FFF: VIA2 (disk controller), registers mirrored
+        C000..FFFF: 16 KB ROM
+    */
+    bool mem_access = false;
+    uint64_t via1_pins = pins & M6502_PIN_MASK;
+    uint64_t via2_pins = pins & M6502_PIN_MASK;
+    if ((addr & 0xFC00) == 0x1800) {
+        via1_pins |= M6522_CS1;
+    }
+    else if ((addr & 0xFC00) == 0x1C00) {
+        via2_pins |= M6522_CS1;
     }
     else {
-        mem_wr(&sys->mem, addr, M6502_GET_DATA(pins));
+        mem_access = true;
     }
 
+    /* tick VIA1, connected to the IEC serial bus, the ATN line also
+       goes to CA1 to raise an interrupt when the C64 wants to talk
+    */
+    {
+        uint8_t pb = 0;
+        if (iec & C1541_IECPORT_DATA) {
+            pb |= (1<<0);
+        }
+        if (iec & C1541_IECPORT_CLK) {
+            pb |= (1<<2);
+        }
+        if (iec & C1541_IECPORT_ATN) {
+            pb |= (1<<7);
+            via1_pins |= M6522_CA1;
+        }
+        M6522_SET_PAB(via1_pins, 0xFF, pb);
+        via1_pins = m6522_tick(&sys->via_1, via1_pins);
+        const uint8_t out = sys->via_1.pb.outr & sys->via_1.pb.ddr;
+        const bool atn = 0 != (iec & C1541_IECPORT_ATN);
+        const bool atna = 0 != (out & (1<<4));
+        uint8_t iec_out = 0;
+        if ((out & (1<<1)) || (atn != atna)) {
+            iec_out |= C1541_IECPORT_DATA;
+        }
+        if (out & (1<<3)) {
+            iec_out |= C1541_IECPORT_CLK;
+        }
+        sys->iec_out = iec_out;
+        if (via1_pins & M6502_IRQ) {
+            pins |= M6502_IRQ;
+        }
+        if ((via1_pins & (M6522_CS1|M6522_RW)) == (M6522_CS1|M6522_RW)) {
+            pins = M6502_COPY_DATA(pins, via1_pins);
+        }
+    }
+
+    /* tick VIA2, the disk controller:
+
+        PB0..1: head stepper motor
+        PB2:    spindle motor on
+        PB3:    drive LED
+        PB4:    write protect sense (0: protected)
+        PB5..6: bit rate zone
+        PB7:    SYNC detected (0: found)
+        PA:     byte read from or written to the disk
+
+        CA1:    BYTE READY
+        CA2:    BYTE READY to the CPU SO pin enable
+        CB2:    read (1) or write (0) mode
+
+       the disc is never write protected, the caller decides where
+       changes go when mapping the image
+    */
+    {
+        c1541_disc_t* d = &sys->disc;
+        M6522_SET_PAB(via2_pins, d->data, (d->sync ? 0 : (1<<7)) | (1<<4));
+        if (d->byte_ready) {
+            via2_pins |= M6522_CA1;
+        }
+        via2_pins = m6522_tick(&sys->via_2, via2_pins);
+        const uint8_t pb = sys->via_2.pb.outr & sys->via_2.pb.ddr;
+        const uint8_t pa = sys->via_2.pa.outr & sys->via_2.pa.ddr;
+        d->byte_ready = _c1541_disc_tick(d, pb, pa, !(via2_pins & M6522_CB2));
+        if (d->byte_ready && (via2_pins & M6522_CA2)) {
+            sys->cpu.P |= M6502_VF;
+        }
+        if (via2_pins & M6502_IRQ) {
+            pins |= M6502_IRQ;
+        }
+        if ((via2_pins & (M6522_CS1|M6522_RW)) == (M6522_CS1|M6522_RW)) {
+            pins = M6502_COPY_DATA(pins, via2_pins);
+        }
+    }
+
+    if (mem_access) {
+        if (pins & M6502_RW) {
+            M6502_SET_DATA(pins, mem_rd(&sys->mem, addr));
+        }
+        else {
+            mem_wr(&sys->mem, addr, M6502_GET_DATA(pins));
+        }
+    }
+
+    /* suspend the drive when it's waiting for commands in the DOS idle loop */
+    if ((pins & M6502_SYNC) && (addr == C1541_IDLE_PC) &&
+        !(iec & C1541_IECPORT_ATN) &&
+        !(sys->via_2.pb.outr & sys->via_2.pb.ddr & (1<<2)))
+    {
+        sys->sleeping = true;
+        sys->sleep_iec = _C1541_IEC_UNKNOWN;
+    }
     sys->pins = pins;
 }
 
-void c1541_insert_disc(c1541_t* sys, chips_range_t data) {
-    // FIXME
-    (void)sys;
-    (void)data;
+bool c1541_insert_disc(c1541_t* sys, chips_range_t data) {
+    CHIPS_ASSERT(sys && sys->valid && data.ptr);
+    c1541_disc_t* d = &sys->disc;
+    c1541_remove_disc(sys);
+    const uint8_t* p = (const uint8_t*) data.ptr;
+    if ((data.size >= _C1541_G64_HEADER_SIZE) && (0 == memcmp(p, "GCR-1541", 8))) {
+        if ((p[9] > C1541_MAX_HALF_TRACKS) ||
+            (data.size < (size_t)(_C1541_G64_HEADER_SIZE + p[9]*8)))
+        {
+            return false;
+        }
+        d->g64 = true;
+        d->num_tracks = p[9];
+    }
+    else if ((data.size == _C1541_D64_SIZE) || (data.size == _C1541_D64_SIZE + 683)) {
+        d->g64 = false;
+        d->num_tracks = _C1541_D64_TRACKS;
+    }
+    else if ((data.size == _C1541_D64_SIZE_40) || (data.size == _C1541_D64_SIZE_40 + 768)) {
+        d->g64 = false;
+        d->num_tracks = 40;
+    }
+    else {
+        return false;
+    }
+    d->image = (uint8_t*) data.ptr;
+    d->image_size = data.size;
+    d->pos = 0;
+    d->cur = -1;
+    return true;
+}
+
+void c1541_flush_disc(c1541_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    c1541_disc_t* d = &sys->disc;
+    if (d->image) {
+        for (int i = 0; i < C1541_TRACK_CACHE_SIZE; i++) {
+            _c1541_track_save(d, &d->cache[i]);
+        }
+    }
 }
 
 void c1541_remove_disc(c1541_t* sys) {
-    // FIXME
-    (void)sys;
+    CHIPS_ASSERT(sys && sys->valid);
+    c1541_disc_t* d = &sys->disc;
+    c1541_flush_disc(sys);
+    for (int i = 0; i < C1541_TRACK_CACHE_SIZE; i++) {
+        d->cache[i].valid = false;
+    }
+    d->image = 0;
+    d->image_size = 0;
+    d->cur = -1;
+    d->sync = false;
+    d->byte_ready = false;
+}
+
+void c1541_relocate(c1541_t* sys, uint8_t* iec_port) {
+    CHIPS_ASSERT(sys && sys->valid && iec_port);
+    sys->iec = iec_port;
+    _c1541_init_memory_map(sys, &sys->mem);
 }
 
-void c1541_snapshot_onsave(c1541_t* snapshot, void* base) {
-    CHIPS_ASSERT(snapshot && base);
+void c1541_snapshot_onsave(c1541_t* snapshot) {
+    CHIPS_ASSERT(snapshot);
     snapshot->iec = 0;
+    snapshot->disc.image = 0;
+    // the memory map never changes, it is rebuilt on load
+    snapshot->rom_c000 = snapshot->rom_e000 = 0;
+    mem_init(&snapshot->mem);
     m6502_snapshot_onsave(&snapshot->cpu);
-    mem_snapshot_onsave(&snapshot->mem, base);
 }
 
-void c1541_snapshot_onload(c1541_t* snapshot, c1541_t* sys, void* base) {
-    CHIPS_ASSERT(snapshot && sys && base);
+void c1541_snapshot_onload(c1541_t* snapshot, c1541_t* sys) {
+    CHIPS_ASSERT(snapshot && sys);
     snapshot->iec = sys->iec;
+    snapshot->rom_c000 = sys->rom_c000;
+    snapshot->rom_e000 = sys->rom_e000;
+    _c1541_init_memory_map(sys, &snapshot->mem);
+    // the disc in the drive is not part of the snapshot, only the head is
+    snapshot->disc.image = sys->disc.image;
+    snapshot->disc.image_size = sys->disc.image_size;
+    snapshot->disc.g64 = sys->disc.g64;
+    snapshot->disc.num_tracks = sys->disc.num_tracks;
+    snapshot->disc.lru = sys->disc.lru;
+    snapshot->disc.cur = -1;
+    memcpy(snapshot->disc.cache, sys->disc.cache, sizeof(sys->disc.cache));
     m6502_snapshot_onload(&snapshot->cpu, &sys->cpu);
-    mem_snapshot_onload(&snapshot->mem, base);
 }
 
 #endif // CHIPS_IMPL
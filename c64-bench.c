@@ -0,0 +1,308 @@
+/* c64-bench.c
+ * Measure the emulation speed with every combination of the features
+ * the tick loop is specialized for: debug callback, audio callback,
+ * video output and floppy drive.
+ *
+ * The machine boots, runs the demo included with the emulator, and the
+ * speed is reported relative to a real PAL C64. The drive is only
+ * benchmarked if a 1541 ROM is given:
+ *
+ *   ./c64-bench [--frames <count>] [--1541-rom <file>]
+ *               [--accuracy cycle|line|frame] [--cache] [--video-thread]
+ *
+ * With --cache the L1 data cache and last level cache read misses per
+ * emulated frame are reported too, using the Linux perf counters, when
+ * the host provides them.
+ *
+ * With --video-thread the pixels are composed by the video thread of
+ * video.c, and the speed is also reported relative to the CPU time used
+ * by the emulation thread alone, that is what a host with a free core
+ * for the video thread gets.
+ *
+ * Build with "make bench". The c64-bench-generic binary built along with
+ * it uses a single tick loop checking the features at runtime, for
+ * comparison. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define CHIPS_IMPL
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+#include "c64-roms.h"
+#include "c64-kitty.h"
+
+#define BENCH_FRAME_USEC 20000
+#define BENCH_LOAD_FRAME 150    // Boot first, then load the demo.
+#define BENCH_PRG "a_mind_is_born.prg"
+
+#define BENCH_DEBUG (1<<0)
+#define BENCH_AUDIO (1<<1)
+#define BENCH_VIDEO (1<<2)
+#define BENCH_DRIVE (1<<3)
+#define BENCH_COMBINATIONS 16
+
+static c64_t C64;
+static uint8_t Framebuffer[_C64_SCREEN_WIDTH*_C64_SCREEN_HEIGHT*3];
+static uint8_t DriveRom[0x4000];
+static uint8_t Prg[0x10000];
+static size_t PrgLen = 0;
+static int Accuracy = -1;     // C64_ACCURACY_*, -1 until parsed.
+static bool Cache = false;
+static bool VideoThread = false;
+static bool DebugStopped = false;
+static uint64_t Sink = 0;   // Keeps the callbacks from being optimized out.
+
+static void bench_debug(void *user_data, uint64_t pins) {
+    (void)user_data;
+    Sink += pins & 1;
+}
+
+static void bench_audio(const float *samples, int num_samples,
+                        void *user_data)
+{
+    (void)user_data;
+    Sink += (samples[0] > 0) + num_samples;
+}
+
+static void bench_pixel(void *fbptr, int x, int y, uint32_t c) {
+    if (x < 0 || x >= _C64_SCREEN_WIDTH || y < 0 || y >= _C64_SCREEN_HEIGHT)
+        return;
+    uint8_t *p = (uint8_t*)fbptr + (y*_C64_SCREEN_WIDTH + x)*3;
+    p[0] = c;
+    p[1] = c >> 8;
+    p[2] = c >> 16;
+}
+
+static uint64_t time_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Cache miss counters, see cache_open(). */
+#define CACHE_L1D 0
+#define CACHE_LL 1
+#define CACHE_COUNTERS 2
+static int CacheFd[CACHE_COUNTERS] = {-1, -1};
+
+/* Open the L1 data cache and last level cache read miss counters for this
+ * process. Returns 0 on success, -1 if the host does not provide them, as
+ * it is often the case inside virtual machines. */
+static int cache_open(void) {
+#ifdef __linux__
+    static const uint64_t cache[CACHE_COUNTERS] = {
+        PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_LL
+    };
+    for (int j = 0; j < CACHE_COUNTERS; j++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache[j] |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        CacheFd[j] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (CacheFd[j] == -1) return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Reset and enable the cache counters (if enable is true), or disable them
+ * and store their values in 'misses' (if enable is false). */
+static void cache_count(bool enable, uint64_t *misses) {
+#ifdef __linux__
+    for (int j = 0; j < CACHE_COUNTERS; j++) {
+        if (CacheFd[j] == -1) continue;
+        if (enable) {
+            ioctl(CacheFd[j], PERF_EVENT_IOC_RESET, 0);
+            ioctl(CacheFd[j], PERF_EVENT_IOC_ENABLE, 0);
+        } else {
+            ioctl(CacheFd[j], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(CacheFd[j], &misses[j], sizeof(misses[j])) !=
+                sizeof(misses[j])) misses[j] = 0;
+        }
+    }
+#else
+    (void)enable;
+    (void)misses;
+#endif
+}
+
+/* Run the benchmark with the features in 'features', returning how many
+ * times faster than a real C64 the emulation was. If the cache counters
+ * are open, the read misses during the run are stored in 'misses'. The
+ * speed relative to the CPU time of this thread is stored in 'cpu_speed'. */
+static double bench_run(int features, int frames, uint64_t *misses,
+                        double *cpu_speed)
+{
+    c64_desc_t desc = {0};
+    desc.roms.chars.ptr = dump_c64_char_bin;
+    desc.roms.chars.size = sizeof(dump_c64_char_bin);
+    desc.roms.basic.ptr = dump_c64_basic_bin;
+    desc.roms.basic.size = sizeof(dump_c64_basic_bin);
+    desc.roms.kernal.ptr = dump_c64_kernalv3_bin;
+    desc.roms.kernal.size = sizeof(dump_c64_kernalv3_bin);
+    desc.accuracy = (c64_accuracy_t)Accuracy;
+    desc.video_threaded = VideoThread && (features & BENCH_VIDEO);
+    if (features & BENCH_DEBUG) {
+        desc.debug.callback.func = bench_debug;
+        desc.debug.stopped = &DebugStopped;
+    }
+    if (features & BENCH_AUDIO) desc.audio.callback.func = bench_audio;
+    if (features & BENCH_VIDEO) {
+        desc.crt_set_pixel = bench_pixel;
+        desc.crt_set_pixel_fb = Framebuffer;
+    }
+    if (features & BENCH_DRIVE) {
+        desc.c1541_enabled = true;
+        desc.roms.c1541.c000_dfff.ptr = DriveRom;
+        desc.roms.c1541.c000_dfff.size = 0x2000;
+        desc.roms.c1541.e000_ffff.ptr = DriveRom + 0x2000;
+        desc.roms.c1541.e000_ffff.size = 0x2000;
+    }
+    c64_init(&C64, &desc);
+    if (desc.video_threaded && video_thread_start(&C64) == -1) {
+        fprintf(stderr, "Can't start the video thread\n");
+        exit(1);
+    }
+
+    if (Cache) cache_count(true, misses);
+    uint64_t start = time_us(CLOCK_MONOTONIC);
+    uint64_t cpu_start = time_us(CLOCK_THREAD_CPUTIME_ID);
+    for (int j = 0; j < frames; j++) {
+        if (j == BENCH_LOAD_FRAME && PrgLen) {
+            c64_quickload(&C64, (chips_range_t){ .ptr = Prg, .size = PrgLen });
+            c64_basic_run(&C64);
+        }
+        c64_exec(&C64, BENCH_FRAME_USEC);
+    }
+    uint64_t elapsed = time_us(CLOCK_MONOTONIC) - start;
+    uint64_t cpu_elapsed = time_us(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    if (Cache) cache_count(false, misses);
+    if (desc.video_threaded) video_thread_stop();
+    if (elapsed == 0) elapsed = 1;
+    if (cpu_elapsed == 0) cpu_elapsed = 1;
+    *cpu_speed = (double)frames * BENCH_FRAME_USEC / cpu_elapsed;
+    return (double)frames * BENCH_FRAME_USEC / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int frames = 1000;
+    int drive = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int leftargs = argc-j-1;
+        if (!strcasecmp(argv[j],"--frames") && leftargs) {
+            frames = atoi(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--1541-rom") && leftargs) {
+            FILE *fp = fopen(argv[++j], "rb");
+            if (fp == NULL || fread(DriveRom, 1, sizeof(DriveRom), fp) !=
+                              sizeof(DriveRom))
+            {
+                fprintf(stderr, "Can't read the 16k 1541 ROM %s\n", argv[j]);
+                return 1;
+            }
+            fclose(fp);
+            drive = 1;
+        } else if (!strcasecmp(argv[j],"--accuracy") && leftargs) {
+            j++;
+            if (!strcasecmp(argv[j],"cycle")) {
+                Accuracy = C64_ACCURACY_CYCLE;
+            } else if (!strcasecmp(argv[j],"line")) {
+                Accuracy = C64_ACCURACY_LINE;
+            } else if (!strcasecmp(argv[j],"frame")) {
+                Accuracy = C64_ACCURACY_FRAME;
+            } else {
+                fprintf(stderr, "Unknown accuracy %s\n", argv[j]);
+                return 1;
+            }
+        } else if (!strcasecmp(argv[j],"--cache")) {
+            Cache = true;
+        } else if (!strcasecmp(argv[j],"--video-thread")) {
+            VideoThread = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--frames <count>] "
+                            "[--1541-rom <file>] "
+                            "[--accuracy cycle|line|frame] [--cache] "
+                            "[--video-thread]\n",
+                            argv[0]);
+            return 1;
+        }
+    }
+    // The cycle by cycle decoding can't be threaded.
+    if (VideoThread && Accuracy == C64_ACCURACY_CYCLE) {
+        fprintf(stderr, "--video-thread requires --accuracy line or frame\n");
+        return 1;
+    }
+    if (Accuracy == -1)
+        Accuracy = VideoThread ? C64_ACCURACY_LINE : C64_ACCURACY_CYCLE;
+
+    FILE *fp = fopen(BENCH_PRG, "rb");
+    if (fp) {
+        PrgLen = fread(Prg, 1, sizeof(Prg), fp);
+        fclose(fp);
+    } else {
+        fprintf(stderr, "%s not found, benchmarking the idle machine\n",
+            BENCH_PRG);
+    }
+
+    if (Cache && cache_open() == -1) {
+        fprintf(stderr, "Cache miss counters not available on this host\n");
+        Cache = false;
+    }
+
+    printf("%d frames, speed relative to a real C64%s\n\n", frames,
+        Cache ? ", read misses per frame" : "");
+    printf("debug audio video drive    speed%s%s\n",
+        VideoThread ? "  cpu speed" : "",
+        Cache ? "   L1D misses    LL misses" : "");
+    for (int features = 0; features < BENCH_COMBINATIONS; features++) {
+        if ((features & BENCH_DRIVE) && !drive) continue;
+        uint64_t misses[CACHE_COUNTERS] = {0};
+        double cpu_speed;
+        double speed = bench_run(features, frames, misses, &cpu_speed);
+        printf("%-5s %-5s %-5s %-5s %7.2fx",
+            (features & BENCH_DEBUG) ? "on" : "off",
+            (features & BENCH_AUDIO) ? "on" : "off",
+            (features & BENCH_VIDEO) ? "on" : "off",
+            (features & BENCH_DRIVE) ? "on" : "off",
+            speed);
+        if (VideoThread) printf("   %7.2fx", cpu_speed);
+        if (Cache) {
+            printf(" %12.0f %12.0f",
+                (double)misses[CACHE_L1D] / frames,
+                (double)misses[CACHE_LL] / frames);
+        }
+        printf("\n");
+    }
+    return Sink == 0xFFFFFFFF;  // Never true, but the compiler can't know.
+}
@@ -0,0 +1,215 @@
+/* c64-damage.c
+ * Check the screen damage reported by c64_damage() against the pixels
+ * that actually change: the frontends only redraw the lines it reports,
+ * so a change it misses stays on the viewers' screens until something
+ * else redraws that line.
+ *
+ * The machine boots and types each of a set of BASIC programs exercising
+ * the text screen, the colors, the bitmap mode and the sprites (moving,
+ * changing shape, color, size and priority while being drawn), or loads
+ * and runs the PRG files given, once for every accuracy tier. After each
+ * frame the framebuffer is compared with the previous one, and a line
+ * that changed outside the damage is reported as a miss:
+ *
+ *   ./c64-damage [--frames <count>] [--accuracy cycle|line|frame]
+ *                [<file.prg> ...]
+ *
+ * The exit code is 1 if there was any miss. Build with "make damage". */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define CHIPS_IMPL
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+#include "c64-roms.h"
+
+#define DAMAGE_FRAME_USEC 20000
+#define DAMAGE_LOAD_FRAME 150   // Boot first, then type or load the program.
+#define DAMAGE_KEY_FRAMES 3     // Frames between two typed keys.
+#define DAMAGE_MAX_REPORTS 5    // Misses printed for each run.
+
+#define LINE_BYTES (_C64_SCREEN_WIDTH*3)
+#define FB_BYTES (LINE_BYTES*_C64_SCREEN_HEIGHT)
+
+/* The programs typed in, all starting with a sprite of solid pixels. */
+#define SPRITE "10 V=53248:POKEV+21,1:POKE2040,13:" \
+               "FORI=832TO894:POKEI,255:NEXT\n"
+static const struct {
+    const char *name;
+    const char *text;
+} Programs[] = {
+    {"text scroll", "10 PRINT RND(1):GOTO10\nRUN\n"},
+    {"colors",
+     "10 POKE53280,RND(1)*16:POKE53281,RND(1)*16:GOTO10\nRUN\n"},
+    {"bitmap",
+     "10 POKE53272,24:POKE53265,59:"
+     "FORI=8192TO8192+7999STEP7:POKEI,RND(1)*255:NEXT\nRUN\n"},
+    {"sprite move", SPRITE
+     "20 FORY=0TO255:POKEV+1,Y:POKEV,Y:POKEV+39,YAND15:NEXT:GOTO20\n"
+     "RUN\n"},
+    {"sprite data", SPRITE
+     "15 POKEV+1,240:POKEV+23,1\n"
+     "20 POKE832+RND(1)*63,RND(1)*255:GOTO20\nRUN\n"},
+    {"sprite pointer", SPRITE
+     "15 POKEV+1,30:FORI=896TO958:POKEI,RND(1)*255:NEXT\n"
+     "20 POKE2040,13+(RND(1)>.5):GOTO20\nRUN\n"},
+    {"sprite bits", SPRITE
+     "15 POKEV+1,100\n"
+     "20 POKEV+16,RND(1)*2:POKEV+28,RND(1)*2:POKEV+21,RND(1)*2:"
+     "POKEV+37,RND(1)*16:GOTO20\nRUN\n"},
+    {"sprite priority", SPRITE
+     "15 POKEV+1,200:POKEV+23,1\n"
+     "20 POKEV+21,RND(1)*2:POKEV+29,RND(1)*2:POKEV+27,RND(1)*2:"
+     "POKE1024+RND(1)*999,RND(1)*255:GOTO20\nRUN\n"},
+};
+#define NUM_PROGRAMS (int)(sizeof(Programs)/sizeof(Programs[0]))
+
+static const char *AccuracyNames[] = {"cycle", "line", "frame"};
+
+static c64_t C64;
+static uint8_t Framebuffer[FB_BYTES];
+static uint8_t PrevFramebuffer[FB_BYTES];
+static uint8_t Prg[0x10000];
+
+static void damage_pixel(void *fbptr, int x, int y, uint32_t c) {
+    if (x < 0 || x >= _C64_SCREEN_WIDTH || y < 0 || y >= _C64_SCREEN_HEIGHT)
+        return;
+    uint8_t *p = (uint8_t*)fbptr + (y*_C64_SCREEN_WIDTH + x)*3;
+    p[0] = c;
+    p[1] = c >> 8;
+    p[2] = c >> 16;
+}
+
+/* Run 'text' (typed in, if 'prg_len' is zero) or the PRG image in 'Prg'
+ * for 'frames' frames with the accuracy 'accuracy', checking the damage
+ * of every frame. Returns the number of changed lines that were not
+ * reported as damaged. */
+static long damage_run(const char *name, const char *text, size_t prg_len,
+                       c64_accuracy_t accuracy, int frames)
+{
+    c64_desc_t desc = {0};
+    desc.roms.chars.ptr = dump_c64_char_bin;
+    desc.roms.chars.size = sizeof(dump_c64_char_bin);
+    desc.roms.basic.ptr = dump_c64_basic_bin;
+    desc.roms.basic.size = sizeof(dump_c64_basic_bin);
+    desc.roms.kernal.ptr = dump_c64_kernalv3_bin;
+    desc.roms.kernal.size = sizeof(dump_c64_kernalv3_bin);
+    desc.accuracy = accuracy;
+    desc.crt_set_pixel = damage_pixel;
+    desc.crt_set_pixel_fb = Framebuffer;
+    c64_init(&C64, &desc);
+    memset(Framebuffer, 0, sizeof(Framebuffer));
+    memset(PrevFramebuffer, 0, sizeof(PrevFramebuffer));
+
+    long all = 0, partial = 0, lines = 0, missed = 0;
+    for (int j = 0; j < frames; j++) {
+        if (j == DAMAGE_LOAD_FRAME && prg_len) {
+            c64_quickload(&C64, (chips_range_t){ .ptr = Prg, .size = prg_len });
+            c64_basic_run(&C64);
+        } else if (j >= DAMAGE_LOAD_FRAME && !prg_len && *text &&
+                   (j % DAMAGE_KEY_FRAMES) == 0)
+        {
+            int key = *text++;
+            if (key == '\n') key = C64_KEY_RETURN;
+            c64_key_down(&C64, key);
+            c64_key_up(&C64, key);
+        }
+        c64_exec(&C64, DAMAGE_FRAME_USEC);
+
+        uint32_t damage = c64_damage(&C64);
+        int y0 = 0, y1 = 0;
+        bool damaged = c64_damage_lines(damage, &y0, &y1);
+        if (damage & C64_DAMAGE_ALL) {
+            all++;
+        } else if (damaged) {
+            partial++;
+            lines += y1-y0;
+        }
+        for (int y = 0; y < _C64_SCREEN_HEIGHT; y++) {
+            if (damaged && y >= y0 && y < y1) continue;
+            if (memcmp(Framebuffer+y*LINE_BYTES, PrevFramebuffer+y*LINE_BYTES,
+                       LINE_BYTES) == 0) continue;
+            if (missed < DAMAGE_MAX_REPORTS) {
+                printf("  frame %d: line %d changed, damage %08x "
+                       "(lines %d..%d)\n", j, y, damage, y0, y1);
+            }
+            missed++;
+        }
+        memcpy(PrevFramebuffer, Framebuffer, sizeof(Framebuffer));
+    }
+    c64_discard(&C64);
+    printf("%-16s %-5s all %5ld  partial %5ld (%3ld lines)  missed %ld\n",
+        name, AccuracyNames[accuracy], all, partial,
+        partial ? lines/partial : 0, missed);
+    return missed;
+}
+
+int main(int argc, char **argv) {
+    int frames = 1200;
+    int accuracy = -1;      // All the tiers.
+    int first_prg = argc;
+
+    for (int j = 1; j < argc; j++) {
+        int leftargs = argc-j-1;
+        if (!strcasecmp(argv[j],"--frames") && leftargs) {
+            frames = atoi(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--accuracy") && leftargs) {
+            j++;
+            for (accuracy = 0; accuracy < 3; accuracy++)
+                if (!strcasecmp(argv[j],AccuracyNames[accuracy])) break;
+            if (accuracy == 3) {
+                fprintf(stderr, "Unknown accuracy %s\n", argv[j]);
+                return 1;
+            }
+        } else if (argv[j][0] != '-') {
+            first_prg = j;
+            break;
+        } else {
+            fprintf(stderr, "Usage: %s [--frames <count>] "
+                            "[--accuracy cycle|line|frame] "
+                            "[<file.prg> ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    long missed = 0;
+    for (int acc = 0; acc < 3; acc++) {
+        if (accuracy != -1 && acc != accuracy) continue;
+        if (first_prg == argc) {
+            for (int j = 0; j < NUM_PROGRAMS; j++) {
+                missed += damage_run(Programs[j].name, Programs[j].text, 0,
+                                     (c64_accuracy_t)acc, frames);
+            }
+        }
+        for (int j = first_prg; j < argc; j++) {
+            FILE *fp = fopen(argv[j], "rb");
+            if (fp == NULL) {
+                perror(argv[j]);
+                return 1;
+            }
+            size_t len = fread(Prg, 1, sizeof(Prg), fp);
+            fclose(fp);
+            const char *name = strrchr(argv[j], '/');
+            missed += damage_run(name ? name+1 : argv[j], "", len,
+                                 (c64_accuracy_t)acc, frames);
+        }
+    }
+    printf("%s\n", missed ? "Damage missed changed lines" : "All changes were in the damage");
+    return missed != 0;
+}
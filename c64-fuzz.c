@@ -0,0 +1,194 @@
+/* c64-fuzz.c
+ * Fuzzing harness for the chips emulation and the loaders.
+ *
+ * The machine is booted once, up to the READY prompt, and a copy of it is
+ * taken. Every input is then injected into the booted machine, that runs
+ * for a bounded number of cycles, and finally the machine is restored with
+ * c64_restore_dirty(): only the RAM pages the run touched are copied back,
+ * so an iteration costs the emulated cycles plus a few microseconds.
+ *
+ * The first byte of the input selects how the rest is used:
+ *
+ *   0  A PRG file: quickloaded, then started with RUN or SYS.
+ *   1  Keystrokes: each byte is a key code, held down for a few frames.
+ *   2  Memory patches: address low, address high, length, bytes..., then
+ *      the CPU is started at the first patched address.
+ *
+ * Build with "make fuzz" for a standalone binary that reads one input
+ * from each file given as argument, or from stdin (AFL style), and
+ * checks the restored machine is identical to the booted one. Build with
+ * "make fuzz-libfuzzer" (clang) to get a libFuzzer target. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CHIPS_IMPL
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+#include "c64-roms.h"
+
+#define FUZZ_BOOT_CYCLES (C64_FREQUENCY*3)  // Enough to reach READY.
+#define FUZZ_RUN_CYCLES (C64_FREQUENCY/5)   // Budget for every input.
+#define FUZZ_KEY_CYCLES (C64_FREQUENCY/25)  // Each key is held that long.
+#define FUZZ_MAX_KEYS (FUZZ_RUN_CYCLES/FUZZ_KEY_CYCLES)
+
+#define FUZZ_MODE_PRG 0
+#define FUZZ_MODE_KEYS 1
+#define FUZZ_MODE_PATCH 2
+#define FUZZ_MODES 3
+
+static c64_t C64;
+static c64_t Base;      // The booted machine every input starts from.
+static int Booted = 0;
+
+static void fuzz_boot(void) {
+    c64_desc_t desc = {0};
+    desc.roms.chars.ptr = dump_c64_char_bin;
+    desc.roms.chars.size = sizeof(dump_c64_char_bin);
+    desc.roms.basic.ptr = dump_c64_basic_bin;
+    desc.roms.basic.size = sizeof(dump_c64_basic_bin);
+    desc.roms.kernal.ptr = dump_c64_kernalv3_bin;
+    desc.roms.kernal.size = sizeof(dump_c64_kernalv3_bin);
+    c64_init(&C64, &desc);
+    c64_exec_ticks(&C64, FUZZ_BOOT_CYCLES);
+    C64.ram_dirty = 0;
+    Base = C64;
+    Booted = 1;
+}
+
+/* Continue execution at 'addr', by simulating an opcode fetch from
+ * there (see the m6502.h documentation). */
+static void fuzz_jump(c64_t *c64, uint16_t addr) {
+    uint64_t pins = M6502_SYNC;
+    M6502_SET_ADDR(pins, addr);
+    M6502_SET_DATA(pins, mem_rd(&c64->mem_cpu, addr));
+    m6502_set_pc(&c64->cpu, addr);
+    c64->pins = pins;
+}
+
+static void fuzz_run_prg(const uint8_t *data, size_t size) {
+    if (size < 2) return;
+    if (!c64_quickload(&C64, (chips_range_t){ .ptr = (void*)data,
+                                             .size = size })) return;
+    uint16_t addr = data[0] | (data[1] << 8);
+    if (addr == 0x801) {
+        c64_basic_run(&C64);
+    } else {
+        c64_basic_syscall(&C64, addr);
+    }
+    c64_exec_ticks(&C64, FUZZ_RUN_CYCLES);
+}
+
+static void fuzz_run_keys(const uint8_t *data, size_t size) {
+    if (size > FUZZ_MAX_KEYS) size = FUZZ_MAX_KEYS;
+    for (size_t j = 0; j < size; j++) {
+        c64_key_down(&C64, data[j]);
+        c64_exec_ticks(&C64, FUZZ_KEY_CYCLES/2);
+        c64_key_up(&C64, data[j]);
+        c64_exec_ticks(&C64, FUZZ_KEY_CYCLES/2);
+    }
+}
+
+static void fuzz_run_patch(const uint8_t *data, size_t size) {
+    int start = -1;
+
+    while (size >= 3) {
+        uint16_t addr = data[0] | (data[1] << 8);
+        size_t len = data[2];
+        data += 3;
+        size -= 3;
+        if (len > size) len = size;
+        if (start == -1) start = addr;
+        for (size_t j = 0; j < len; j++) {
+            uint16_t a = addr+j;
+            C64.ram[a] = data[j];
+            C64.ram_dirty |= 1ULL << (a >> 10);
+        }
+        data += len;
+        size -= len;
+    }
+    if (start == -1) return;
+    fuzz_jump(&C64, start);
+    c64_exec_ticks(&C64, FUZZ_RUN_CYCLES);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (!Booted) fuzz_boot();
+    if (size == 0) return 0;
+
+    switch (data[0] % FUZZ_MODES) {
+    case FUZZ_MODE_PRG: fuzz_run_prg(data+1, size-1); break;
+    case FUZZ_MODE_KEYS: fuzz_run_keys(data+1, size-1); break;
+    case FUZZ_MODE_PATCH: fuzz_run_patch(data+1, size-1); break;
+    }
+    c64_restore_dirty(&C64, &Base);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+/* Run a single input, then check the restore really brought the
+ * machine back to the booted state: a page written without setting its
+ * dirty bit would make every later input start from a different machine.
+ * Returns 0 on success, 1 on mismatch. */
+static int fuzz_one(const uint8_t *data, size_t size) {
+    LLVMFuzzerTestOneInput(data, size);
+    if (memcmp(&C64, &Base, sizeof(C64)) != 0) {
+        fprintf(stderr, "Machine not restored to the booted state\n");
+        return 1;
+    }
+    return 0;
+}
+
+static uint8_t *read_file(FILE *fp, size_t *size) {
+    size_t alloc = 65536, len = 0;
+    uint8_t *buf = malloc(alloc);
+    size_t n;
+
+    while ((n = fread(buf+len, 1, alloc-len, fp)) > 0) {
+        len += n;
+        if (len == alloc) buf = realloc(buf, alloc *= 2);
+    }
+    *size = len;
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    size_t size;
+    uint8_t *data;
+    int err = 0;
+
+    if (argc == 1) {
+        data = read_file(stdin, &size);
+        err = fuzz_one(data, size);
+        free(data);
+        return err;
+    }
+
+    for (int j = 1; j < argc; j++) {
+        FILE *fp = fopen(argv[j], "rb");
+        if (fp == NULL) {
+            perror(argv[j]);
+            return 1;
+        }
+        data = read_file(fp, &size);
+        fclose(fp);
+        err |= fuzz_one(data, size);
+        free(data);
+    }
+    return err;
+}
+#endif
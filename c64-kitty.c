@@ -13,8 +13,14 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <assert.h>
+#include <errno.h>
+
+#include "c64-kitty.h"
 
 /* Global configuration (mostly from command line options). */
 struct {
@@ -27,12 +33,36 @@ struct {
     float zoom;         // C64 display zoom level.
     int width_chars;    // C64 display width in characters.
     int height_chars;   // C64 display height in characters.
+    char *listen_path;  // Unix socket where viewers can attach, or NULL.
+    char *attach_path;  // Attach as a viewer to this socket, or NULL.
+    int observe;        // When attaching, don't send keystrokes.
+    int lag_policy;     // When attaching, what to do if we lag behind.
+    int daemonize;      // Run in background, only serving viewers.
+    int audio;          // Play audio, if compiled with audio support.
+    char *shm_name;     // Shared memory segment to export state, or NULL.
+    char *control_path; // Unix socket accepting control commands, or NULL.
+    int headless;       // No terminal, no realtime: run only on commands.
+    char *drive_rom;    // 1541 ROM image, enables the drive, or NULL.
+    int drive_thread;   // Tick the 1541 drive on its own thread.
+    int video_thread;   // Compose the screen pixels on their own thread.
+    char *disk;         // D64/G64 image to insert in the drive, or NULL.
+    char *cart;         // CRT cartridge image to plug in, or NULL.
+    int reu_kb;         // REU memory size in KB, 0 for no REU.
+    int accuracy;       // Emulation accuracy, one of C64_ACCURACY_*, or -1.
+    int traps;          // Native BASIC/KERNAL routines in the frame tier.
+    int traps_verify;   // Check the native routines against the ROM.
+    char *trace_path;   // Instruction trace dump file, or NULL.
+    char *heatmap_path; // Memory heatmap files prefix, or NULL.
+    char *profile_path; // Raster time profile timeline file, or NULL.
+    int stats;          // Draw the emulation statistics over the screen.
 } EmuConfig;
 
 #define C64_MIN_ZOOM 0.25               // Minimum zoom level.
 #define C64_MAX_ZOOM 10                 // Maximum zoom level.
 #define C64_DEFAULT_WIDTH_CHARS 30      // Width in characters.
 #define C64_DEFAULT_HEIGHT_CHARS 10     // Height in characters.
+#define C64_TRACE_ENTRIES (1<<22)       // Instructions kept by --trace.
+#define C64_DAMAGE_CHECK_FRAMES 30      // Full frame compare period.
 
 #define CHIPS_IMPL
 #include "chips_common.h"
@@ -77,11 +107,11 @@ size_t base64_encode(const unsigned char *data, size_t input_length, char *encod
 // Terminal keyboard input handling
 struct termios orig_termios;
 
-void disable_raw_mode() {
+void disable_raw_mode(void) {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
 }
 
-void enable_raw_mode() {
+void enable_raw_mode(void) {
     tcgetattr(STDIN_FILENO, &orig_termios);
     atexit(disable_raw_mode);
 
@@ -114,10 +144,20 @@ uint8_t *kitty_init(int width, int height, long *kitty_id) {
     return fb;
 }
 
-// Update display using Kitty graphics protocol
-void kitty_update_display(long kitty_id, int frame_number, int width, int height, uint8_t *fb) {
+/* Encode a frame as Kitty graphics protocol escape sequences, appending
+ * them to 'out'. The kind of frame is one of FRAME_*: FRAME_CREATE creates
+ * the image (the first frame a terminal receives), the other kinds update
+ * it. For FRAME_DELTA only the rows from y0 (included) to y1 (excluded)
+ * are sent in Kitty mode, while Ghostty mode always replaces the whole
+ * image. */
+void kitty_encode_frame(obuf *out, int kind, long kitty_id, int width, int height, uint8_t *fb, int y0, int y1) {
+    if (kind != FRAME_DELTA || EmuConfig.ghostty_mode) {
+        y0 = 0;
+        y1 = height;
+    }
+
     // Calculate base64 encoded size
-    size_t bitmap_size = width * height * 3;
+    size_t bitmap_size = width * (y1-y0) * 3;
     size_t encoded_size = 4 * ((bitmap_size + 2) / 3);
     char *encoded_data = (char*)malloc(encoded_size + 1);
 
@@ -127,10 +167,10 @@ void kitty_update_display(long kitty_id, int frame_number, int width, int height
     }
 
     // Encode the bitmap data to base64
-    base64_encode(fb, bitmap_size, encoded_data);
+    base64_encode(fb + y0*width*3, bitmap_size, encoded_data);
     encoded_data[encoded_size] = '\0';  // Null-terminate the string
 
-    // Send Kitty Graphics Protocol escape sequence with base64 data.
+    // Emit Kitty Graphics Protocol escape sequences with base64 data.
     // Kitty allows a maximum chunk of 4096 bytes each.
     size_t encoded_offset = 0;
     size_t chunk_size = 4096;
@@ -138,101 +178,138 @@ void kitty_update_display(long kitty_id, int frame_number, int width, int height
         int more_chunks = (encoded_offset + chunk_size) < encoded_size;
         if (encoded_offset == 0) {
             if (EmuConfig.ghostty_mode) {
-                printf("\033_Ga=%c,i=%lu,f=24,s=%d,v=%d,q=2,c=%d,r=%d,m=%d;",
-                    frame_number == 0 ? 'T' : 't',  kitty_id, width, height,
+                obuf_printf(out,
+                    "\033_Ga=%c,i=%lu,f=24,s=%d,v=%d,q=2,c=%d,r=%d,m=%d;",
+                    kind == FRAME_CREATE ? 'T' : 't',  kitty_id, width, height,
                     EmuConfig.width_chars, EmuConfig.height_chars,
                     more_chunks);
             } else {
-                if (frame_number == 0) {
-                    printf("\033_Ga=T,i=%lu,f=24,s=%d,v=%d,q=2,"
+                if (kind == FRAME_CREATE) {
+                    obuf_printf(out, "\033_Ga=T,i=%lu,f=24,s=%d,v=%d,q=2,"
                            "c=%d,r=%d,m=%d;",
                         kitty_id, width, height,
                         EmuConfig.width_chars, EmuConfig.height_chars,
                         more_chunks);
                 } else {
-                    printf("\033_Ga=f,r=1,i=%lu,f=24,x=0,y=0,s=%d,v=%d,m=%d;",
-                        kitty_id, width, height, more_chunks);
+                    obuf_printf(out,
+                        "\033_Ga=f,r=1,i=%lu,f=24,x=0,y=%d,s=%d,v=%d,m=%d;",
+                        kitty_id, y0, width, y1-y0, more_chunks);
                 }
             }
         } else {
             if (EmuConfig.ghostty_mode) {
-                printf("\033_Gm=%d;", more_chunks);
+                obuf_printf(out, "\033_Gm=%d;", more_chunks);
             } else {
                 // Chunks after the first just require the raw data and the
                 // more flag.
-                if (frame_number == 0) {
-                    printf("\033_Gm=%d;", more_chunks);
+                if (kind == FRAME_CREATE) {
+                    obuf_printf(out, "\033_Gm=%d;", more_chunks);
                 } else {
-                    printf("\033_Ga=f,r=1,m=%d;", more_chunks);
+                    obuf_printf(out, "\033_Ga=f,r=1,m=%d;", more_chunks);
                 }
             }
         }
 
         // Transfer payload.
         size_t this_size = more_chunks ? 4096 : encoded_size-encoded_offset;
-        fwrite(encoded_data+encoded_offset, this_size, 1, stdout);
-        printf("\033\\");
-        fflush(stdout);
+        obuf_append(out, encoded_data+encoded_offset, this_size);
+        obuf_printf(out, "\033\\");
         encoded_offset += this_size;
     }
 
-    if (EmuConfig.kitty_mode && frame_number > 0) {
+    if (EmuConfig.kitty_mode && kind != FRAME_CREATE) {
         // In Kitty mode we need to emit the "a" action to update
         // our area with the new frame.
-        printf("\033_Ga=a,c=1,i=%lu;", kitty_id);
-        printf("\033\\");
+        obuf_printf(out, "\033_Ga=a,c=1,i=%lu;", kitty_id);
+        obuf_printf(out, "\033\\");
     }
 
     /* When the image is created, add a newline so that the cursor
      * is more naturally placed under the image, not at the right/bottom
      * corner. */
-    if (frame_number == 0) {
-        printf("\r\n");
-        fflush(stdout);
-    }
+    if (kind == FRAME_CREATE) obuf_printf(out, "\r\n");
 
     // Clean up
     free(encoded_data);
 }
 
-// Process keyboard input, sets the pressed or released key into the
-// state of the emulator. Returns 0 for any key, and 1 if the user
-// requested to stop the emulator.
+/* Compare the framebuffer with the copy of the previous frame in 'prev',
+ * then update the copy. Returns 0 if nothing changed, otherwise 1,
+ * setting *y0 and *y1 to the first changed row and to the row after the
+ * last changed one, so that only those rows are sent as a delta. */
+int frame_damage(uint8_t *fb, uint8_t *prev, int width, int height, int *y0, int *y1) {
+    size_t pitch = width*3;
+    int first = -1, last = -1;
+
+    for (int y = 0; y < height; y++) {
+        if (memcmp(fb+y*pitch, prev+y*pitch, pitch) == 0) continue;
+        if (first == -1) first = y;
+        last = y;
+    }
+    if (first == -1) return 0;
+    memcpy(prev+first*pitch, fb+first*pitch, (last-first+1)*pitch);
+    *y0 = first;
+    *y1 = last+1;
+    return 1;
+}
+
+/* Process the keyboard input in 'ch' (as read from a terminal in raw mode),
+ * setting the pressed and released keys into the state of the emulator.
+ * Returns 1 if the user requested to stop the emulator (ESC alone),
+ * otherwise 0. */
+int process_keys(c64_t *c64, const char *ch, size_t len) {
+    if (len == 1 && ch[0] == 27) return 1; // Just ESC.
+
+    for (size_t j = 0; j < len; j++) {
+        int c64_key = 0;
+
+        if (ch[j] == 27 && j+2 < len && ch[j+1] == '[') {
+            switch(ch[j+2]) {
+            case 'A': c64_key = C64_KEY_CSRUP; break;
+            case 'B': c64_key = C64_KEY_CSRDOWN; break;
+            case 'C': c64_key = C64_KEY_CSRRIGHT; break;
+            case 'D': c64_key = C64_KEY_CSRLEFT; break;
+            default:
+                printf("Not handled escape: ESC[%c\r\n", ch[j+2]);
+                break;
+            }
+            j += 2;
+        } else {
+            c64_key = (unsigned char)ch[j];
+            if (islower(c64_key)) c64_key = toupper(c64_key);
+            else if (isupper(c64_key)) c64_key = tolower(c64_key);
+            else if (c64_key == 127 || c64_key == 8) c64_key = C64_KEY_DEL;
+            else if (c64_key == 27) c64_key = 0;
+        }
+
+        if (c64_key == 0) continue;
+
+        // Map key to C64 keycode and send it to the emulator.
+        c64_key_down(c64, c64_key);
+        c64_key_up(c64, c64_key);
+    }
+    return 0;
+}
+
+// Process keyboard input from our terminal. Returns 0 for any key, and 1 if
+// the user requested to stop the emulator.
 int process_keyboard(c64_t *c64) {
     int bytes_waiting = kbhit();
     char ch[8];
 
     if (!bytes_waiting) return 0; // No keyboard events pending.
-    for (int j = 0; j < bytes_waiting && j < (int)sizeof(ch); j++)
-        ch[j] = getchar();
-
-    int c64_key = 0;
-
-    if (ch[0] == 27 && bytes_waiting == 1) { // Just ESC.
-        return 1;
-    } else if (bytes_waiting == 3 && ch[0] == 27 && ch[1] == '[') {
-        switch(ch[2]) {
-        case 'A': c64_key = C64_KEY_CSRUP; break;
-        case 'B': c64_key = C64_KEY_CSRDOWN; break;
-        case 'C': c64_key = C64_KEY_CSRRIGHT; break;
-        case 'D': c64_key = C64_KEY_CSRLEFT; break;
-        default:
-            printf("Not handled escape: ESC[%c\r\n", ch[2]);
-            break;
-        }
-    } else {
-        c64_key = ch[0];
-        if (islower(c64_key)) c64_key = toupper(c64_key);
-        else if (isupper(c64_key)) c64_key = tolower(c64_key);
-        else if (c64_key == 127 || c64_key == 8) c64_key = C64_KEY_DEL;
-    }
-
-    if (c64_key == 0) return 0;
+    int len = 0;
+    while (len < bytes_waiting && len < (int)sizeof(ch))
+        ch[len++] = getchar();
+    return process_keys(c64, ch, len);
+}
 
-    // Map key to C64 keycode and send it to the emulator.
-    c64_key_down(c64, c64_key);
-    c64_key_up(c64, c64_key);
-    return 0;
+/* Keystrokes received from attached viewers. ESC is handled by the viewers
+ * themselves to detach, so it never stops the emulator from here. */
+void viewer_input(const char *buf, size_t len, void *user_data) {
+    c64_t *c64 = user_data;
+    if (len == 1 && buf[0] == 27) return;
+    process_keys(c64, buf, len);
 }
 
 void crt_set_pixel(void *fbptr, int x, int y, uint32_t color) {
@@ -315,6 +392,140 @@ void audio_from_emulator(const float *samples, int num_samples, void *user_data)
 void audio_cleanup(void *user_data);
 #endif
 
+/* Set by SIGTERM/SIGINT: the only way to stop a daemonized emulator,
+ * since viewers can only detach. */
+static volatile sig_atomic_t ShutdownRequested = 0;
+
+static void shutdown_handler(int sig) {
+    (void)sig;
+    ShutdownRequested = 1;
+}
+
+/* With --trace, SIGUSR1 saves the instruction trace right away, even if
+ * the emulator is stuck in the middle of a frame. */
+static c64_t *TracedC64 = NULL;
+
+static void trace_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    trace_save(TracedC64, EmuConfig.trace_path);
+    errno = saved_errno;
+}
+
+/* With --raster-profile, a line is appended to the timeline file at the
+ * end of each frame: the frame number, the total ticks spent in IRQ and
+ * NMI handlers and stolen by the video chip, then a character for each
+ * raster line from 0 to 311: '.' if no handler ran in that line, 'i' or
+ * 'n' if an IRQ or NMI handler ran for less than half of the line, 'I' or
+ * 'N' if it ran for half of the line or more. */
+static c64_raster_profile_t RasterProfile;
+
+static void raster_profile_frame(const c64_raster_profile_t *p,
+                                 void *user_data)
+{
+    FILE *fp = user_data;
+    char timeline[M6569_VTOTAL+1];
+    unsigned long irq = 0, nmi = 0, stolen = 0;
+
+    for (int line = 0; line < M6569_VTOTAL; line++) {
+        const c64_raster_line_t *l = &p->lines[line];
+        int ticks = l->irq > l->nmi ? l->irq : l->nmi;
+        char c = l->irq > l->nmi ? 'i' : 'n';
+        if (ticks == 0) c = '.';
+        else if (ticks >= M6569_HTOTAL/2) c -= 'a'-'A';
+        timeline[line] = c;
+        irq += l->irq;
+        nmi += l->nmi;
+        stolen += l->stolen;
+    }
+    timeline[M6569_VTOTAL] = '\0';
+    fprintf(fp, "%llu %lu %lu %lu %s\n", (unsigned long long)p->frame,
+        irq, nmi, stolen, timeline);
+}
+
+/* With --stats, a line with the emulation speed (how many times faster
+ * than a real C64 the last frames were emulated) and the bus usage of the
+ * video chip in the last frame (see "Bus Statistics" in m6569.h) is drawn
+ * over the top border of the screen, with the C64 character set. */
+void draw_stats(uint8_t *fb, c64_t *c64, double speed) {
+    char text[64];
+    m6569_stats_t stats = c64_vic_stats(c64);
+    snprintf(text, sizeof(text), "SPEED %.2fX BAD %u SPR %u BA %u STALL %u",
+        speed, stats.badlines, stats.sprite_dma, stats.ba, stats.stalled);
+
+    const int x0 = 8, y0 = 8;
+    for (int j = 0; text[j] && x0+(j+1)*8 <= _C64_SCREEN_WIDTH; j++) {
+        const uint8_t *glyph = dump_c64_char_bin + (text[j] & 0x3F)*8;
+        for (int y = 0; y < 8; y++) {
+            uint8_t *dst = fb + ((y0+y)*_C64_SCREEN_WIDTH + x0+j*8)*3;
+            for (int x = 0; x < 8; x++) {
+                uint8_t v = (glyph[y] & (0x80>>x)) ? 0xFF : 0x00;
+                dst[x*3] = dst[x*3+1] = dst[x*3+2] = v;
+            }
+        }
+    }
+}
+
+/* Write end of the pipe the daemon uses to tell the parent that the
+ * setup is done, see daemonize(). */
+static int DaemonReadyFd = -1;
+
+/* Detach from the terminal and keep running in background, so that the
+ * emulator survives the session that started it. The parent waits for
+ * daemon_ready(): if the setup fails the errors still go to the terminal
+ * and the parent exits with the same status as the daemon. */
+void daemonize(void) {
+    int ready[2];
+
+    fflush(stdout);
+    if (pipe(ready) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid != 0) { /* parent exits */
+        char c;
+        int status;
+
+        close(ready[1]);
+        if (read(ready[0], &c, 1) == 1) {
+            printf("Running in background, stop it with: kill %d\n",
+                (int)pid);
+            exit(0);
+        }
+        if (waitpid(pid, &status, 0) == pid && WIFEXITED(status))
+            exit(WEXITSTATUS(status));
+        exit(1);
+    }
+    close(ready[0]);
+    DaemonReadyFd = ready[1];
+    setsid(); /* create a new session */
+}
+
+/* Called by the daemon once the setup is done: from now on every output
+ * goes to /dev/null and the parent can exit. */
+void daemon_ready(void) {
+    int fd;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((fd = open("/dev/null", O_RDWR, 0)) != -1) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO) close(fd);
+    }
+    if (write(DaemonReadyFd, "R", 1) == -1) {
+        /* The parent is gone: nobody to tell. */
+    }
+    close(DaemonReadyFd);
+    DaemonReadyFd = -1;
+}
+
 /* Initialize and parse the configuration, storing it into the
  * global EmuConfig structure. */
 void parse_config(int argc, char **argv) {
@@ -322,6 +533,28 @@ void parse_config(int argc, char **argv) {
     EmuConfig.kitty_mode = 0;
     EmuConfig.prg_filename = NULL;
     EmuConfig.zoom = 1;
+    EmuConfig.listen_path = NULL;
+    EmuConfig.attach_path = NULL;
+    EmuConfig.observe = 0;
+    EmuConfig.lag_policy = VIEWER_LAG_RESYNC;
+    EmuConfig.daemonize = 0;
+    EmuConfig.audio = 1;
+    EmuConfig.shm_name = NULL;
+    EmuConfig.control_path = NULL;
+    EmuConfig.headless = 0;
+    EmuConfig.drive_rom = NULL;
+    EmuConfig.drive_thread = 0;
+    EmuConfig.video_thread = 0;
+    EmuConfig.disk = NULL;
+    EmuConfig.cart = NULL;
+    EmuConfig.reu_kb = 0;
+    EmuConfig.accuracy = -1;
+    EmuConfig.traps = 0;
+    EmuConfig.traps_verify = 0;
+    EmuConfig.trace_path = NULL;
+    EmuConfig.heatmap_path = NULL;
+    EmuConfig.profile_path = NULL;
+    EmuConfig.stats = 0;
 
     for (int j = 1; j < argc; j++) {
         int leftargs = argc-j-1;
@@ -339,6 +572,94 @@ void parse_config(int argc, char **argv) {
             } else if (EmuConfig.zoom > C64_MAX_ZOOM) {
                 EmuConfig.zoom = C64_MAX_ZOOM;
             }
+        } else if (!strcasecmp(argv[j],"--listen") && leftargs) {
+            EmuConfig.listen_path = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--daemon") && leftargs) {
+            EmuConfig.listen_path = strdup(argv[++j]);
+            EmuConfig.daemonize = 1;
+        } else if (!strcasecmp(argv[j],"--no-audio")) {
+            EmuConfig.audio = 0;
+        } else if (!strcasecmp(argv[j],"--shm") && leftargs) {
+            EmuConfig.shm_name = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--control") && leftargs) {
+            EmuConfig.control_path = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--stats")) {
+            EmuConfig.stats = 1;
+        } else if (!strcasecmp(argv[j],"--headless")) {
+            EmuConfig.headless = 1;
+            EmuConfig.audio = 0;
+        } else if (!strcasecmp(argv[j],"--1541-rom") && leftargs) {
+            EmuConfig.drive_rom = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--disk") && leftargs) {
+            EmuConfig.disk = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--cart") && leftargs) {
+            EmuConfig.cart = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--reu") && leftargs) {
+            EmuConfig.reu_kb = atoi(argv[++j]);
+            if (EmuConfig.reu_kb < 128 || EmuConfig.reu_kb > 16384 ||
+                (EmuConfig.reu_kb & (EmuConfig.reu_kb-1)))
+            {
+                fprintf(stderr, "--reu must be a power of 2 from 128 "
+                                "to 16384 (KB)\n");
+                exit(1);
+            }
+        } else if (!strcasecmp(argv[j],"--1541-thread")) {
+            EmuConfig.drive_thread = 1;
+        } else if (!strcasecmp(argv[j],"--video-thread")) {
+            EmuConfig.video_thread = 1;
+        } else if (!strcasecmp(argv[j],"--accuracy") && leftargs) {
+            j++;
+            if (!strcasecmp(argv[j],"cycle")) {
+                EmuConfig.accuracy = C64_ACCURACY_CYCLE;
+            } else if (!strcasecmp(argv[j],"line")) {
+                EmuConfig.accuracy = C64_ACCURACY_LINE;
+            } else if (!strcasecmp(argv[j],"frame")) {
+                EmuConfig.accuracy = C64_ACCURACY_FRAME;
+            } else {
+                fprintf(stderr, "--accuracy must be 'cycle', 'line' or 'frame'\n");
+                exit(1);
+            }
+        } else if (!strcasecmp(argv[j],"--traps")) {
+            EmuConfig.traps = 1;
+        } else if (!strcasecmp(argv[j],"--traps-verify")) {
+            EmuConfig.traps = 1;
+            EmuConfig.traps_verify = 1;
+        } else if (!strcasecmp(argv[j],"--trace") && leftargs) {
+#ifdef C64_TRACE
+            EmuConfig.trace_path = strdup(argv[++j]);
+#else
+            fprintf(stderr, "--trace requires building with TRACE=1\n");
+            exit(1);
+#endif
+        } else if (!strcasecmp(argv[j],"--heatmap") && leftargs) {
+#ifdef C64_HEATMAP
+            EmuConfig.heatmap_path = strdup(argv[++j]);
+#else
+            fprintf(stderr, "--heatmap requires building with HEATMAP=1\n");
+            exit(1);
+#endif
+        } else if (!strcasecmp(argv[j],"--raster-profile") && leftargs) {
+#ifdef C64_RASTER_PROFILE
+            EmuConfig.profile_path = strdup(argv[++j]);
+#else
+            fprintf(stderr, "--raster-profile requires building with "
+                            "PROFILE=1\n");
+            exit(1);
+#endif
+        } else if (!strcasecmp(argv[j],"--attach") && leftargs) {
+            EmuConfig.attach_path = strdup(argv[++j]);
+        } else if (!strcasecmp(argv[j],"--observe")) {
+            EmuConfig.observe = 1;
+        } else if (!strcasecmp(argv[j],"--on-lag") && leftargs) {
+            j++;
+            if (!strcasecmp(argv[j],"resync")) {
+                EmuConfig.lag_policy = VIEWER_LAG_RESYNC;
+            } else if (!strcasecmp(argv[j],"kick")) {
+                EmuConfig.lag_policy = VIEWER_LAG_KICK;
+            } else {
+                fprintf(stderr, "--on-lag must be 'resync' or 'kick'\n");
+                exit(1);
+            }
         } else {
             if (argv[j][0] != '-' && EmuConfig.prg_filename == NULL) {
                 EmuConfig.prg_filename = strdup(argv[j]);
@@ -349,28 +670,165 @@ void parse_config(int argc, char **argv) {
         }
     }
 
+    if (EmuConfig.headless && EmuConfig.control_path == NULL) {
+        fprintf(stderr, "--headless requires --control <path>\n");
+        exit(1);
+    }
+    if ((EmuConfig.drive_thread || EmuConfig.disk) &&
+        EmuConfig.drive_rom == NULL)
+    {
+        fprintf(stderr, "--1541-thread and --disk require --1541-rom <file>\n");
+        exit(1);
+    }
+    if (EmuConfig.video_thread && EmuConfig.accuracy == C64_ACCURACY_CYCLE) {
+        fprintf(stderr, "--video-thread requires --accuracy line or frame\n");
+        exit(1);
+    }
+
     // Handle configurations that require to be computed.
+    if (EmuConfig.accuracy == -1) {
+        EmuConfig.accuracy = EmuConfig.video_thread ? C64_ACCURACY_LINE :
+                                                      C64_ACCURACY_CYCLE;
+    }
     EmuConfig.width_chars = C64_DEFAULT_WIDTH_CHARS * EmuConfig.zoom;
     EmuConfig.height_chars = C64_DEFAULT_HEIGHT_CHARS * EmuConfig.zoom;
 }
 
+/* Load the 16k ROM of the 1541 drive (DOS and controller code, usually
+ * distributed as a single image) into 'rom'. Returns 0 on success, -1 on
+ * error, after reporting it. */
+int load_drive_rom(const char *filename, uint8_t *rom) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open 1541 ROM %s: %s\n", filename,
+            strerror(errno));
+        return -1;
+    }
+    size_t len = fread(rom, 1, 0x4000, file);
+    int extra = fgetc(file);
+    fclose(file);
+    if (len != 0x4000 || extra != EOF) {
+        fprintf(stderr, "The 1541 ROM %s must be exactly 16384 bytes\n",
+            filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* Map the D64/G64 image 'filename' in memory, so that the drive writes
+ * go directly into the file. If the file is read only, the changes are
+ * only kept in memory. Returns the mapping, setting '*size', or NULL on
+ * error, after reporting it. */
+uint8_t *map_disk_image(const char *filename, size_t *size) {
+    int shared = 1;
+    int fd = open(filename, O_RDWR);
+    if (fd == -1 && (errno == EACCES || errno == EROFS)) {
+        fd = open(filename, O_RDONLY);
+        shared = 0;
+    }
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open disk image %s: %s\n", filename,
+            strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) != -1 && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+                 shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to map disk image %s\n", filename);
+        return NULL;
+    }
+    if (!shared) {
+        fprintf(stderr, "%s is read only: changes will not be saved\n",
+            filename);
+    }
+    *size = st.st_size;
+    return p;
+}
+
+/* Load the CRT cartridge image 'filename' in memory. The image must stay
+ * around while the cartridge is plugged in, since the emulator maps its
+ * ROM banks in place. Returns the image, setting '*size', or NULL on
+ * error, after reporting it. */
+uint8_t *load_cart_image(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open cartridge %s: %s\n", filename,
+            strerror(errno));
+        return NULL;
+    }
+    uint8_t *image = NULL;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) > 0 &&
+        fseek(file, 0, SEEK_SET) == 0 && (image = malloc(len)) != NULL &&
+        fread(image, 1, len, file) != (size_t)len)
+    {
+        free(image);
+        image = NULL;
+    }
+    fclose(file);
+    if (image == NULL) {
+        fprintf(stderr, "Failed to read cartridge %s\n", filename);
+        return NULL;
+    }
+    *size = len;
+    return image;
+}
+
 int main(int argc, char **argv) {
     c64_t c64;
     c64_desc_t c64_desc = {0};
 
     parse_config(argc, argv);
 
+    /* When attaching to another emulator we are just a viewer. */
+    if (EmuConfig.attach_path) {
+        return viewer_attach(EmuConfig.attach_path, EmuConfig.observe,
+                             EmuConfig.lag_policy);
+    }
+
+    /* Accept viewers if requested. When running as a daemon this is
+     * the only way to interact with the emulator. */
+    if (EmuConfig.listen_path) {
+        if (server_listen(EmuConfig.listen_path) == -1) {
+            fprintf(stderr, "Can't listen on %s: %s\n",
+                EmuConfig.listen_path, strerror(errno));
+            exit(1);
+        }
+        printf("Viewers can attach with: %s --attach %s\n",
+            argv[0], EmuConfig.listen_path);
+    }
+    if (EmuConfig.control_path) {
+        if (control_listen(EmuConfig.control_path) == -1) {
+            fprintf(stderr, "Can't listen on %s: %s\n",
+                EmuConfig.control_path, strerror(errno));
+            exit(1);
+        }
+        printf("Control commands accepted at %s\n", EmuConfig.control_path);
+    }
+    signal(SIGTERM, shutdown_handler);
+    signal(SIGINT, shutdown_handler);
+    if (EmuConfig.daemonize) daemonize();
+
     /* Initialize the audio subsystem. */
 #ifdef USE_AUDIO
-    void *audio_user_data = audio_init();
-    if (audio_user_data == NULL) {
-        fprintf(stderr,"Audio initialization failed\n");
-        exit(1);
+    void *audio_user_data = NULL;
+    if (EmuConfig.audio) {
+        audio_user_data = audio_init();
+        if (audio_user_data == NULL) {
+            fprintf(stderr,"Audio initialization failed\n");
+            exit(1);
+        }
+        chips_audio_callback_t audio_cb;
+        audio_cb.func = audio_from_emulator;
+        audio_cb.user_data = audio_user_data;
+        c64_desc.audio.callback = audio_cb;
     }
-    chips_audio_callback_t audio_cb;
-    audio_cb.func = audio_from_emulator;
-    audio_cb.user_data = audio_user_data;
-    c64_desc.audio.callback = audio_cb;
 #endif
 
     /* Initialize Kitty graphics */
@@ -378,6 +836,8 @@ int main(int argc, char **argv) {
     int height = _C64_SCREEN_HEIGHT;
     long kitty_id;
     uint8_t *fb = kitty_init(width, height, &kitty_id);
+    uint8_t *prev_fb = calloc(width * height, 3);
+    obuf frames[FRAME_KINDS] = {{0}};
 
     /* C64 emulator init. */
     c64_desc.roms.chars.ptr = dump_c64_char_bin;
@@ -386,36 +846,237 @@ int main(int argc, char **argv) {
     c64_desc.roms.basic.size = sizeof(dump_c64_basic_bin);
     c64_desc.roms.kernal.ptr = dump_c64_kernalv3_bin;
     c64_desc.roms.kernal.size = sizeof(dump_c64_kernalv3_bin);
+    static uint8_t drive_rom[0x4000];
+    if (EmuConfig.drive_rom) {
+        if (load_drive_rom(EmuConfig.drive_rom, drive_rom) == -1) exit(1);
+        c64_desc.c1541_enabled = true;
+        c64_desc.c1541_threaded = EmuConfig.drive_thread;
+        c64_desc.roms.c1541.c000_dfff.ptr = drive_rom;
+        c64_desc.roms.c1541.c000_dfff.size = 0x2000;
+        c64_desc.roms.c1541.e000_ffff.ptr = drive_rom + 0x2000;
+        c64_desc.roms.c1541.e000_ffff.size = 0x2000;
+    }
     c64_desc.crt_set_pixel = crt_set_pixel;
     c64_desc.crt_set_pixel_fb = fb;
+    c64_desc.accuracy = EmuConfig.accuracy;
+    c64_desc.video_threaded = EmuConfig.video_thread;
+    if (EmuConfig.traps) c64_desc.traps = C64_TRAPS_ALL;
+    if (EmuConfig.traps_verify) {
+        /* The check state is big (bitmaps and copies of the whole
+         * memory), so it's only allocated when needed. */
+        c64_desc.trap_verify = malloc(sizeof(c64_trap_verify_t));
+        if (c64_desc.trap_verify == NULL) {
+            fprintf(stderr, "Out of memory allocating the traps check\n");
+            exit(1);
+        }
+    }
+    if (EmuConfig.trace_path) {
+        void *ring = malloc(C64_TRACE_ENTRIES * sizeof(c64_trace_entry_t));
+        if (ring == NULL) {
+            fprintf(stderr, "Out of memory allocating the trace\n");
+            exit(1);
+        }
+        c64_desc.trace.ptr = ring;
+        c64_desc.trace.size = C64_TRACE_ENTRIES * sizeof(c64_trace_entry_t);
+    }
+    if (EmuConfig.heatmap_path) {
+        c64_heatmap_t *heatmap = calloc(1, sizeof(*heatmap));
+        if (heatmap) heatmap->byte = calloc(0x10000, sizeof(heatmap->byte[0]));
+        if (heatmap == NULL || heatmap->byte == NULL) {
+            fprintf(stderr, "Out of memory allocating the heatmap\n");
+            exit(1);
+        }
+        c64_desc.heatmap = heatmap;
+    }
+    if (EmuConfig.reu_kb) {
+        /* The pages of the anonymous mapping are only allocated by the
+         * OS when the programs use them, so a 16MB REU is cheap. */
+        size_t reu_size = (size_t)EmuConfig.reu_kb * 1024;
+        void *reu = mmap(NULL, reu_size, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (reu == MAP_FAILED) {
+            fprintf(stderr, "Can't allocate the REU memory\n");
+            exit(1);
+        }
+        c64_desc.reu.ptr = reu;
+        c64_desc.reu.size = reu_size;
+    }
+    if (EmuConfig.profile_path) {
+        FILE *fp = fopen(EmuConfig.profile_path, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Can't create %s: %s\n", EmuConfig.profile_path,
+                strerror(errno));
+            exit(1);
+        }
+        fprintf(fp, "# frame irq nmi stolen lines\n");
+        RasterProfile.func = raster_profile_frame;
+        RasterProfile.user_data = fp;
+        c64_desc.raster_profile = &RasterProfile;
+    }
     c64_init(&c64, &c64_desc);
+    if (EmuConfig.trace_path) {
+        TracedC64 = &c64;
+        signal(SIGUSR1, trace_handler);
+    }
+    if (EmuConfig.drive_thread && drive_thread_start(&c64) == -1) {
+        fprintf(stderr, "Can't start the 1541 drive thread\n");
+        exit(1);
+    }
+    if (EmuConfig.video_thread && video_thread_start(&c64) == -1) {
+        fprintf(stderr, "Can't start the video thread\n");
+        exit(1);
+    }
+    uint8_t *disk = NULL;
+    size_t disk_size = 0;
+    if (EmuConfig.disk) {
+        disk = map_disk_image(EmuConfig.disk, &disk_size);
+        if (disk == NULL) exit(1);
+        if (!c64_insert_disc(&c64, (chips_range_t){ .ptr = disk,
+                                                    .size = disk_size }))
+        {
+            fprintf(stderr, "%s is not a D64 or G64 disk image\n",
+                EmuConfig.disk);
+            exit(1);
+        }
+    }
+    uint8_t *cart = NULL;
+    if (EmuConfig.cart) {
+        size_t cart_size = 0;
+        cart = load_cart_image(EmuConfig.cart, &cart_size);
+        if (cart == NULL) exit(1);
+        if (!c64_insert_cart(&c64, (chips_range_t){ .ptr = cart,
+                                                    .size = cart_size }))
+        {
+            fprintf(stderr, "%s is not a CRT cartridge image of a "
+                            "supported type\n", EmuConfig.cart);
+            exit(1);
+        }
+    }
 
     /* Get C64 display information */
     chips_display_info_t di = c64_display_info(&c64);
     printf("FB total size %dx%d\n", di.frame.dim.width, di.frame.dim.height);
     printf("FB screen %dx%d at %dx%d\n", di.screen.width, di.screen.height, di.screen.x, di.screen.y);
 
-    printf("C64 Emulator started. Press 'ESC' to quit.\n");
+    /* Export the machine state in shared memory if requested. */
+    if (EmuConfig.shm_name && shm_export_init(EmuConfig.shm_name) == -1) {
+        fprintf(stderr, "Can't create shared memory segment %s: %s\n",
+            EmuConfig.shm_name, strerror(errno));
+        exit(1);
+    }
+
+    /* All the setup that could fail is done. The threads are started
+     * after daemonize(), since fork() only keeps the calling one. */
+    if (EmuConfig.daemonize) daemon_ready();
+
+    /* In headless mode the machine only runs when a control client asks
+     * it to, as fast as possible, and nothing is rendered. */
+    if (EmuConfig.headless) {
+        c64.vic.crt_set_pixel = NULL;
+        while (!ShutdownRequested) control_poll(&c64, -1);
+    }
+
+    // Our own terminal is used only when not running in background.
+    int local_term = !EmuConfig.daemonize && !EmuConfig.headless;
+    if (local_term) {
+        printf("C64 Emulator started. Press 'ESC' to quit.\n");
 
-    // Enable raw mode for keyboard input
-    enable_raw_mode();
+        // Enable raw mode for keyboard input
+        enable_raw_mode();
+    }
 
     // run the emulation/input/render loop
     int frame = 0;
+    uint64_t total_ticks = 0;
     uint64_t total_us_emulated = 0;
     uint64_t total_us_start = time_us();
     int quit_requested = 0;
+    double speed = 1;
+    int rendering = 1;
+    c64_accuracy_t accuracy = c64_accuracy(&c64);
+
+    while (!EmuConfig.headless && !quit_requested && !ShutdownRequested) {
+        // Pixels are only output if somebody is going to look at them.
+        // While nobody does, the video chip runs in the frame tier, that
+        // only looks at the sprites once per frame for the collisions,
+        // and goes back to the selected accuracy when a viewer attaches.
+        int render = local_term || server_viewers() || EmuConfig.shm_name;
+        c64.vic.crt_set_pixel = render ? crt_set_pixel : NULL;
+        if (render != rendering) {
+            if (!render) accuracy = c64_accuracy(&c64);
+            c64_set_accuracy(&c64, render ? accuracy : C64_ACCURACY_FRAME);
+            rendering = render;
+        }
 
-    while (!quit_requested) {
         // tick the emulator for 1 frame
-        c64_exec(&c64, FRAME_USEC);
+        uint64_t exec_start = time_us();
+        total_ticks += c64_exec(&c64, FRAME_USEC);
         total_us_emulated += FRAME_USEC;
+        if (EmuConfig.stats) {
+            uint64_t exec_us = time_us() - exec_start;
+            if (exec_us == 0) exec_us = 1;
+            // Smoothed, or the number would be unreadable.
+            speed = speed*0.9 + ((double)FRAME_USEC/exec_us)*0.1;
+        }
+
+        // Let external tools see the state at the end of the frame.
+        if (EmuConfig.shm_name) {
+            c64_shm_header_t hdr = {
+                .frame = frame+1, .ticks = total_ticks,
+                .pc = c64.cpu.PC, .a = c64.cpu.A, .x = c64.cpu.X,
+                .y = c64.cpu.Y, .s = c64.cpu.S, .p = c64.cpu.P,
+                .cpu_port = c64.cpu_port, .vic_bank = c64.vic_bank_select
+            };
+            memcpy(hdr.vic_regs, c64.vic.reg.regs, sizeof(hdr.vic_regs));
+            shm_export_publish(&hdr, c64.ram, c64.color_ram, fb);
+        }
 
-        // Handle keyboard input
-        quit_requested = process_keyboard(&c64);
+        // Handle keyboard input, from our terminal and from the viewers.
+        if (local_term) quit_requested = process_keyboard(&c64);
+        server_poll(viewer_input, &c64);
+        control_poll(&c64, 0);
 
-        // Update display using Kitty protocol
-        kitty_update_display(kitty_id, frame++, width, height, fb);
+        // Encode each kind of frame some terminal needs, just once: our
+        // own terminal gets the image created at the first frame, then
+        // only deltas. Viewers that attached during this frame, while
+        // nothing was rendered, will get their first frame at the next
+        // one.
+        if (render) {
+            if (EmuConfig.stats) draw_stats(fb, &c64, speed);
+            // The emulator knows which text rows were written, the pixels
+            // are only compared when something else changed, and once in
+            // a while anyway: a change the damage missed is then sent
+            // late instead of staying on the screen.
+            int y0 = 0, y1 = height, changed;
+            uint32_t damage = c64_damage(&c64);
+            if ((damage & C64_DAMAGE_ALL) || EmuConfig.stats ||
+                (frame % C64_DAMAGE_CHECK_FRAMES) == 0)
+            {
+                changed = frame_damage(fb, prev_fb, width, height, &y0, &y1);
+            } else if ((changed = c64_damage_lines(damage, &y0, &y1))) {
+                memcpy(prev_fb+y0*width*3, fb+y0*width*3, (y1-y0)*width*3);
+            }
+            for (int kind = 0; kind < FRAME_KINDS; kind++) {
+                frames[kind].len = 0;
+                int ours = local_term && kind != FRAME_FULL &&
+                           (kind == FRAME_CREATE) == (frame == 0);
+                if (!ours && !server_needs(kind)) continue;
+                if (kind == FRAME_DELTA && !changed) continue;
+                kitty_encode_frame(frames+kind, kind, kitty_id, width, height,
+                                   fb, y0, y1);
+            }
+
+            // Update display using Kitty protocol, then share the same
+            // frames with the viewers.
+            if (local_term) {
+                obuf *local = frames + (frame == 0 ? FRAME_CREATE :
+                                                     FRAME_DELTA);
+                fwrite(local->buf, local->len, 1, stdout);
+                fflush(stdout);
+            }
+            server_broadcast(frames);
+        }
+        frame++;
 
         // Synchronize the emulated C64 at its theoretical speed.
         uint64_t total_us_real = time_us() - total_us_start;
@@ -430,11 +1091,49 @@ int main(int argc, char **argv) {
     }
 
 #ifdef USE_AUDIO
-    audio_cleanup(audio_user_data);
+    if (audio_user_data) audio_cleanup(audio_user_data);
 #endif
     // Cleanup
+    server_cleanup();
+    shm_export_cleanup();
+    control_cleanup();
+    if (disk) {
+        // Save the tracks the drive is still holding.
+        c64_remove_disc(&c64);
+        munmap(disk, disk_size);
+    }
+    drive_thread_stop();
+    video_thread_stop();
+    free(cart);
+    for (int kind = 0; kind < FRAME_KINDS; kind++) obuf_free(frames+kind);
     free(fb);
-    disable_raw_mode();
+    free(prev_fb);
+    if (EmuConfig.trace_path) {
+        signal(SIGUSR1, SIG_IGN);
+        free(c64_desc.trace.ptr);
+    }
+    if (EmuConfig.heatmap_path) {
+        if (heatmap_save(&c64, EmuConfig.heatmap_path) == -1) {
+            fprintf(stderr, "Can't save the heatmap %s: %s\n",
+                EmuConfig.heatmap_path, strerror(errno));
+        }
+        free(c64_desc.heatmap->byte);
+        free(c64_desc.heatmap);
+    }
+    if (EmuConfig.profile_path) fclose(RasterProfile.user_data);
+    if (EmuConfig.traps_verify) {
+        static const char *names[C64_NUM_TRAPS] =
+            {"BLTU", "MLTPLY", "FDIVT", "MOVLIN", "CLRLIN"};
+        c64_trap_stats_t stats = c64_trap_stats(&c64);
+        for (int j = 0; j < C64_NUM_TRAPS; j++) {
+            fprintf(stderr, "%-6s %llu calls, %llu mismatches\n", names[j],
+                (unsigned long long)stats.calls[j],
+                (unsigned long long)stats.mismatches[j]);
+        }
+        free(c64_desc.trap_verify);
+    }
+    if (EmuConfig.reu_kb) munmap(c64_desc.reu.ptr, c64_desc.reu.size);
+    if (local_term) disable_raw_mode();
     printf("\nC64 Emulator terminated.\n");
 
     return 0;
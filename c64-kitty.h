@@ -0,0 +1,93 @@
+/* c64-kitty.h
+ * Declarations shared by the frontend source files. */
+
+#ifndef C64_KITTY_H
+#define C64_KITTY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "c64-shm.h"
+
+/* Growable output buffer. Frames are encoded once into one of those
+ * and then handed to every output: the local terminal and all the
+ * attached viewers. */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t alloc;
+} obuf;
+
+void obuf_append(obuf *b, const void *p, size_t len);
+void obuf_printf(obuf *b, const char *fmt, ...);
+void obuf_free(obuf *b);
+
+/* Kinds of encoded frames. A terminal receives FRAME_CREATE once, then
+ * deltas, or a full refresh when it lost some deltas along the way. */
+#define FRAME_CREATE 0  // Creates the image: first frame of a terminal.
+#define FRAME_FULL 1    // Replaces the whole image.
+#define FRAME_DELTA 2   // Only the rows changed since the previous frame.
+#define FRAME_KINDS 3
+
+/* Terminal handling, from c64-kitty.c. */
+void enable_raw_mode(void);
+void disable_raw_mode(void);
+
+/* Viewers server and client, from server.c. */
+#define VIEWER_LAG_RESYNC 0     // Slow viewer: skip frames, then resync.
+#define VIEWER_LAG_KICK 1       // Slow viewer: disconnect it.
+
+typedef void (*viewer_input_cb)(const char *buf, size_t len, void *user_data);
+
+int server_listen(const char *path);
+void server_poll(viewer_input_cb cb, void *user_data);
+int server_viewers(void);
+int server_needs(int kind);
+void server_broadcast(obuf *frames);
+void server_cleanup(void);
+int viewer_attach(const char *path, int observer, int lag_policy);
+
+/* Shared memory export, from shm.c. */
+int shm_export_init(const char *name);
+void shm_export_publish(const c64_shm_header_t *hdr, const uint8_t *ram,
+                        const uint8_t *color_ram, const uint8_t *fb);
+void shm_export_cleanup(void);
+
+/* Control commands, from control.c. The machine is passed as a c64_t
+ * pointer, a type only known to the files including the chips headers. */
+int control_listen(const char *path);
+void control_poll(void *c64, int timeout_ms);
+void control_cleanup(void);
+
+/* 1541 drive thread, from drive.c. */
+int drive_thread_start(void *c64);
+void drive_thread_stop(void);
+
+/* Instruction trace dumps, from trace.c. A dump file starts with this
+ * header, followed by the 64k of memory as seen by the CPU when the dump
+ * was taken (so that the instructions operands can be decoded), and by
+ * 'count' c64_trace_entry_t items, oldest first, in the host byte order
+ * (see "Instruction Trace" in c64.h). c64-trace.c turns it into a
+ * disassembled listing. */
+#define TRACE_MAGIC "C64TRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];          // TRACE_MAGIC, not null terminated.
+    uint32_t version;       // TRACE_VERSION
+    uint32_t entry_size;    // sizeof(c64_trace_entry_t)
+    uint64_t count;         // Number of entries in the file.
+} trace_header_t;
+
+int trace_save(void *c64, const char *filename);
+
+/* Memory access heatmap, from heatmap.c. Saves '<prefix>.ppm' and
+ * '<prefix>.csv' (see "Memory Heatmap" in c64.h). */
+int heatmap_save(void *c64, const char *prefix);
+void heatmap_reset(void *c64);
+
+/* Video output thread, from video.c. */
+int video_thread_start(void *c64);
+void video_thread_stop(void);
+
+#endif
@@ -0,0 +1,70 @@
+/* c64-shm.h
+ * Layout of the shared memory segment exported with --shm <name>.
+ *
+ * External tools (test oracles, bots, debugger UIs) can map the segment
+ * read only and observe the emulated machine with no copies and no
+ * protocol at all:
+ *
+ *   int fd = shm_open("/c64", O_RDONLY, 0);
+ *   const c64_shm_t *shm = mmap(NULL, sizeof(c64_shm_t), PROT_READ,
+ *                               MAP_SHARED, fd, 0);
+ *
+ * The emulator updates the segment once per frame. Updates are protected
+ * by a sequence lock: readers wanting a consistent snapshot of more than a
+ * single field should read like that:
+ *
+ *   uint32_t seq;
+ *   do {
+ *       seq = c64_shm_read_begin(shm);
+ *       ... read what you need from shm ...
+ *   } while (c64_shm_read_retry(shm, seq));
+ */
+
+#ifndef C64_SHM_H
+#define C64_SHM_H
+
+#include <stdint.h>
+
+#define C64_SHM_MAGIC 0x4b343643    // "C64K" in little endian.
+#define C64_SHM_VERSION 1           // Bumped when the layout changes.
+#define C64_SHM_FB_WIDTH 392        // Same as the emulator framebuffer.
+#define C64_SHM_FB_HEIGHT 272
+
+typedef struct {
+    uint32_t magic;         // C64_SHM_MAGIC
+    uint32_t version;       // C64_SHM_VERSION
+    uint32_t seq;           // Sequence lock: odd while being updated.
+    uint32_t frame;         // Number of frames emulated so far.
+    uint64_t ticks;         // Number of CPU cycles emulated so far.
+    uint16_t pc;            // CPU registers at the end of the frame.
+    uint8_t a, x, y, s, p;
+    uint8_t cpu_port;       // Memory configuration (address $01).
+    uint16_t vic_bank;      // Base address of the VIC-II 16k bank.
+    uint16_t fb_width;      // C64_SHM_FB_WIDTH
+    uint16_t fb_height;     // C64_SHM_FB_HEIGHT
+    uint8_t vic_regs[64];   // VIC-II registers $D000-$D03F.
+} c64_shm_header_t;
+
+typedef struct {
+    c64_shm_header_t hdr;
+    uint8_t ram[1<<16];     // The 64k RAM, without ROMs overlays.
+    uint8_t color_ram[1024];// Color RAM, low nibble only.
+    uint8_t fb[C64_SHM_FB_WIDTH*C64_SHM_FB_HEIGHT*3]; // RGB24 pixels.
+} c64_shm_t;
+
+/* Start reading: returns the sequence number to pass to
+ * c64_shm_read_retry() once done. */
+static inline uint32_t c64_shm_read_begin(const c64_shm_t *shm) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&shm->hdr.seq, __ATOMIC_ACQUIRE)) & 1);
+    return seq;
+}
+
+/* Return true if the emulator updated the segment while we were reading
+ * it, so that what we read may be inconsistent and must be read again. */
+static inline int c64_shm_read_retry(const c64_shm_t *shm, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shm->hdr.seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif
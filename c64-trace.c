@@ -0,0 +1,217 @@
+/* c64-trace.c
+ * Turn an instruction trace saved by the emulator (see --trace and the
+ * TRACE control command) into a disassembled listing:
+ *
+ *   ./c64-trace [--last <count>] <file>
+ *
+ * For each instruction the listing shows the cycle it started at,
+ * counted from the first instruction listed, the address, the
+ * instruction and the registers before it was executed. The trace only
+ * has the opcodes: the operands are taken from the memory saved along
+ * with the trace, so they are the ones in memory when the trace was
+ * saved, that differ from the executed ones for self modifying code.
+ *
+ * Build with "make c64-trace". */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "c64-kitty.h"
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+
+/* Addressing modes. */
+enum { IMP, ACC, IMM, ZP, ZPX, ZPY, IZX, IZY, ABS, ABX, ABY, IND, REL };
+
+/* Bytes taken by the operand of each addressing mode. */
+static const int OperandLen[] = { 0, 0, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 1 };
+
+/* NMOS 6510 opcodes, including the undocumented ones. */
+static const char *Mnemonics[256] = {
+    "BRK", "ORA", "JAM", "SLO", "NOP", "ORA", "ASL", "SLO",
+    "PHP", "ORA", "ASL", "ANC", "NOP", "ORA", "ASL", "SLO",
+    "BPL", "ORA", "JAM", "SLO", "NOP", "ORA", "ASL", "SLO",
+    "CLC", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO",
+    "JSR", "AND", "JAM", "RLA", "BIT", "AND", "ROL", "RLA",
+    "PLP", "AND", "ROL", "ANC", "BIT", "AND", "ROL", "RLA",
+    "BMI", "AND", "JAM", "RLA", "NOP", "AND", "ROL", "RLA",
+    "SEC", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA",
+    "RTI", "EOR", "JAM", "SRE", "NOP", "EOR", "LSR", "SRE",
+    "PHA", "EOR", "LSR", "ALR", "JMP", "EOR", "LSR", "SRE",
+    "BVC", "EOR", "JAM", "SRE", "NOP", "EOR", "LSR", "SRE",
+    "CLI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE",
+    "RTS", "ADC", "JAM", "RRA", "NOP", "ADC", "ROR", "RRA",
+    "PLA", "ADC", "ROR", "ARR", "JMP", "ADC", "ROR", "RRA",
+    "BVS", "ADC", "JAM", "RRA", "NOP", "ADC", "ROR", "RRA",
+    "SEI", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA",
+    "NOP", "STA", "NOP", "SAX", "STY", "STA", "STX", "SAX",
+    "DEY", "NOP", "TXA", "ANE", "STY", "STA", "STX", "SAX",
+    "BCC", "STA", "JAM", "SHA", "STY", "STA", "STX", "SAX",
+    "TYA", "STA", "TXS", "TAS", "SHY", "STA", "SHX", "SHA",
+    "LDY", "LDA", "LDX", "LAX", "LDY", "LDA", "LDX", "LAX",
+    "TAY", "LDA", "TAX", "LXA", "LDY", "LDA", "LDX", "LAX",
+    "BCS", "LDA", "JAM", "LAX", "LDY", "LDA", "LDX", "LAX",
+    "CLV", "LDA", "TSX", "LAS", "LDY", "LDA", "LDX", "LAX",
+    "CPY", "CMP", "NOP", "DCP", "CPY", "CMP", "DEC", "DCP",
+    "INY", "CMP", "DEX", "SBX", "CPY", "CMP", "DEC", "DCP",
+    "BNE", "CMP", "JAM", "DCP", "NOP", "CMP", "DEC", "DCP",
+    "CLD", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP",
+    "CPX", "SBC", "NOP", "ISC", "CPX", "SBC", "INC", "ISC",
+    "INX", "SBC", "NOP", "SBC", "CPX", "SBC", "INC", "ISC",
+    "BEQ", "SBC", "JAM", "ISC", "NOP", "SBC", "INC", "ISC",
+    "SED", "SBC", "NOP", "ISC", "NOP", "SBC", "INC", "ISC",
+};
+
+static const uint8_t Modes[256] = {
+    IMP, IZX, IMP, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, ACC, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+    ABS, IZX, IMP, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, ACC, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+    IMP, IZX, IMP, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, ACC, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+    IMP, IZX, IMP, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, ACC, IMM, IND, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+    IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPY, ZPY,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABY, ABY,
+    IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPY, ZPY,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABY, ABY,
+    IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+    IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP,
+    IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+    REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX,
+    IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+};
+
+static uint8_t Mem[0x10000];
+
+/* Disassemble the instruction at 'pc' into 'buf', using the operands
+ * found in the saved memory. Returns the length of the instruction. */
+static int disassemble(uint16_t pc, uint8_t opcode, char *buf, size_t len) {
+    uint8_t mode = Modes[opcode];
+    uint8_t lo = Mem[(uint16_t)(pc+1)];
+    uint16_t word = lo | (Mem[(uint16_t)(pc+2)] << 8);
+    const char *mne = Mnemonics[opcode];
+
+    switch (mode) {
+    case IMP: snprintf(buf, len, "%s", mne); break;
+    case ACC: snprintf(buf, len, "%s A", mne); break;
+    case IMM: snprintf(buf, len, "%s #$%02X", mne, lo); break;
+    case ZP: snprintf(buf, len, "%s $%02X", mne, lo); break;
+    case ZPX: snprintf(buf, len, "%s $%02X,X", mne, lo); break;
+    case ZPY: snprintf(buf, len, "%s $%02X,Y", mne, lo); break;
+    case IZX: snprintf(buf, len, "%s ($%02X,X)", mne, lo); break;
+    case IZY: snprintf(buf, len, "%s ($%02X),Y", mne, lo); break;
+    case ABS: snprintf(buf, len, "%s $%04X", mne, word); break;
+    case ABX: snprintf(buf, len, "%s $%04X,X", mne, word); break;
+    case ABY: snprintf(buf, len, "%s $%04X,Y", mne, word); break;
+    case IND: snprintf(buf, len, "%s ($%04X)", mne, word); break;
+    case REL:
+        snprintf(buf, len, "%s $%04X", mne, (uint16_t)(pc + 2 + (int8_t)lo));
+        break;
+    }
+    return 1 + OperandLen[mode];
+}
+
+int main(int argc, char **argv) {
+    const char *filename = NULL;
+    uint64_t last = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int leftargs = argc-j-1;
+        if (!strcasecmp(argv[j],"--last") && leftargs) {
+            last = strtoull(argv[++j], NULL, 10);
+        } else if (argv[j][0] != '-' && filename == NULL) {
+            filename = argv[j];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (filename == NULL) {
+        fprintf(stderr, "Usage: %s [--last <count>] <file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+    trace_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TRACE_VERSION ||
+        hdr.entry_size != sizeof(c64_trace_entry_t) ||
+        fread(Mem, sizeof(Mem), 1, fp) != 1)
+    {
+        fprintf(stderr, "%s is not an instruction trace\n", filename);
+        return 1;
+    }
+
+    // Skip to the last entries if requested.
+    uint64_t first = 0;
+    if (last && last < hdr.count) first = hdr.count - last;
+    if (fseeko(fp, first * sizeof(c64_trace_entry_t), SEEK_CUR) == -1) {
+        perror(filename);
+        return 1;
+    }
+
+    printf("       cycle  PC    bytes     instruction     A  X  Y  S  P\n");
+    uint64_t cycle = 0;
+    c64_trace_entry_t e;
+    for (uint64_t j = first; j < hdr.count; j++) {
+        if (fread(&e, sizeof(e), 1, fp) != 1) {
+            fprintf(stderr, "%s is truncated\n", filename);
+            return 1;
+        }
+        if (j != first) cycle += e.ticks;
+
+        char ins[32], bytes[16];
+        int len = disassemble(e.pc, e.opcode, ins, sizeof(ins));
+        int pos = snprintf(bytes, sizeof(bytes), "%02X", e.opcode);
+        for (int k = 1; k < len; k++) {
+            pos += snprintf(bytes+pos, sizeof(bytes)-pos, " %02X",
+                            Mem[(uint16_t)(e.pc+k)]);
+        }
+        char flags[9];
+        for (int k = 0; k < 8; k++) {
+            flags[k] = (e.p & (0x80>>k)) ? "NV-BDIZC"[k] : '.';
+        }
+        flags[8] = 0;
+        printf("%12llu  %04X  %-8s  %-14s  %02X %02X %02X %02X %s\n",
+            (unsigned long long)cycle, e.pc, bytes, ins,
+            e.a, e.x, e.y, e.s, flags);
+    }
+    fclose(fp);
+    return 0;
+}
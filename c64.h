@@ -36,9 +36,306 @@
 
     TODO!
 
+    ## ROM Images
+
+    The ROM images in c64_desc_t (and the optional 1541 ones) are mapped
+    in place, not copied, so any number of instances share a single copy
+    of them, usually the constant arrays of c64-roms.h. They must stay
+    valid as long as the instances using them.
+
+    Snapshots don't contain the ROMs either, only a hash of them:
+    c64_load_snapshot() fails if the machine was initialized with
+    different ROM images (or with the floppy drive on one side only).
+
+    ## Cartridges
+
+    c64_insert_cart() plugs a cartridge into the expansion port, from a
+    .CRT file image, and resets the machine. Like the ROMs, the image is
+    mapped in place and must stay valid while the cartridge is inserted.
+    The supported hardware types are:
+
+        - C64_CART_NORMAL: 8 KB at 8000..9FFF, or 16 KB at 8000..BFFF,
+          or an Ultimax cartridge with ROMH at E000..FFFF
+        - C64_CART_OCEAN: up to 64 banks of 8 KB, selected by writing
+          the bank number to DE00 and visible both at 8000 and A000
+        - C64_CART_MAGIC_DESK: up to 128 banks of 8 KB at 8000, selected
+          by writing DE00, writing a value with bit 7 set switches the
+          cartridge off
+        - C64_CART_EASYFLASH: 64 banks of 2x 8 KB selected by writing
+          DE00, with the GAME and EXROM lines controlled by DE02 (the
+          boot jumper is in the boot position) and 256 bytes of RAM at
+          DF00..DFFF, the flash memory is read only
+
+    The cartridge ROM banks are mapped into the CPU memory map like the
+    other ROMs, so a bank switch only changes a few page pointers, and
+    there is no cost at all for the memory accesses. In the Ultimax mode
+    the unmapped areas read and write the RAM, and the VIC-II doesn't see
+    the ROMH bank.
+
+    Snapshots only load into a machine with the same cartridge inserted,
+    and restore the bank and the lines selected by the program.
+
+    ## RAM Expansion Unit
+
+    With c64_desc_t.reu pointing to 128 KB to 16 MB of memory (a power of
+    2), a 1700/1764/1750 compatible REU is plugged in, with its registers
+    at DF00..DF0A (repeated every 32 bytes up to DFFF, and taking the
+    place of the IO2 area of a cartridge). The memory is provided by the
+    caller and not cleared, so memory fresh from the OS (like from mmap())
+    only takes the pages the programs actually use.
+
+    A transfer (stash, fetch, swap or verify) starts when the command is
+    written, or at the next CPU write to FF00, and stops the CPU for as
+    many ticks as the real REU: one per byte, two per byte for the swap,
+    and the REU waits while the VIC-II uses the bus. If the C64 memory
+    involved doesn't include the IO area, the whole transfer is done at
+    once with a copy, and the CPU is only stopped afterwards, so the
+    VIC-II sees the new data a bit early. Otherwise it is done a byte
+    each tick on the bus, like the CPU does, so that REU transfers to the
+    VIC-II or SID registers have exactly the right timing.
+
+    Snapshots contain the REU registers but not the REU memory (like the
+    disc image), and only load into a machine with a REU of the same size.
+    A machine with a REU is forked with c64_fork_reu(), that takes the REU
+    memory of the fork, of the same size: its 64 KB pages are shared with
+    the original like the RAM ones, and copied into the fork when a stash
+    or swap writes them. c64_restore_dirty() shares the REU pages a fork
+    wrote again, but can't undo the writes to REU pages not shared with
+    the forked machine, and asserts that there were none (see "Forking").
+
+    ## Forking
+
+    c64_fork() clones a machine cheaply, for instance to try many inputs
+    from the same state. The fork gets a copy of everything but the RAM:
+    its 1 KB RAM pages are shared with the original, and a page is copied
+    into the fork only when it is written to, by the CPU or by functions
+    like c64_quickload() and c64_mem_write(). The VIC-II reads shared
+    pages in place.
+
+    The original becomes the common base of its forks: it can't run or be
+    changed until they are all discarded with c64_discard() (to keep it
+    running too, fork it twice and run one of the forks instead). Forks
+    can be forked in turn. With a REU, c64_fork_reu() shares its memory
+    the same way, in 64 KB pages (see "RAM Expansion Unit").
+    As the RAM pages of a fork are only written when they are copied, a
+    fork in memory fresh from the OS (like from mmap()) only takes about
+    32 KB of physical memory, plus the pages it writes. A threaded
+    floppy drive (or video output) is not threaded in the forks, and the
+    disc image is shared: what a fork's drive writes ends up in it.
+
+    ## Instruction Trace
+
+    Compiled with C64_TRACE defined, the emulator can keep the last
+    instructions executed by the CPU in a ring buffer provided with
+    c64_desc_t.trace, a power of 2 of c64_trace_entry_t items. Each entry
+    takes 10 bytes: the address and the opcode, the registers before the
+    instruction is executed, and the ticks since the previous opcode
+    fetch, that is the duration of the previous instruction, DMA stalls
+    included. An instruction whose opcode fetch is turned into an
+    interrupt by the CPU is traced, followed by the interrupt handler.
+
+    The ring is written with plain stores, and the count of entries is
+    published after each one, so c64_trace_parts() can be called at any
+    time, even from a signal handler interrupting the emulation, to get
+    the entries oldest first. Without C64_TRACE nothing is compiled into
+    the tick loop. The trace belongs to the running instance: loading a
+    snapshot or restoring a machine with c64_restore_dirty() doesn't
+    change it, and forks don't trace.
+
+    ## Memory Heatmap
+
+    Compiled with C64_HEATMAP defined, the emulator counts the memory
+    accesses into the c64_heatmap_t provided with c64_desc_t.heatmap, to
+    find out where a program spends its time and which data it touches.
+    There are four counters for each 256 byte page, and optionally for
+    each byte if c64_heatmap_t.byte points to 0x10000 more of them:
+
+        - C64_HEAT_READ: the CPU reads, opcode fetches excluded
+        - C64_HEAT_WRITE: the CPU writes
+        - C64_HEAT_EXEC: the CPU opcode fetches
+        - C64_HEAT_VIC: the VIC-II fetches, at the 16-bit address formed
+          with the bank selected via CIA-2 (so the character ROM
+          fetches are counted at 0x1000..0x1FFF or 0x9000..0x9FFF)
+
+    The CPU accesses are counted at their address whatever is mapped
+    there (RAM, ROM or IO), once even if the CPU is stopped by the VIC-II
+    for a while. The counters are just incremented, the caller can read
+    or clear them at any time between two c64_exec() calls. Like the
+    instruction trace, the heatmap belongs to the running instance and
+    forks don't count.
+
+    ## Raster Time Profile
+
+    C64 programs are budgeted in raster lines. Compiled with
+    C64_RASTER_PROFILE defined, the emulator records for each raster line
+    of each frame how many ticks the CPU spent in the interrupt handlers,
+    and how many ticks it was stopped by the VIC-II (the bad line and
+    sprite DMA cycles stolen with BA). The caller provides a
+    c64_raster_profile_t with c64_desc_t.raster_profile, and its func is
+    called with the counters of all the lines when the frame ends (when
+    the raster line counter wraps to 0), then they are cleared.
+
+    A handler starts with the BRK instruction forced by an IRQ or NMI (or
+    with a BRK opcode, that goes through the IRQ vector) and ends with the
+    RTI that returns from it, both included. Handlers can nest, like an
+    NMI interrupting an IRQ handler, and the ticks go to the innermost
+    one. A handler that doesn't return with RTI is counted until the next
+    RTI. Like the instruction trace, the profile belongs to the running
+    instance and forks don't profile.
+
+    ## Specialized Tick Loops
+
+    c64_exec() and c64_exec_ticks() pick, once per call, a version of the
+    tick loop compiled for the features actually in use: debug callback,
+    audio callback, crt_set_pixel callback, floppy drive and ROM traps
+    (see "ROM Traps"). The checks for the others are compiled out of the
+    loop, and, without an audio callback, the SID doesn't generate
+    samples at all, and without a crt_set_pixel callback the VIC-II
+    doesn't compute the pixel colors.
+
+    The 32 loops add about 65 KB of code. Define C64_NO_EXEC_VARIANTS
+    before including the implementation to get a single loop checking
+    the features at runtime instead. c64-bench.c measures the speed of
+    each variant.
+
+    ## Accuracy Tiers
+
+    c64_set_accuracy() trades the exactness of the picture for speed, so
+    that for instance a test can run through a loader quickly and switch
+    back to full accuracy for the timing sensitive part:
+
+    - C64_ACCURACY_CYCLE: the VIC-II decodes the pixels cycle by cycle
+    - C64_ACCURACY_LINE: each raster line is rendered at its end, from
+      the data fetched and the register writes recorded during the line,
+      so only horizontal scrolling and sprites moved in the middle of a
+      line take effect on the next one
+    - C64_ACCURACY_FRAME: the frame is rendered at its end from video
+      memory, raster effects are lost
+
+    Only how the pixels are produced changes (see "Render Modes" in
+    m6569.h): the CPU, the CIAs and the VIC-II state machine still run
+    cycle by cycle in every tier, so badlines, sprite DMA and raster
+    interrupts keep their exact timing and switching loses no state. The
+    CIAs already skip their idle cycles in every tier. Sprite collisions
+    are detected when the line or frame is rendered. The switch happens
+    at the start of the next frame, and the accuracy is not part of the
+    snapshots.
+
+    ## ROM Traps
+
+    In the C64_ACCURACY_FRAME tier, c64_set_traps() (or c64_desc_t.traps)
+    replaces some hot BASIC and KERNAL routines with native versions
+    working on the same RAM and registers:
+
+    - C64_TRAP_BLTU: the BASIC memory move (A3BF), that makes room for
+      program lines, variables and arrays
+    - C64_TRAP_MLTPLY: the floating point multiplication by one byte of
+      the mantissa (BA59 and BA5E), four of them make a multiplication
+    - C64_TRAP_FDIVT: the floating point division (BB12)
+    - C64_TRAP_MOVLIN: the copy of a screen line and its colors (E9C8),
+      CHROUT scrolls the screen with it
+    - C64_TRAP_CLRLIN: the clear of a screen line (E9FF), used by CHROUT
+      to scroll and to clear the screen
+
+    When the CPU fetches the first opcode of one of them, and the ROM is
+    mapped there, an RTS is put on the data bus in its place, and the
+    native version runs when the CPU executes it. The native versions are
+    transcriptions of the ROM code: they leave the RAM, the registers,
+    the flags and even the bytes below the stack pointer exactly like the
+    ROM code does, only without taking any time. The ROM code runs as
+    usual if the routine would access the IO area or end with a BASIC
+    error, if an interrupt is taken at the fetch, or if the BASIC or
+    KERNAL image isn't the one the native versions were written for.
+    CHROUT itself isn't trapped, most of it is about the screen editor
+    state, but the scroll and the line clear are most of its time.
+
+    Since the trapped routines take no time the program timing changes,
+    so the traps only run in the frame tier, where the raster effects are
+    lost anyway. Like the accuracy, the traps are not part of the
+    snapshots.
+
+    To test the native versions, provide a c64_trap_verify_t with
+    c64_desc_t.trap_verify: the ROM code then always runs, in every tier,
+    and each call is compared with what the native version computed at
+    its entry: the registers, and the addresses written and their values
+    (those overwritten meanwhile by an interrupt handler are not
+    compared). c64_trap_stats() returns the calls of each trap and, in
+    the test mode, the mismatches. Like the instruction trace, the test
+    mode belongs to the running instance and forks don't verify.
+
+    ## Screen Damage
+
+    c64_damage() returns the character rows of the screen that may have
+    changed since the last call, so that a frontend can output only those
+    without comparing the pixels of the frame: bit N is set for the text
+    row N (0..24), and C64_DAMAGE_ALL if anything else may have changed.
+    The rows are marked when the CPU (or the REU, a ROM trap or
+    c64_mem_write()) writes the video matrix, the bitmap or the color
+    RAM. When the data, the pointer, the position, the colors or the
+    other bits of an enabled sprite change, the rows it is drawn at
+    before and after the change are marked, C64_DAMAGE_TOP and
+    C64_DAMAGE_BOTTOM standing for the lines above and below the text
+    rows. Writes to the character set, to the byte fetched in the idle
+    state (drawn in the lines where no text row is, like with a vertical
+    scroll or open borders), to the other VIC-II registers (but the
+    raster compare and interrupt ones), a VIC-II bank switch, a snapshot
+    load and a reset mark the whole screen. The write path only checks a
+    mask of the 1 KB pages the VIC-II displays (the video matrix, the
+    character set or the bitmap, the idle state byte and the data of the
+    enabled sprites), so most writes cost a single test.
+
+    A row written after the beam passed it is only drawn in the next
+    frame, and a sprite or a text row changed while the beam draws it
+    keeps the old look down to its end, up to the next frame as well. So
+    the rows of the previous two calls are returned again: c64_damage()
+    is meant to be called once per frame, after c64_exec().
+    c64_damage_lines() turns the rows into the framebuffer lines they are
+    drawn at, with any vertical scroll.
+
+    ## Running the Floppy Drive on its own Thread
+
+    With c64_desc_t.c1541_threaded the drive is not ticked by c64_exec(),
+    instead another thread is expected to call c64_drive_step() in a loop,
+    so that a busy drive runs on a different core.
+
+    The two sides only depend on each other through the IEC bus, and the
+    synchronization is conservative, there is never a rollback:
+
+    - the drive never runs ahead of the C64, and every change of the lines
+      pulled low by the C64 is queued with the tick it happened at, so the
+      drive sees it at the same tick it would see it in a single thread
+    - the C64 only looks at the bus when the CPU reads CIA-2 port A, and
+      only then it waits for the drive to reach the same tick
+    - the C64 can't run more than C64_DRIVE_MAX_LEAD ticks ahead of the
+      drive, or queue more than C64_DRIVE_RING_SIZE bus changes
+
+    The result is the same, tick by tick, of the single threaded emulation.
+    Functions that access the drive state, like c64_reset() and the
+    snapshot functions, first wait for the drive thread to catch up. The
+    drive thread must be running whenever the C64 is ticked or one of
+    those functions is called, otherwise they wait forever.
+
+    ## Outputting the Video on its own Thread
+
+    With c64_desc_t.video_threaded the VIC-II records each raster line
+    (see "Render Modes" in m6569.h) and c64_exec() queues it, while
+    another thread calls c64_video_step() in a loop to compose the pixels
+    and call crt_set_pixel, one or more lines behind the emulation. The
+    sprite collisions are still detected by the emulation itself, so the
+    CPU sees them at the same time as in a single thread.
+
+    c64_exec() and c64_exec_ticks() wait for the queued lines to be output
+    before returning, so the framebuffer is complete as usual between two
+    calls. The lines are composed from the recorded data, never from the
+    machine state, so the video thread doesn't need to be stopped to
+    save, load or fork the machine. The cycle by cycle decoding can't be
+    threaded: c64_desc_t.accuracy and c64_set_accuracy() must select
+    C64_ACCURACY_LINE or C64_ACCURACY_FRAME. The video thread must be
+    running whenever the C64 is ticked with a crt_set_pixel callback.
+
     ## TODO:
 
-    - floppy disc support
+    - disc change detection
 
     ## Tests Status
 
@@ -73,8 +370,8 @@
     In chips-test/tests/vice-tests/CIA:
 
     ciavarious:
-        - all green, expect cia15.prg, which tests the CIA TOD clock,
-          which isn't implemented
+        - all green, expect cia15.prg, which tests the CIA TOD clock
+          (the TOD clock was implemented since, not re-tested)
 
     cia-timer/cia-timer-oldcias.prg:
         - left side (CIA-1, IRQ) all green, right side (CIA-2, NMI) some red
@@ -252,7 +549,7 @@ extern "C" {
 #endif
 
 // bump snapshot version when c64_t memory layout changes
-#define C64_SNAPSHOT_VERSION (1)
+#define C64_SNAPSHOT_VERSION (20)
 
 #define C64_FREQUENCY (985248)              // clock frequency in Hz
 #define C64_MAX_AUDIO_SAMPLES (1024)        // max number of audio samples in internal sample buffer
@@ -268,6 +565,13 @@ typedef enum {
     C64_JOYSTICKTYPE_PADDLE_2,      // FIXME: not emulated
 } c64_joystick_type_t;
 
+// emulation accuracy, see c64_set_accuracy()
+typedef enum {
+    C64_ACCURACY_CYCLE,     // the VIC-II decodes pixels cycle by cycle (default)
+    C64_ACCURACY_LINE,      // the VIC-II renders each raster line at its end
+    C64_ACCURACY_FRAME,     // the VIC-II renders the whole frame at its end
+} c64_accuracy_t;
+
 // joystick mask bits
 #define C64_JOYSTICK_UP    (1<<0)
 #define C64_JOYSTICK_DOWN  (1<<1)
@@ -319,14 +623,176 @@ typedef enum {
 #define C64_KEY_F7       (0xF7)     // F7
 #define C64_KEY_F8       (0xF8)     // F8
 
+// cartridge hardware types (the numbers of the CRT file format) supported by c64_insert_cart()
+#define C64_CART_NORMAL     (0)     // 8 KB, 16 KB or Ultimax
+#define C64_CART_OCEAN      (5)     // 8 KB banks selected at DE00
+#define C64_CART_MAGIC_DESK (19)    // 8 KB banks selected at DE00, bit 7 disables the cartridge
+#define C64_CART_EASYFLASH  (32)    // 16 KB banks selected at DE00, lines controlled at DE02, RAM at DF00
+#define C64_CART_MAX_BANKS  (128)
+
+// expansion port lines pulled low by a cartridge
+#define C64_CART_EXROM (1<<0)
+#define C64_CART_GAME  (1<<1)
+
+// expansion port cartridge state
+typedef struct {
+    bool inserted;
+    uint8_t type;               // C64_CART_*
+    uint8_t bank;               // bank mapped at ROML and ROMH
+    uint8_t lines;              // C64_CART_EXROM and C64_CART_GAME if pulled low
+    uint8_t reset_lines;        // the lines after a reset, from the CRT file
+    uint32_t hash;              // hash of the CRT image, snapshots only load into a machine with the same cartridge
+    const uint8_t* roml[C64_CART_MAX_BANKS];    // 8 KB ROML image of each bank (8000..9FFF), or NULL
+    const uint8_t* romh[C64_CART_MAX_BANKS];    // 8 KB ROMH image of each bank (A000..BFFF or E000..FFFF), or NULL
+    uint8_t ram[256];           // EasyFlash RAM at DF00..DFFF
+} c64_cart_t;
+
+// the REU registers, see "RAM Expansion Unit"
+typedef struct {
+    uint8_t* mem;               // the REU memory from c64_desc_t, or NULL without REU
+    uint32_t size;              // size of the REU memory, a power of 2
+    uint32_t dma;               // ticks left to stop the CPU for the current transfer
+    uint8_t status;             // DF00
+    uint8_t command;            // DF01
+    uint8_t irq_mask;           // DF09
+    uint8_t addr_ctrl;          // DF0A
+    uint16_t c64_addr;          // DF02..DF03
+    uint16_t length;            // DF07..DF08, 0 means 64 KB
+    uint32_t reu_addr;          // DF04..DF06
+    uint16_t c64_base;          // the values loaded back into the address and length registers with autoload
+    uint16_t length_base;
+    uint32_t reu_base;
+    bool bus;                   // true if the transfer is done a byte each tick on the bus
+    bool swap_write;            // true in the write tick of a byte swapped on the bus
+    bool vic_ba;                // true if the VIC-II requested the bus in the last tick
+    uint8_t latch;              // the byte being swapped
+    uint64_t cpu_pins;          // the CPU pins while the REU uses the bus
+} c64_reu_t;
+
+// BASIC and KERNAL routines replaced by native versions, see "ROM Traps"
+#define C64_TRAP_BLTU       (1<<0)  // BASIC memory move (A3BF)
+#define C64_TRAP_MLTPLY     (1<<1)  // BASIC floating point multiplication by a byte (BA59 and BA5E)
+#define C64_TRAP_FDIVT      (1<<2)  // BASIC floating point division (BB12)
+#define C64_TRAP_MOVLIN     (1<<3)  // KERNAL screen line copy (E9C8)
+#define C64_TRAP_CLRLIN     (1<<4)  // KERNAL screen line clear (E9FF)
+#define C64_NUM_TRAPS       (5)
+#define C64_TRAPS_ALL       ((1<<C64_NUM_TRAPS)-1)
+#define C64_TRAP_MEM_SIZE   (0x10000+0x400)     // the memory the ROM traps write: RAM, then color RAM
+
+// ROM traps counters, indexed by the C64_TRAP_* bit number
+typedef struct {
+    uint64_t calls[C64_NUM_TRAPS];      // calls run by the native versions, or verified in the test mode
+    uint64_t mismatches[C64_NUM_TRAPS]; // verified calls where the ROM code did something else
+} c64_trap_stats_t;
+
+// ROM traps test mode, provided by the caller and only written by the emulator
+typedef struct {
+    uint8_t state;              // no call, call starting or ROM code running
+    uint8_t trap;               // the trap being verified
+    uint8_t opcode;             // the first opcode of its ROM code
+    uint8_t depth;              // nesting level of the interrupt handler being executed, 0 if none
+    uint8_t s;                  // stack pointer at the entry
+    uint16_t ret;               // return address
+    uint8_t a, x, y, p;         // registers left by the native version
+    uint64_t native[C64_TRAP_MEM_SIZE/64];      // bit set for each address written by the native version
+    uint64_t rom[C64_TRAP_MEM_SIZE/64];         // ... by the ROM code
+    uint64_t clobbered[C64_TRAP_MEM_SIZE/64];   // ... by an interrupt handler while the ROM code ran
+    uint8_t before[C64_TRAP_MEM_SIZE];          // memory before the native version ran
+    uint8_t expect[C64_TRAP_MEM_SIZE];          // ... and after
+} c64_trap_verify_t;
+
+// ROM traps state
+typedef struct {
+    uint32_t mask;              // enabled C64_TRAP_*
+    uint32_t usable;            // C64_TRAP_* written for the ROM images in use
+    c64_trap_verify_t* verify;  // test mode state, or NULL
+    c64_trap_stats_t stats;
+    bool pending;               // an RTS was put on the data bus in place of the first opcode of a routine
+    bool capture;               // record the writes of the native version into verify
+    uint8_t trap;               // the pending trap
+    uint8_t opcode;             // the opcode replaced by the RTS
+    uint8_t a, x, y, p;         // registers computed at the entry by the floating point routines
+    uint64_t zp_written[8];     // bit set for each byte of zp written by them
+    uint8_t zp[0x200];          // zero page and stack as computed by them
+} c64_traps_t;
+
+// one instruction in the trace ring, see "Instruction Trace"
+typedef struct {
+    uint16_t pc;                // address of the opcode
+    uint8_t opcode;
+    uint8_t a, x, y, s, p;      // registers before the instruction is executed
+    uint16_t ticks;             // ticks since the previous opcode fetch, at most 0xFFFF
+} c64_trace_entry_t;
+
+// instruction trace ring state
+typedef struct {
+    c64_trace_entry_t* ring;    // NULL if not tracing
+    uint32_t mask;              // ring entries - 1
+    uint32_t ticks;             // ticks since the last traced opcode fetch
+    uint64_t head;              // entries written so far
+} c64_trace_t;
+
+// screen rows written, see "Screen Damage"
+#define C64_DAMAGE_TOP (1U<<25)       // the lines above text row 0
+#define C64_DAMAGE_BOTTOM (1U<<26)    // the lines below text row 24
+#define C64_DAMAGE_ALL (1U<<31)
+typedef struct {
+    uint64_t watch;             // bit N set if the VIC-II displays 1 KB RAM page N
+    uint32_t rows;              // bit N set if text row N was written, C64_DAMAGE_TOP/BOTTOM/ALL
+    uint32_t prev[2];           // the rows written before the last two c64_damage() calls
+} c64_damage_t;
+
+// memory access counters, see "Memory Heatmap"
+#define C64_HEAT_READ   (0)     // CPU reads, opcode fetches excluded
+#define C64_HEAT_WRITE  (1)     // CPU writes
+#define C64_HEAT_EXEC   (2)     // CPU opcode fetches
+#define C64_HEAT_VIC    (3)     // VIC-II fetches
+#define C64_HEAT_NUM    (4)
+typedef struct {
+    uint64_t page[256][C64_HEAT_NUM];   // per 256 byte page
+    uint64_t (*byte)[C64_HEAT_NUM];     // optional per byte counters (0x10000 items), or NULL
+} c64_heatmap_t;
+
+// CPU ticks of one raster line, see "Raster Time Profile"
+typedef struct {
+    uint8_t irq;                // ticks spent in IRQ (and BRK) handlers
+    uint8_t nmi;                // ticks spent in NMI handlers
+    uint8_t stolen;             // ticks the CPU was stopped by the VIC-II
+} c64_raster_line_t;
+
+typedef struct c64_raster_profile_t c64_raster_profile_t;
+// called when a frame ends, profile->lines holds the counters of each raster line
+typedef void (*c64_raster_profile_cb_t)(const c64_raster_profile_t* profile, void* user_data);
+
+// raster time profiler, provided by the caller
+struct c64_raster_profile_t {
+    c64_raster_profile_cb_t func;
+    void* user_data;
+    // written by the emulator
+    uint64_t frame;             // frames ended so far
+    uint16_t line;              // raster line of the last tick
+    uint8_t depth;              // nesting level of the interrupt handler being executed, 0 if none
+    uint8_t nmi_mask;           // bit N set if the handler at nesting level N+1 is an NMI handler
+    c64_raster_line_t lines[M6569_VTOTAL];
+};
+
 // config parameters for c64_init()
 typedef struct {
     bool c1530_enabled;     // true to enable the C1530 datassette emulation
     bool c1541_enabled;     // true to enable the C1541 floppy drive emulation
+    bool c1541_threaded;    // true if the drive is ticked by another thread via c64_drive_step()
+    bool video_threaded;    // true if the raster lines are output by another thread via c64_video_step(), needs a LINE or FRAME accuracy
     c64_joystick_type_t joystick_type;  // default is C64_JOYSTICK_NONE
+    c64_accuracy_t accuracy;    // default is C64_ACCURACY_CYCLE
+    uint32_t traps;         // C64_TRAP_* routines to replace with native versions in C64_ACCURACY_FRAME
+    c64_trap_verify_t* trap_verify; // optional ROM traps test mode
     chips_debug_t debug;    // optional debugging hook
+    chips_range_t trace;    // with C64_TRACE, optional instruction trace ring (a power of 2 of c64_trace_entry_t)
+    c64_heatmap_t* heatmap; // with C64_HEATMAP, optional memory access counters
+    c64_raster_profile_t* raster_profile;   // with C64_RASTER_PROFILE, optional raster time profiler
+    chips_range_t reu;      // optional REU memory, 128 KB to 16 MB (a power of 2), not copied or cleared
     chips_audio_desc_t audio;   // audio output options
-    // ROM images
+    // ROM images, not copied: they must stay valid as long as the instance is used
     struct {
         chips_range_t chars;     // 4 KByte character ROM dump
         chips_range_t basic;     // 8 KByte BASIC dump
@@ -341,47 +807,112 @@ typedef struct {
     void *crt_set_pixel_fb;
 } c64_desc_t;
 
-// C64 emulator state
+#define C64_DRIVE_RING_SIZE (256)              // max queued C64 bus changes, must be a power of 2
+#define C64_DRIVE_MAX_LEAD (C64_FREQUENCY/50)  // max ticks the C64 can run ahead of a threaded drive
+#define C64_DRIVE_PUBLISH_TICKS (64)           // the drive thread gets new work every that many ticks
+
+// synchronization with a floppy drive running on its own thread
 typedef struct {
-    m6502_t cpu;
+    bool enabled;
+    // written by the C64 side
+    uint64_t ticks;             // ticks executed by the C64
+    uint64_t published;         // ticks the drive is allowed to run
+    uint32_t head;              // ring write position
+    uint8_t last_out;           // last C64 bus output queued for the drive
+    uint8_t drive_out;          // drive bus output, as of the last wait for the drive
+    // changes of the lines pulled low by the C64, this also keeps the
+    // fields of the two sides in different cache lines
+    struct {
+        uint64_t tick;
+        uint8_t iec_out;
+    } ring[C64_DRIVE_RING_SIZE];
+    // written by the drive side
+    uint64_t drive_ticks;       // ticks executed by the drive
+    uint32_t tail;              // ring read position
+    uint8_t c64_out;            // C64 bus output at the drive's current tick
+    uint8_t bus;                // IEC bus as seen by the drive (c1541_t.iec points here)
+} c64_drive_sync_t;
+
+#define C64_VIDEO_RING_SIZE (64)    // max raster lines queued for a video thread, must be a power of 2
+
+// raster lines handed over to a video thread
+typedef struct {
+    bool enabled;
+    uint32_t head;              // ring write position, written by the C64 side
+    alignas(64) uint32_t tail;  // ring read position, written by the video side
+    alignas(64) m6569_line_t ring[C64_VIDEO_RING_SIZE];
+} c64_video_sync_t;
+
+/* C64 emulator state
+
+    The state accessed by every tick comes first, packed together and
+    starting at a cache line boundary, followed by the 64 KB RAM. The
+    bulky data only needed now and then (the memory mapping layers, the
+    audio sample buffer, the VIC-II memory mapping and the optional floppy
+    drive) sits behind them, and the ROMs are not copied at all. The effect
+    of the layout on the cache misses hasn't been measured: c64-bench
+    --cache reports them on hosts that expose the perf counters.
+*/
+typedef struct {
+    // per-tick state
+    alignas(64) m6502_t cpu;
     m6526_t cia_1;
     m6526_t cia_2;
     m6569_t vic;
     m6581_t sid;
     uint64_t pins;
-
-    c64_joystick_type_t joystick_type;
+    uint64_t ram_dirty;         // bit N set if 1 KB RAM page N was written since the last c64_restore_dirty()
+    uint64_t ram_shared;        // bit N set if 1 KB RAM page N is still shared with the forked machine (ram_src)
+    chips_debug_t debug;
+    bool valid;
     bool io_mapped;             // true when D000..DFFF has IO area mapped in
     uint8_t cas_port;           // cassette port, shared with c1530_t if datasette is connected
-    uint8_t iec_port;           // IEC serial port, shared with c1541_t if connected
+    uint8_t iec_port;           // IEC serial bus, C64_IECPORT_* bits set while a line is pulled low, shared with c1541_t
+    uint8_t iec_out;            // IEC lines pulled low by the C64 (CIA-2 port A)
     uint8_t cpu_port;           // last state of CPU port (for memory mapping)
     uint8_t kbd_joy1_mask;      // current joystick-1 state from keyboard-joystick emulation
     uint8_t kbd_joy2_mask;      // current joystick-2 state from keyboard-joystick emulation
     uint8_t joy_joy1_mask;      // current joystick-1 state from c64_joystick()
     uint8_t joy_joy2_mask;      // current joystick-2 state from c64_joystick()
     uint16_t vic_bank_select;   // upper 4 address bits from CIA-2 port A
-
-    kbd_t kbd;                  // keyboard matrix state
-    mem_t mem_cpu;              // CPU-visible memory mapping
-    mem_t mem_vic;              // VIC-visible memory mapping
-    bool valid;
-    chips_debug_t debug;
-
+    uint32_t tod_countdown;     // ticks until the next CIA TOD pin pulse
+    c64_damage_t damage;        // screen rows written since the last c64_damage()
+    c64_reu_t reu;              // RAM expansion unit
+    c64_trace_t trace;          // instruction trace, only written when compiled with C64_TRACE
+    c64_heatmap_t* heatmap;     // memory access counters, only written when compiled with C64_HEATMAP
+    c64_raster_profile_t* raster_profile;   // raster time profiler, only written when compiled with C64_RASTER_PROFILE
+    kbd_t kbd;                  // keyboard matrix state, scanned by CIA-1 every tick
+    uint8_t color_ram[1024];    // special static color ram
+    mem_t mem_cpu;              // CPU-visible memory mapping, only the page table in front is used per tick
+    alignas(64) uint8_t ram[1<<16];     // general ram
+
+    // accessed now and then
+    c64_joystick_type_t joystick_type;
     struct {
         chips_audio_callback_t callback;
         int num_samples;
         int sample_pos;
         float sample_buffer[C64_MAX_AUDIO_SAMPLES];
     } audio;
-
-    uint8_t color_ram[1024];        // special static color ram
-    uint8_t ram[1<<16];             // general ram
-    uint8_t rom_char[0x1000];       // 4 KB character ROM image
-    uint8_t rom_basic[0x2000];      // 8 KB BASIC ROM image
-    uint8_t rom_kernal[0x2000];     // 8 KB KERNAL V3 ROM image
+    mem_t mem_vic;              // VIC-visible memory mapping (the VIC-II itself decodes it in _c64_vic_fetch())
+    const uint8_t* rom_char;    // 4 KB character ROM image, from c64_desc_t
+    const uint8_t* rom_basic;   // 8 KB BASIC ROM image, from c64_desc_t
+    const uint8_t* rom_kernal;  // 8 KB KERNAL V3 ROM image, from c64_desc_t
+    uint32_t rom_hash;          // hash of all the ROM images, snapshots only load into a machine with the same ROMs
+    const uint8_t* ram_src[64]; // where the pages in ram_shared actually are, in the RAM of the forked machine or its base
+    uint64_t reu_shared[4];     // bit N set if 64 KB REU page N is still shared with the forked machine (reu_src)
+    uint64_t reu_dirty[4];      // bit N set if 64 KB REU page N was written since the last c64_restore_dirty()
+    const uint8_t* reu_src[256];    // where the pages in reu_shared actually are, in the REU memory of the forked machine or its base
+    uint32_t num_forks;         // live machines forked from this one, it can't change until they are discarded
+    uint32_t* fork_base;        // num_forks of the machine this one was forked from, or NULL
+    c64_cart_t cart;            // expansion port cartridge
+    c64_traps_t traps;          // native versions of ROM routines
 
     // c1530_t c1530;      // optional datassette
-    // c1541_t c1541;      // optional floppy drive
+    c1541_t c1541;          // optional floppy drive (c1541.valid is true if enabled)
+    // the thread synchronization state must be last
+    c64_drive_sync_t drive_sync;    // only used with c64_desc_t.c1541_threaded
+    c64_video_sync_t video_sync;    // only used with c64_desc_t.video_threaded
 } c64_t;
 
 // initialize a new C64 instance
@@ -394,6 +925,20 @@ void c64_reset(c64_t* sys);
 chips_display_info_t c64_display_info(c64_t* sys);
 // tick C64 instance for a given number of microseconds, return number of ticks executed
 uint32_t c64_exec(c64_t* sys, uint32_t micro_seconds);
+// tick C64 instance for a given number of ticks, return number of ticks executed (less if the debug callback stopped execution)
+uint32_t c64_exec_ticks(c64_t* sys, uint32_t num_ticks);
+// set the emulation accuracy, the switch happens at the start of the next frame
+void c64_set_accuracy(c64_t* sys, c64_accuracy_t accuracy);
+// get the emulation accuracy (the one that will be used from the next frame on)
+c64_accuracy_t c64_accuracy(c64_t* sys);
+// replace the C64_TRAP_* ROM routines with native versions in C64_ACCURACY_FRAME, returns the ones enabled
+uint32_t c64_set_traps(c64_t* sys, uint32_t mask);
+// get the calls of the ROM traps, and the mismatches in the test mode
+c64_trap_stats_t c64_trap_stats(const c64_t* sys);
+// get the text rows that may have changed since the last call, and clear them
+uint32_t c64_damage(c64_t* sys);
+// get the framebuffer lines from y0 (included) to y1 (excluded) where the rows can be drawn, false if none
+bool c64_damage_lines(uint32_t rows, int* y0, int* y1);
 // send a key-down event to the C64
 void c64_key_down(c64_t* sys, int key_code);
 // send a key-up event to the C64
@@ -418,10 +963,40 @@ void c64_tape_play(c64_t* sys);
 void c64_tape_stop(c64_t* sys);
 // return true if tape motor is on
 bool c64_is_tape_motor_on(c64_t* sys);
+// insert a .d64 or .g64 disc image into the floppy drive (c1541 must be enabled), see c1541_insert_disc()
+bool c64_insert_disc(c64_t* sys, chips_range_t data);
+// remove the disc from the floppy drive, saving pending writes into the image
+void c64_remove_disc(c64_t* sys);
+// insert a cartridge as .CRT file and reset, returns false if the format or hardware type is not supported
+bool c64_insert_cart(c64_t* sys, chips_range_t data);
+// remove the cartridge and reset
+void c64_remove_cart(c64_t* sys);
+// return true if a cartridge is inserted
+bool c64_cart_inserted(c64_t* sys);
 // save a snapshot, patches pointers to zero and offsets, returns snapshot version
 uint32_t c64_save_snapshot(c64_t* sys, c64_t* dst);
 // load a snapshot, returns false if snapshot versions don't match
 bool c64_load_snapshot(c64_t* sys, uint32_t version, c64_t* src);
+// restore a plain copy of the same instance (*base = *sys), only copying back the RAM pages written since
+void c64_restore_dirty(c64_t* sys, const c64_t* base);
+// clone a machine into fork sharing the RAM copy-on-write, sys can't change until the fork is discarded (no REU)
+void c64_fork(c64_t* sys, c64_t* fork);
+// like c64_fork() for a machine with a REU, reu is the REU memory of the fork (same size), sharing the pages copy-on-write
+void c64_fork_reu(c64_t* sys, c64_t* fork, chips_range_t reu);
+// write a byte to memory like the CPU does (RAM under the ROMs, color RAM if IO is mapped), copying a shared RAM page first
+void c64_mem_write(c64_t* sys, uint16_t addr, uint8_t data);
+// get the VIC-II bus usage counters of the last complete frame (see "Bus Statistics" in m6569.h)
+m6569_stats_t c64_vic_stats(const c64_t* sys);
+// get the traced instructions oldest first, as up to 2 parts of the ring, returns the number of parts
+int c64_trace_parts(const c64_t* sys, chips_range_t parts[2]);
+// run a threaded floppy drive up to the C64 tick, call in a loop from the drive thread, returns ticks executed
+uint32_t c64_drive_step(c64_t* sys);
+// wait until a threaded floppy drive caught up with the C64, after this the drive state can be accessed
+void c64_drive_sync(c64_t* sys);
+// output the raster lines queued for the video thread, call in a loop from the video thread, returns lines output
+uint32_t c64_video_step(c64_t* sys);
+// wait until the video thread output all the queued raster lines (c64_exec() does it before returning)
+void c64_video_sync(c64_t* sys);
 // perform a RUN BASIC call
 void c64_basic_run(c64_t* sys);
 // perform a LOAD BASIC call
@@ -438,6 +1013,7 @@ uint16_t c64_syscall_return_addr(void);
 /*-- IMPLEMENTATION ----------------------------------------------------------*/
 #ifdef CHIPS_IMPL
 #include <string.h> // memcpy, memset
+#include <sched.h>  // sched_yield
 #ifndef CHIPS_ASSERT
     #include <assert.h>
     #define CHIPS_ASSERT(c) assert(c)
@@ -447,19 +1023,70 @@ uint16_t c64_syscall_return_addr(void);
 #define _C64_SCREEN_HEIGHT (272)
 #define _C64_SCREEN_X (64)
 #define _C64_SCREEN_Y (24)
+#define _C64_TEXT_Y (33)           // framebuffer line of the first text row with YSCROLL 0 (raster line 0x30)
+#define _C64_TOD_PERIOD (C64_FREQUENCY/50)   // CIA TOD pins pulse at the 50 Hz power line frequency
+#define _C64_DRIVE_RING_MASK (C64_DRIVE_RING_SIZE-1)
+#define _C64_VIDEO_RING_MASK (C64_VIDEO_RING_SIZE-1)
+
+// features selecting a specialized tick loop
+#define _C64_EXEC_DEBUG (1<<0)     // debug callback after each tick
+#define _C64_EXEC_AUDIO (1<<1)     // audio callback, SID samples must be generated
+#define _C64_EXEC_VIDEO (1<<2)     // crt_set_pixel callback
+#define _C64_EXEC_DRIVE (1<<3)     // floppy drive attached
+#define _C64_EXEC_TRAPS (1<<4)     // ROM traps or their test mode
+#define _C64_EXEC_VARIANTS (32)
+// ROM traps test mode states
+#define _C64_VERIFY_IDLE (0)
+#define _C64_VERIFY_START (1)   // the first opcode was fetched, the ROM code runs unless an interrupt is taken
+#define _C64_VERIFY_ROM (2)     // the ROM code is running
+#if defined(__GNUC__)
+    #define _C64_ALWAYS_INLINE __attribute__((always_inline))
+#else
+    #define _C64_ALWAYS_INLINE
+#endif
+#define _C64_THREAD_SPINS (1000)  // busy waits for the drive or video thread before yielding the CPU
+#if defined(__x86_64__) || defined(__i386__)
+    #define _C64_SPIN() __builtin_ia32_pause()
+#else
+    #define _C64_SPIN()
+#endif
 
 static uint8_t _c64_cpu_port_in(void* user_data);
 static void _c64_cpu_port_out(uint8_t data, void* user_data);
 static uint16_t _c64_vic_fetch(uint16_t addr, void* user_data);
 static void _c64_update_memory_map(c64_t* sys);
+static void _c64_reu_reset(c64_t* sys);
 static void _c64_init_key_map(c64_t* sys);
+static void _c64_init_ram(c64_t* sys);
 static void _c64_init_memory_map(c64_t* sys);
+static void _c64_map_shared_ram(c64_t* sys, uint16_t from_addr);
+static void _c64_unshare_ram(c64_t* sys, uint64_t mask);
+static void _c64_damage_all(c64_t* sys);
+static void _c64_damage_ram(c64_t* sys, uint16_t addr);
+static void _c64_damage_color(c64_t* sys, uint16_t addr);
+static void _c64_damage_vic(c64_t* sys, uint8_t reg, uint8_t old);
 
 #define _C64_DEFAULT(val,def) (((val) != 0) ? (val) : (def))
 
+// 32-bit FNV-1a, identifies the ROM images a snapshot was taken with
+#define _C64_ROM_HASH_INIT (2166136261u)
+#define _C64_TRAP_BASIC_HASH (0x3DD934EDu)     // BASIC V2, the ROM traps were written for it
+#define _C64_TRAP_KERNAL_HASH (0x0D9B7E21u)    // KERNAL 901227-03
+static uint32_t _c64_rom_hash(uint32_t hash, chips_range_t rom) {
+    const uint8_t* ptr = (const uint8_t*) rom.ptr;
+    for (size_t i = 0; i < rom.size; i++) {
+        hash = (hash ^ ptr[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void _c64_video_line(const m6569_line_t* line, void* user_data);
+
 void c64_init(c64_t* sys, const c64_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
     if (desc->debug.callback.func) { CHIPS_ASSERT(desc->debug.stopped); }
+    // the cycle by cycle decoding can't be threaded
+    if (desc->video_threaded) { CHIPS_ASSERT(desc->accuracy != C64_ACCURACY_CYCLE); }
 
     memset(sys, 0, sizeof(c64_t));
     sys->valid = true;
@@ -468,17 +1095,61 @@ void c64_init(c64_t* sys, const c64_desc_t* desc) {
     sys->audio.callback = desc->audio.callback;
     sys->audio.num_samples = _C64_DEFAULT(desc->audio.num_samples, C64_DEFAULT_AUDIO_SAMPLES);
     CHIPS_ASSERT(sys->audio.num_samples <= C64_MAX_AUDIO_SAMPLES);
-    CHIPS_ASSERT(desc->roms.chars.ptr && (desc->roms.chars.size == sizeof(sys->rom_char)));
-    CHIPS_ASSERT(desc->roms.basic.ptr && (desc->roms.basic.size == sizeof(sys->rom_basic)));
-    CHIPS_ASSERT(desc->roms.kernal.ptr && (desc->roms.kernal.size == sizeof(sys->rom_kernal)));
-    memcpy(sys->rom_char, desc->roms.chars.ptr, sizeof(sys->rom_char));
-    memcpy(sys->rom_basic, desc->roms.basic.ptr, sizeof(sys->rom_basic));
-    memcpy(sys->rom_kernal, desc->roms.kernal.ptr, sizeof(sys->rom_kernal));
+    CHIPS_ASSERT(desc->roms.chars.ptr && (desc->roms.chars.size == 0x1000));
+    CHIPS_ASSERT(desc->roms.basic.ptr && (desc->roms.basic.size == 0x2000));
+    CHIPS_ASSERT(desc->roms.kernal.ptr && (desc->roms.kernal.size == 0x2000));
+    #ifndef C64_TRACE
+    CHIPS_ASSERT(0 == desc->trace.ptr);
+    #endif
+    #ifndef C64_HEATMAP
+    CHIPS_ASSERT(0 == desc->heatmap);
+    #endif
+    #ifndef C64_RASTER_PROFILE
+    CHIPS_ASSERT(0 == desc->raster_profile);
+    #endif
+    sys->rom_char = (const uint8_t*) desc->roms.chars.ptr;
+    sys->rom_basic = (const uint8_t*) desc->roms.basic.ptr;
+    sys->rom_kernal = (const uint8_t*) desc->roms.kernal.ptr;
+    if (_c64_rom_hash(_C64_ROM_HASH_INIT, desc->roms.basic) == _C64_TRAP_BASIC_HASH) {
+        sys->traps.usable |= C64_TRAP_BLTU|C64_TRAP_MLTPLY|C64_TRAP_FDIVT;
+    }
+    if (_c64_rom_hash(_C64_ROM_HASH_INIT, desc->roms.kernal) == _C64_TRAP_KERNAL_HASH) {
+        sys->traps.usable |= C64_TRAP_MOVLIN|C64_TRAP_CLRLIN;
+    }
+    sys->traps.mask = desc->traps & sys->traps.usable;
+    sys->traps.verify = desc->trap_verify;
+    if (sys->traps.verify) {
+        sys->traps.verify->state = _C64_VERIFY_IDLE;
+    }
 
     // initialize the hardware
     sys->cpu_port = 0xF7;       // for initial memory mapping
     sys->io_mapped = true;
     sys->cas_port = C64_CASPORT_MOTOR|C64_CASPORT_SENSE;
+    sys->tod_countdown = _C64_TOD_PERIOD;
+    if (desc->trace.ptr) {
+        const size_t num_entries = desc->trace.size / sizeof(c64_trace_entry_t);
+        CHIPS_ASSERT((num_entries > 0) && ((num_entries & (num_entries - 1)) == 0));
+        sys->trace.ring = (c64_trace_entry_t*) desc->trace.ptr;
+        sys->trace.mask = (uint32_t)(num_entries - 1);
+    }
+    sys->heatmap = desc->heatmap;
+    if (desc->reu.ptr) {
+        CHIPS_ASSERT((desc->reu.size >= 0x20000) && (desc->reu.size <= 0x1000000));
+        CHIPS_ASSERT((desc->reu.size & (desc->reu.size - 1)) == 0);
+        sys->reu.mem = (uint8_t*) desc->reu.ptr;
+        sys->reu.size = (uint32_t) desc->reu.size;
+    }
+    _c64_reu_reset(sys);
+    sys->raster_profile = desc->raster_profile;
+    if (sys->raster_profile) {
+        CHIPS_ASSERT(sys->raster_profile->func);
+        sys->raster_profile->frame = 0;
+        sys->raster_profile->line = 0;
+        sys->raster_profile->depth = 0;
+        sys->raster_profile->nmi_mask = 0;
+        memset(sys->raster_profile->lines, 0, sizeof(sys->raster_profile->lines));
+    }
 
     sys->pins = m6502_init(&sys->cpu, &(m6502_desc_t) {
         .m6510_in_cb = _c64_cpu_port_in,
@@ -500,18 +1171,47 @@ void c64_init(c64_t* sys, const c64_desc_t* desc) {
         .user_data = sys,
         .crt_set_pixel = desc->crt_set_pixel,
         .crt_set_pixel_fb = desc->crt_set_pixel_fb,
+        // the accuracy tiers map 1:1 to the VIC-II render modes
+        .render_mode = (int) desc->accuracy,
+        .line_cb = desc->video_threaded ? _c64_video_line : 0,
     });
+    sys->video_sync.enabled = desc->video_threaded;
     m6581_init(&sys->sid, &(m6581_desc_t){
         .tick_hz = C64_FREQUENCY,
         .sound_hz = _C64_DEFAULT(desc->audio.sample_rate, 44100),
         .magnitude = _C64_DEFAULT(desc->audio.volume, 1.0f),
     });
+    if (desc->c1541_enabled) {
+        sys->drive_sync.enabled = desc->c1541_threaded;
+        c1541_init(&sys->c1541, &(c1541_desc_t){
+            .iec_port = desc->c1541_threaded ? &sys->drive_sync.bus : &sys->iec_port,
+            .roms = {
+                .c000_dfff = desc->roms.c1541.c000_dfff,
+                .e000_ffff = desc->roms.c1541.e000_ffff,
+            },
+        });
+    }
     _c64_init_key_map(sys);
+    _c64_init_ram(sys);
     _c64_init_memory_map(sys);
+    _c64_damage_all(sys);
+
+    sys->rom_hash = _c64_rom_hash(_C64_ROM_HASH_INIT, desc->roms.chars);
+    sys->rom_hash = _c64_rom_hash(sys->rom_hash, desc->roms.basic);
+    sys->rom_hash = _c64_rom_hash(sys->rom_hash, desc->roms.kernal);
+    if (desc->c1541_enabled) {
+        sys->rom_hash = _c64_rom_hash(sys->rom_hash, desc->roms.c1541.c000_dfff);
+        sys->rom_hash = _c64_rom_hash(sys->rom_hash, desc->roms.c1541.e000_ffff);
+    }
 }
 
 void c64_discard(c64_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
+    CHIPS_ASSERT(sys->num_forks == 0);
+    if (sys->fork_base) {
+        *sys->fork_base -= 1;
+        sys->fork_base = 0;
+    }
     sys->valid = false;
 }
 
@@ -522,19 +1222,617 @@ void c64_reset(c64_t* sys) {
     sys->joy_joy1_mask = sys->joy_joy2_mask = 0;
     sys->io_mapped = true;
     sys->cas_port = C64_CASPORT_MOTOR|C64_CASPORT_SENSE;
+    sys->tod_countdown = _C64_TOD_PERIOD;
+    sys->cart.bank = 0;
+    sys->cart.lines = sys->cart.reset_lines;
+    _c64_reu_reset(sys);
     _c64_update_memory_map(sys);
     sys->pins |= M6502_RES;
     m6526_reset(&sys->cia_1);
     m6526_reset(&sys->cia_2);
     m6569_reset(&sys->vic);
     m6581_reset(&sys->sid);
+    _c64_damage_all(sys);
+    if (sys->c1541.valid) {
+        c64_drive_sync(sys);
+        c1541_reset(&sys->c1541);
+        sys->drive_sync.drive_out = sys->c1541.iec_out;
+    }
+}
+
+/* wait for the drive or video thread to make progress */
+static void _c64_thread_wait(uint32_t* spins) {
+    // don't steal the CPU from the other thread on a busy host
+    if (++(*spins) < _C64_THREAD_SPINS) {
+        _C64_SPIN();
+    }
+    else {
+        sched_yield();
+    }
+}
+
+static void _c64_drive_publish(c64_drive_sync_t* s) {
+    __atomic_store_n(&s->published, s->ticks, __ATOMIC_RELEASE);
+    uint32_t spins = 0;
+    while ((s->ticks - __atomic_load_n(&s->drive_ticks, __ATOMIC_ACQUIRE)) > C64_DRIVE_MAX_LEAD) {
+        _c64_thread_wait(&spins);
+    }
+}
+
+/* queue the C64 bus output for a threaded drive, and count the tick */
+static void _c64_drive_tick(c64_t* sys) {
+    c64_drive_sync_t* s = &sys->drive_sync;
+    bool publish = (++s->ticks % C64_DRIVE_PUBLISH_TICKS) == 0;
+    if (sys->iec_out != s->last_out) {
+        if ((s->head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE)) == C64_DRIVE_RING_SIZE) {
+            _c64_drive_publish(s);
+            uint32_t spins = 0;
+            while ((s->head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE)) == C64_DRIVE_RING_SIZE) {
+                _c64_thread_wait(&spins);
+            }
+        }
+        // the change happened in the tick just counted
+        s->ring[s->head & _C64_DRIVE_RING_MASK].tick = s->ticks - 1;
+        s->ring[s->head & _C64_DRIVE_RING_MASK].iec_out = sys->iec_out;
+        __atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+        s->last_out = sys->iec_out;
+        publish = true;
+    }
+    if (publish) {
+        _c64_drive_publish(s);
+    }
+    sys->iec_port = sys->iec_out | s->drive_out;
+}
+
+void c64_drive_sync(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    c64_drive_sync_t* s = &sys->drive_sync;
+    if (!s->enabled) {
+        return;
+    }
+    _c64_drive_publish(s);
+    uint32_t spins = 0;
+    while (__atomic_load_n(&s->drive_ticks, __ATOMIC_ACQUIRE) != s->ticks) {
+        _c64_thread_wait(&spins);
+    }
+    // the drive is stopped until the next publish
+    s->drive_out = sys->c1541.iec_out;
+}
+
+/* queue a raster line recorded by the VIC-II for the video thread */
+static void _c64_video_line(const m6569_line_t* line, void* user_data) {
+    c64_t* sys = (c64_t*) user_data;
+    c64_video_sync_t* s = &sys->video_sync;
+    uint32_t spins = 0;
+    while ((s->head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE)) == C64_VIDEO_RING_SIZE) {
+        _c64_thread_wait(&spins);
+    }
+    // only copy the register writes actually recorded
+    m6569_line_t* dst = &s->ring[s->head & _C64_VIDEO_RING_MASK];
+    memcpy(dst, line, offsetof(m6569_line_t, writes));
+    memcpy(dst->writes, line->writes, line->num_writes * sizeof(m6569_line_write_t));
+    __atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t c64_video_step(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid && sys->video_sync.enabled);
+    c64_video_sync_t* s = &sys->video_sync;
+    const uint32_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = s->tail;
+    uint32_t num_lines = 0;
+    while (tail != head) {
+        m6569_render_line(&sys->vic, &s->ring[tail & _C64_VIDEO_RING_MASK]);
+        tail++;
+        num_lines++;
+        // the slot can be reused right away
+        __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+    }
+    return num_lines;
+}
+
+void c64_video_sync(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    c64_video_sync_t* s = &sys->video_sync;
+    if (!s->enabled) {
+        return;
+    }
+    uint32_t spins = 0;
+    while (__atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) != s->head) {
+        _c64_thread_wait(&spins);
+    }
+}
+
+uint32_t c64_drive_step(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid && sys->drive_sync.enabled);
+    c64_drive_sync_t* s = &sys->drive_sync;
+    const uint64_t limit = __atomic_load_n(&s->published, __ATOMIC_ACQUIRE);
+    const uint32_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    uint64_t ticks = s->drive_ticks;
+    uint32_t tail = s->tail;
+    uint32_t num_ticks = 0;
+    while (ticks < limit) {
+        while ((tail != head) && (s->ring[tail & _C64_DRIVE_RING_MASK].tick <= ticks)) {
+            s->c64_out = s->ring[tail & _C64_DRIVE_RING_MASK].iec_out;
+            tail++;
+        }
+        s->bus = s->c64_out | sys->c1541.iec_out;
+        c1541_tick(&sys->c1541);
+        ticks++;
+        num_ticks++;
+        if ((num_ticks % C64_DRIVE_PUBLISH_TICKS) == 0) {
+            __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+            __atomic_store_n(&s->drive_ticks, ticks, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->drive_ticks, ticks, __ATOMIC_RELEASE);
+    return num_ticks;
+}
+
+#ifdef C64_TRACE
+/* record the instruction whose opcode is on the bus */
+static void _c64_trace(c64_t* sys, uint64_t pins) {
+    c64_trace_t* t = &sys->trace;
+    c64_trace_entry_t* e = &t->ring[t->head & t->mask];
+    e->pc = M6502_GET_ADDR(pins);
+    e->opcode = M6502_GET_DATA(pins);
+    e->a = sys->cpu.A;
+    e->x = sys->cpu.X;
+    e->y = sys->cpu.Y;
+    e->s = sys->cpu.S;
+    e->p = sys->cpu.P;
+    e->ticks = (t->ticks > 0xFFFF) ? 0xFFFF : (uint16_t)t->ticks;
+    t->ticks = 0;
+    // readers only look at the entries before head
+    __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+#ifdef C64_HEATMAP
+static inline void _c64_heat(c64_heatmap_t* h, uint16_t addr, int kind) {
+    h->page[addr >> 8][kind]++;
+    if (h->byte) {
+        h->byte[addr][kind]++;
+    }
+}
+#endif
+
+#ifdef C64_RASTER_PROFILE
+/* account the tick to the current raster line, called after the CPU tick */
+static void _c64_raster_profile(c64_t* sys, bool stalled) {
+    c64_raster_profile_t* p = sys->raster_profile;
+    const uint16_t line = sys->vic.rs.v_count;
+    if (line != p->line) {
+        if (line < p->line) {
+            p->func(p, p->user_data);
+            p->frame++;
+            memset(p->lines, 0, sizeof(p->lines));
+        }
+        p->line = line;
+    }
+    c64_raster_line_t* l = &p->lines[line];
+    if (stalled) {
+        // the CPU didn't move, so the instruction register is the same as in the previous tick
+        l->stolen++;
+    }
+    else if (sys->cpu.IR == ((0x00<<3)|1)) {
+        // the first tick of a BRK, forced by an interrupt or not
+        if (sys->cpu.brk_flags & M6502_BRK_RESET) {
+            p->depth = 0;
+        }
+        else if (p->depth < 8) {
+            const uint8_t bit = 1 << p->depth++;
+            if (sys->cpu.brk_flags & M6502_BRK_NMI) {
+                p->nmi_mask |= bit;
+            }
+            else {
+                p->nmi_mask &= ~bit;
+            }
+        }
+    }
+    if (p->depth > 0) {
+        if (p->nmi_mask & (1 << (p->depth - 1))) {
+            l->nmi++;
+        }
+        else {
+            l->irq++;
+        }
+        if (!stalled && (sys->cpu.IR == ((0x40<<3)|6))) {
+            // the last tick of an RTI
+            p->depth--;
+        }
+    }
+}
+#endif
+
+m6569_stats_t c64_vic_stats(const c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return m6569_frame_stats(&sys->vic);
+}
+
+int c64_trace_parts(const c64_t* sys, chips_range_t parts[2]) {
+    CHIPS_ASSERT(sys && parts);
+    const c64_trace_t* t = &sys->trace;
+    if (!t->ring) {
+        return 0;
+    }
+    const uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    const uint64_t size = (uint64_t)t->mask + 1;
+    const uint64_t count = (head < size) ? head : size;
+    const uint64_t first = (head - count) & t->mask;
+    const uint64_t count_0 = ((size - first) < count) ? (size - first) : count;
+    parts[0].ptr = &t->ring[first];
+    parts[0].size = count_0 * sizeof(c64_trace_entry_t);
+    parts[1].ptr = t->ring;
+    parts[1].size = (count - count_0) * sizeof(c64_trace_entry_t);
+    return (count == 0) ? 0 : ((count == count_0) ? 1 : 2);
+}
+
+/* a cartridge register or RAM access at IO1 (DE00..DEFF) or IO2 (DF00..DFFF),
+   the bank switches only remap the ROML/ROMH pages of the CPU memory map
+*/
+static uint64_t _c64_cart_io(c64_t* sys, uint64_t pins, uint16_t addr) {
+    c64_cart_t* cart = &sys->cart;
+    const uint8_t data = M6502_GET_DATA(pins);
+    uint8_t bank = cart->bank;
+    uint8_t lines = cart->lines;
+    if (pins & M6502_RW) {
+        // the registers are write-only, reads get the floating bus
+        if ((cart->type == C64_CART_EASYFLASH) && (addr >= 0xDF00)) {
+            M6502_SET_DATA(pins, cart->ram[addr & 0xFF]);
+        }
+        return pins;
+    }
+    switch (cart->type) {
+        case C64_CART_OCEAN:
+            if (addr < 0xDF00) {
+                bank = data & 0x3F;
+            }
+            break;
+        case C64_CART_MAGIC_DESK:
+            if (addr < 0xDF00) {
+                bank = data & 0x7F;
+                lines = (data & 0x80) ? 0 : C64_CART_EXROM;
+            }
+            break;
+        case C64_CART_EASYFLASH:
+            if (addr >= 0xDF00) {
+                cart->ram[addr & 0xFF] = data;
+            }
+            else if ((addr & 2) == 0) {
+                // DE00: bank register
+                bank = data & 0x3F;
+            }
+            else {
+                // DE02: control register, GAME from bit 0 or from the boot jumper
+                lines = (data & 2) ? C64_CART_EXROM : 0;
+                if (data & 4) {
+                    lines |= (data & 1) ? C64_CART_GAME : 0;
+                }
+                else {
+                    lines |= cart->reset_lines & C64_CART_GAME;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    if ((bank != cart->bank) || (lines != cart->lines)) {
+        cart->bank = bank;
+        cart->lines = lines;
+        _c64_update_memory_map(sys);
+    }
+    return pins;
+}
+
+#define _C64_REU_STATUS_IRQ     (1<<7)  // DF00: interrupt pending
+#define _C64_REU_STATUS_EOB     (1<<6)  // DF00: end of block
+#define _C64_REU_STATUS_FAULT   (1<<5)  // DF00: verify error
+#define _C64_REU_STATUS_256K    (1<<4)  // DF00: 256 KB RAM chips
+#define _C64_REU_EXECUTE        (1<<7)  // DF01: start a transfer
+#define _C64_REU_AUTOLOAD       (1<<5)  // DF01: restore the address and length registers after a transfer
+#define _C64_REU_FF00           (1<<4)  // DF01: start at once, not at a write to FF00
+#define _C64_REU_STASH          (0)     // DF01 bits 0..1: C64 to REU
+#define _C64_REU_FETCH          (1)     // DF01 bits 0..1: REU to C64
+#define _C64_REU_SWAP           (2)     // DF01 bits 0..1: exchange C64 and REU
+#define _C64_REU_VERIFY         (3)     // DF01 bits 0..1: compare C64 and REU
+#define _C64_REU_FIX_C64        (1<<7)  // DF0A: don't increment the C64 address
+#define _C64_REU_FIX_REU        (1<<6)  // DF0A: don't increment the REU address
+#define _C64_REU_PAGE_SHIFT     (16)    // the REU memory is shared with the forks in 64 KB pages
+#define _C64_REU_PAGE_SIZE      (1U<<_C64_REU_PAGE_SHIFT)
+
+/* the REU memory at addr (already masked to the REU size) for reading,
+   in a page still shared with the forked machine or in the own memory
+*/
+static inline const uint8_t* _c64_reu_rd(const c64_t* sys, uint32_t addr) {
+    const uint32_t page = addr >> _C64_REU_PAGE_SHIFT;
+    if (sys->reu_shared[page >> 6] & (1ULL << (page & 63))) {
+        return sys->reu_src[page] + (addr & (_C64_REU_PAGE_SIZE - 1));
+    }
+    return sys->reu.mem + addr;
+}
+
+// the REU memory at addr for writing, copying a page shared with the forked machine first
+static uint8_t* _c64_reu_wr(c64_t* sys, uint32_t addr) {
+    const uint32_t page = addr >> _C64_REU_PAGE_SHIFT;
+    const uint64_t page_mask = 1ULL << (page & 63);
+    if (sys->reu_shared[page >> 6] & page_mask) {
+        memcpy(sys->reu.mem + (page << _C64_REU_PAGE_SHIFT), sys->reu_src[page], _C64_REU_PAGE_SIZE);
+        sys->reu_shared[page >> 6] &= ~page_mask;
+    }
+    sys->reu_dirty[page >> 6] |= page_mask;
+    return sys->reu.mem + addr;
+}
+
+static void _c64_reu_reset(c64_t* sys) {
+    c64_reu_t* reu = &sys->reu;
+    uint8_t* mem = reu->mem;
+    const uint32_t size = reu->size;
+    memset(reu, 0, sizeof(c64_reu_t));
+    reu->mem = mem;
+    reu->size = size;
+    reu->status = (size >= 0x40000) ? _C64_REU_STATUS_256K : 0;
+    reu->command = _C64_REU_FF00;
+    reu->length = reu->length_base = 0xFFFF;
+}
+
+/* the end of a transfer after the last byte, or the first one that
+   doesn't match with verify
+*/
+static void _c64_reu_end(c64_reu_t* reu, bool fault) {
+    reu->status |= fault ? _C64_REU_STATUS_FAULT : _C64_REU_STATUS_EOB;
+    if ((reu->irq_mask & _C64_REU_STATUS_IRQ) && (reu->irq_mask & reu->status & (_C64_REU_STATUS_EOB|_C64_REU_STATUS_FAULT))) {
+        reu->status |= _C64_REU_STATUS_IRQ;
+    }
+    if (reu->command & _C64_REU_AUTOLOAD) {
+        reu->c64_addr = reu->c64_base;
+        reu->reu_addr = reu->reu_base;
+        reu->length = reu->length_base;
+    }
+    reu->bus = false;
+}
+
+// move to the next byte of a transfer, returns true after the last one
+static bool _c64_reu_next(c64_reu_t* reu) {
+    if (0 == (reu->addr_ctrl & _C64_REU_FIX_C64)) {
+        reu->c64_addr++;
+    }
+    if (0 == (reu->addr_ctrl & _C64_REU_FIX_REU)) {
+        reu->reu_addr = (reu->reu_addr + 1) & 0xFFFFFF;
+    }
+    if (reu->length == 1) {
+        return true;
+    }
+    reu->length--;
+    return false;
+}
+
+/* start the transfer of the command register, if the C64 memory involved
+   doesn't include the IO area, the whole transfer is done here, one 1 KB
+   page of the C64 memory map at a time, and the CPU is then stopped
+   for as long as the REU would take
+*/
+static void _c64_reu_start(c64_t* sys) {
+    c64_reu_t* reu = &sys->reu;
+    reu->command = (reu->command & ~_C64_REU_EXECUTE) | _C64_REU_FF00;
+    const uint8_t type = reu->command & 3;
+    const uint32_t len = reu->length ? reu->length : 0x10000;
+    const uint32_t ticks_per_byte = (type == _C64_REU_SWAP) ? 2 : 1;
+    const uint32_t c64_step = (reu->addr_ctrl & _C64_REU_FIX_C64) ? 0 : 1;
+    const uint32_t reu_step = (reu->addr_ctrl & _C64_REU_FIX_REU) ? 0 : 1;
+    if (sys->io_mapped) {
+        const uint16_t to_io = (uint16_t)(0xD000 - reu->c64_addr);
+        if (((reu->c64_addr & 0xF000) == 0xD000) || (c64_step && (to_io < len))) {
+            // the bus ticks and a last tick giving the bus back to the CPU
+            reu->bus = true;
+            reu->swap_write = false;
+            reu->dma = len * ticks_per_byte + 1;
+            return;
+        }
+    }
+    const uint32_t mask = reu->size - 1;
+    uint32_t left = len;
+    bool fault = false;
+    while (left && !fault) {
+        // a chunk doesn't cross a page of the C64 memory map or of the REU memory
+        const uint16_t c64_addr = reu->c64_addr;
+        const uint32_t reu_addr = reu->reu_addr & mask;
+        uint32_t num = left;
+        if (c64_step && (num > (MEM_PAGE_SIZE - (c64_addr & MEM_PAGE_MASK)))) {
+            num = MEM_PAGE_SIZE - (c64_addr & MEM_PAGE_MASK);
+        }
+        if (reu_step && (num > (_C64_REU_PAGE_SIZE - (reu_addr & (_C64_REU_PAGE_SIZE - 1))))) {
+            num = _C64_REU_PAGE_SIZE - (reu_addr & (_C64_REU_PAGE_SIZE - 1));
+        }
+        if ((type == _C64_REU_FETCH) || (type == _C64_REU_SWAP)) {
+            // the REU writes the C64 RAM, even under ROM
+            const uint64_t page_mask = 1ULL << (c64_addr >> 10);
+            if (sys->ram_shared & page_mask) {
+                _c64_unshare_ram(sys, page_mask);
+            }
+            sys->ram_dirty |= page_mask;
+            if (sys->damage.watch & page_mask) {
+                sys->damage.rows |= C64_DAMAGE_ALL;
+            }
+        }
+        const uint8_t* rd = sys->mem_cpu.page_table[c64_addr >> MEM_PAGE_SHIFT].read_ptr + (c64_addr & MEM_PAGE_MASK);
+        uint8_t* wr = sys->ram + c64_addr;
+        // the stash and the swap write the REU memory, copying a shared page first
+        uint8_t* ext_wr = ((type == _C64_REU_STASH) || (type == _C64_REU_SWAP)) ? _c64_reu_wr(sys, reu_addr) : 0;
+        const uint8_t* ext = ext_wr ? ext_wr : _c64_reu_rd(sys, reu_addr);
+        if (c64_step && reu_step && (type == _C64_REU_STASH)) {
+            memcpy(ext_wr, rd, num);
+        }
+        else if (c64_step && reu_step && (type == _C64_REU_FETCH)) {
+            memcpy(wr, ext, num);
+        }
+        else {
+            for (uint32_t i = 0; i < num; i++) {
+                const uint8_t c64_byte = rd[i * c64_step];
+                const uint8_t reu_byte = ext[i * reu_step];
+                if (type != _C64_REU_FETCH) {
+                    if (type != _C64_REU_VERIFY) {
+                        ext_wr[i * reu_step] = c64_byte;
+                    }
+                    else if (c64_byte != reu_byte) {
+                        fault = true;
+                        num = i + 1;
+                        break;
+                    }
+                }
+                if ((type == _C64_REU_FETCH) || (type == _C64_REU_SWAP)) {
+                    wr[i * c64_step] = reu_byte;
+                }
+            }
+        }
+        reu->c64_addr = (uint16_t)(c64_addr + num * c64_step);
+        reu->reu_addr = (reu->reu_addr + num * reu_step) & 0xFFFFFF;
+        left -= num;
+        reu->dma += num * ticks_per_byte;
+    }
+    reu->length = left ? (uint16_t)left : 1;
+    _c64_reu_end(reu, fault);
+}
+
+// a REU register access at IO2 (DF00..DFFF)
+static uint64_t _c64_reu_io(c64_t* sys, uint64_t pins, uint16_t addr) {
+    c64_reu_t* reu = &sys->reu;
+    const uint8_t reg = addr & 0x1F;
+    if (pins & M6502_RW) {
+        uint8_t data = 0xFF;
+        switch (reg) {
+            case 0x00:
+                // reading the status clears the interrupt and the end of transfer flags
+                data = reu->status;
+                reu->status &= ~(_C64_REU_STATUS_IRQ|_C64_REU_STATUS_EOB|_C64_REU_STATUS_FAULT);
+                break;
+            case 0x01: data = reu->command; break;
+            case 0x02: data = (uint8_t)reu->c64_addr; break;
+            case 0x03: data = (uint8_t)(reu->c64_addr >> 8); break;
+            case 0x04: data = (uint8_t)reu->reu_addr; break;
+            case 0x05: data = (uint8_t)(reu->reu_addr >> 8); break;
+            // the bank bits not used by the REU size read as 1
+            case 0x06: data = (uint8_t)(reu->reu_addr >> 16) | (uint8_t)~((reu->size - 1) >> 16); break;
+            case 0x07: data = (uint8_t)reu->length; break;
+            case 0x08: data = (uint8_t)(reu->length >> 8); break;
+            case 0x09: data = reu->irq_mask | 0x1F; break;
+            case 0x0A: data = reu->addr_ctrl | 0x3F; break;
+            default: break;
+        }
+        M6502_SET_DATA(pins, data);
+        return pins;
+    }
+    // the address and length registers are written along with the autoload values
+    const uint8_t data = M6502_GET_DATA(pins);
+    switch (reg) {
+        case 0x01:
+            reu->command = data;
+            if ((data & (_C64_REU_EXECUTE|_C64_REU_FF00)) == (_C64_REU_EXECUTE|_C64_REU_FF00)) {
+                _c64_reu_start(sys);
+            }
+            break;
+        case 0x02: reu->c64_addr = reu->c64_base = (reu->c64_base & 0xFF00) | data; break;
+        case 0x03: reu->c64_addr = reu->c64_base = (uint16_t)((reu->c64_base & 0x00FF) | (data << 8)); break;
+        case 0x04: reu->reu_addr = reu->reu_base = (reu->reu_base & 0xFFFF00) | data; break;
+        case 0x05: reu->reu_addr = reu->reu_base = (reu->reu_base & 0xFF00FF) | ((uint32_t)data << 8); break;
+        case 0x06: reu->reu_addr = reu->reu_base = (reu->reu_base & 0x00FFFF) | ((uint32_t)data << 16); break;
+        case 0x07: reu->length = reu->length_base = (reu->length_base & 0xFF00) | data; break;
+        case 0x08: reu->length = reu->length_base = (uint16_t)((reu->length_base & 0x00FF) | (data << 8)); break;
+        case 0x09: reu->irq_mask = data & 0xE0; break;
+        case 0x0A: reu->addr_ctrl = data & 0xC0; break;
+        default: break;
+    }
+    return pins;
+}
+
+/* a tick of a REU transfer on the bus, while the CPU is stopped and the
+   VIC-II doesn't use the bus, the REU puts its own address (and data
+   if it writes) on the bus for this tick, _c64_reu_tick() completes the
+   access and gives the address back to the CPU
+*/
+static uint64_t _c64_reu_bus(c64_t* sys, uint64_t pins) {
+    c64_reu_t* reu = &sys->reu;
+    if ((reu->dma <= 1) || reu->vic_ba) {
+        return pins;
+    }
+    reu->cpu_pins = pins;
+    const uint8_t type = reu->command & 3;
+    M6502_SET_ADDR(pins, reu->c64_addr);
+    if ((type == _C64_REU_FETCH) || ((type == _C64_REU_SWAP) && reu->swap_write)) {
+        pins &= ~M6502_RW;
+        M6502_SET_DATA(pins, *_c64_reu_rd(sys, reu->reu_addr & (reu->size - 1)));
+    }
+    return pins;
+}
+
+static uint64_t _c64_reu_tick(c64_t* sys, uint64_t pins, uint64_t vic_pins, bool cpu_stalled) {
+    c64_reu_t* reu = &sys->reu;
+    if (reu->dma && cpu_stalled && !reu->vic_ba) {
+        if (reu->bus && (reu->dma > 1)) {
+            const uint32_t addr = reu->reu_addr & (reu->size - 1);
+            const uint8_t data = M6502_GET_DATA(pins);
+            bool fault = false;
+            bool next = true;
+            switch (reu->command & 3) {
+                case _C64_REU_STASH:
+                    *_c64_reu_wr(sys, addr) = data;
+                    break;
+                case _C64_REU_SWAP:
+                    if (!reu->swap_write) {
+                        reu->latch = data;
+                        next = false;
+                    }
+                    else {
+                        *_c64_reu_wr(sys, addr) = reu->latch;
+                    }
+                    reu->swap_write = !reu->swap_write;
+                    break;
+                case _C64_REU_VERIFY:
+                    fault = (data != *_c64_reu_rd(sys, addr));
+                    break;
+                default:
+                    break;
+            }
+            if (next && (_c64_reu_next(reu) || fault)) {
+                _c64_reu_end(reu, fault);
+                reu->dma = 2;
+            }
+            // the CPU gets its address back
+            const uint64_t cpu_mask = 0xFFFFULL | 0xFF0000ULL | M6502_RW;
+            pins = (pins & ~cpu_mask) | (reu->cpu_pins & cpu_mask);
+        }
+        reu->dma--;
+    }
+    reu->vic_ba = 0 != (vic_pins & M6502_RDY);
+    if (reu->dma) {
+        pins |= M6502_RDY;
+    }
+    if (reu->status & _C64_REU_STATUS_IRQ) {
+        pins |= M6502_IRQ;
+    }
+    return pins;
 }
 
-static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
+/* The tick function is specialized at compile time for each combination
+   of the features in use (see _c64_exec_ticks()), so that the per-tick
+   checks for unused features are compiled out of the loop.
+*/
+static inline _C64_ALWAYS_INLINE uint64_t _c64_tick(c64_t* sys, uint64_t pins, const int features) {
     // FIXME: move datasette and floppy tick to end
 
-    // tick the CPU
-    pins = m6502_tick(&sys->cpu, pins);
+    // tick the CPU, it doesn't move in a read tick with RDY active
+    const bool cpu_stalled = (pins & (M6502_RDY|M6502_RW)) == (M6502_RDY|M6502_RW);
+    if (cpu_stalled) {
+        // the bad lines and the sprite DMA stop the CPU for about 1000 ticks in a frame
+        pins = m6502_stall(&sys->cpu, pins);
+        // a REU transfer involving the IO area uses the bus while the CPU is stopped
+        if (sys->reu.bus) {
+            pins = _c64_reu_bus(sys, pins);
+        }
+    }
+    else {
+        pins = m6502_tick(&sys->cpu, pins);
+    }
     const uint16_t addr = M6502_GET_ADDR(pins);
 
     // those pins are set each tick by the CIAs and VIC
@@ -547,6 +1845,7 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
     */
     bool cpu_io_access = false;
     bool color_ram_access = false;
+    bool cart_access = false;
     bool mem_access = false;
     uint64_t vic_pins = pins & M6502_PIN_MASK;
     uint64_t cia1_pins = pins & M6502_PIN_MASK;
@@ -578,6 +1877,10 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
                     // CIA-2 (DD00..DDFF)
                     cia2_pins |= M6526_CS;
                 }
+                else {
+                    // expansion port IO1 and IO2 (DE00..DFFF)
+                    cart_access = true;
+                }
             }
             else {
                 mem_access = true;
@@ -585,22 +1888,30 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
         }
     }
 
-    // tick the SID
-    {
+    // tick the SID, only generate samples if somebody listens
+    if (features & _C64_EXEC_AUDIO) {
         sid_pins = m6581_tick(&sys->sid, sid_pins);
         if (sid_pins & M6581_SAMPLE) {
             // new audio sample ready
             sys->audio.sample_buffer[sys->audio.sample_pos++] = sys->sid.sample;
             if (sys->audio.sample_pos == sys->audio.num_samples) {
-                if (sys->audio.callback.func) {
-                    sys->audio.callback.func(sys->audio.sample_buffer, sys->audio.num_samples, sys->audio.callback.user_data);
-                }
+                sys->audio.callback.func(sys->audio.sample_buffer, sys->audio.num_samples, sys->audio.callback.user_data);
                 sys->audio.sample_pos = 0;
             }
         }
-        if ((sid_pins & (M6581_CS|M6581_RW)) == (M6581_CS|M6581_RW)) {
-            pins = M6502_COPY_DATA(pins, sid_pins);
-        }
+    }
+    else {
+        sid_pins = m6581_tick_silent(&sys->sid, sid_pins);
+    }
+    if ((sid_pins & (M6581_CS|M6581_RW)) == (M6581_CS|M6581_RW)) {
+        pins = M6502_COPY_DATA(pins, sid_pins);
+    }
+
+    // both CIA TOD pins are driven by the power line frequency
+    if (--sys->tod_countdown == 0) {
+        sys->tod_countdown = _C64_TOD_PERIOD;
+        cia1_pins |= M6526_TOD;
+        cia2_pins |= M6526_TOD;
     }
 
     /* tick CIA-1:
@@ -638,7 +1949,7 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
     /* tick CIA-2
         In Port A:
             bits 0..5: output (see cia2_out)
-            bits 6..7: serial bus input, not implemented
+            bits 6..7: serial bus CLK and DATA input
         In Port B:
             RS232 / user functionality (not implemented)
 
@@ -649,7 +1960,7 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
                 10: bank 1 4000..7FFF
                 11: bank 0 0000..3FFF
             bit 2: RS-232 TXD Outout (not implemented)
-            bit 3..5: serial bus output (not implemented)
+            bit 3..5: serial bus ATN, CLK and DATA output
             bit 6..7: input (see cia2_in)
         Out Port B:
             RS232 / user functionality (not implemented)
@@ -657,9 +1968,41 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
         CIA-2 IRQ pin connected to CPU NMI pin
     */
     {
-        M6526_SET_PAB(cia2_pins, 0xFF, 0xFF);
+        // a threaded drive must first reach this tick if the CPU reads the bus
+        if ((features & _C64_EXEC_DRIVE) && sys->drive_sync.enabled && ((addr & 0x0F) == 0) &&
+            ((cia2_pins & (M6526_CS|M6526_RW)) == (M6526_CS|M6526_RW)))
+        {
+            c64_drive_sync(sys);
+            sys->iec_port = sys->iec_out | sys->drive_sync.drive_out;
+        }
+        // serial bus inputs are low while the line is pulled low
+        uint8_t pa = 0x3F;
+        if (!(sys->iec_port & C64_IECPORT_CLK)) {
+            pa |= (1<<6);
+        }
+        if (!(sys->iec_port & C64_IECPORT_DATA)) {
+            pa |= (1<<7);
+        }
+        M6526_SET_PAB(cia2_pins, pa, 0xFF);
         cia2_pins = m6526_tick(&sys->cia_2, cia2_pins);
-        sys->vic_bank_select = ((~M6526_GET_PA(cia2_pins))&3)<<14;
+        const uint8_t pa_out = M6526_GET_PA(cia2_pins);
+        const uint16_t vic_bank_select = ((~pa_out)&3)<<14;
+        if (vic_bank_select != sys->vic_bank_select) {
+            sys->vic_bank_select = vic_bank_select;
+            _c64_damage_all(sys);
+        }
+        // serial bus outputs pull the lines low through inverters
+        uint8_t iec_out = 0;
+        if (pa_out & (1<<3)) {
+            iec_out |= C64_IECPORT_ATN;
+        }
+        if (pa_out & (1<<4)) {
+            iec_out |= C64_IECPORT_CLK;
+        }
+        if (pa_out & (1<<5)) {
+            iec_out |= C64_IECPORT_DATA;
+        }
+        sys->iec_out = iec_out;
         if (cia2_pins & M6502_IRQ) {
             pins |= M6502_NMI;
         }
@@ -668,6 +2011,19 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
         }
     }
 
+    // tick the floppy drive, the serial bus lines are wired-AND
+    if (!(features & _C64_EXEC_DRIVE)) {
+        sys->iec_port = sys->iec_out;
+    }
+    else if (sys->drive_sync.enabled) {
+        _c64_drive_tick(sys);
+    }
+    else {
+        sys->iec_port = sys->iec_out | sys->c1541.iec_out;
+        c1541_tick(&sys->c1541);
+        sys->iec_port = sys->iec_out | sys->c1541.iec_out;
+    }
+
     // the RESTORE key, along with CIA-2 IRQ, is connected to the NMI line,
     if(sys->kbd.scanout_column_masks[8] & 1) {
         pins |= M6502_NMI;
@@ -682,11 +2038,22 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
         this goes active during a badline, but is not checked
     */
     {
-        vic_pins = m6569_tick(&sys->vic, vic_pins);
+        // the register written, and its value before, for the screen damage
+        const uint8_t vic_reg = addr & M6569_REG_MASK;
+        const uint8_t vic_old = sys->vic.reg.regs[vic_reg];
+        if (features & _C64_EXEC_VIDEO) {
+            vic_pins = m6569_tick(&sys->vic, vic_pins);
+        }
+        else {
+            vic_pins = m6569_tick_novideo(&sys->vic, vic_pins);
+        }
         pins |= (vic_pins & (M6502_IRQ|M6502_RDY|M6510_AEC));
         if ((vic_pins & (M6569_CS|M6569_RW)) == (M6569_CS|M6569_RW)) {
             pins = M6502_COPY_DATA(pins, vic_pins);
         }
+        else if ((vic_pins & (M6569_CS|M6569_RW)) == M6569_CS) {
+            _c64_damage_vic(sys, vic_reg, vic_old);
+        }
     }
 
     /* remaining CPU IO and memory accesses, those don't fit into the
@@ -702,6 +2069,15 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
         }
         else {
             sys->color_ram[addr & 0x03FF] = M6502_GET_DATA(pins);
+            _c64_damage_color(sys, addr);
+        }
+    }
+    else if (cart_access) {
+        if (sys->reu.mem && (addr >= 0xDF00)) {
+            pins = _c64_reu_io(sys, pins, addr);
+        }
+        else if (sys->cart.inserted) {
+            pins = _c64_cart_io(sys, pins, addr);
         }
     }
     else if (mem_access) {
@@ -710,10 +2086,50 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
             M6502_SET_DATA(pins, mem_rd(&sys->mem_cpu, addr));
         }
         else {
-            // memory write
+            // memory write (always goes to RAM, even under ROM)
+            const uint64_t page_mask = 1ULL << (addr >> 10);
+            if (sys->ram_shared & page_mask) {
+                _c64_unshare_ram(sys, page_mask);
+            }
             mem_wr(&sys->mem_cpu, addr, M6502_GET_DATA(pins));
+            sys->ram_dirty |= page_mask;
+            if (sys->damage.watch & page_mask) {
+                _c64_damage_ram(sys, addr);
+            }
+            // a REU command can wait for a write to FF00
+            if ((addr == 0xFF00) && (sys->reu.command & _C64_REU_EXECUTE)) {
+                _c64_reu_start(sys);
+            }
+        }
+    }
+
+    // the REU stops the CPU with RDY during a transfer, its IRQ pin is connected to the CPU IRQ pin
+    if (sys->reu.dma | (sys->reu.status & _C64_REU_STATUS_IRQ)) {
+        pins = _c64_reu_tick(sys, pins, vic_pins, cpu_stalled);
+    }
+
+    #ifdef C64_TRACE
+    // the opcode fetch completes when the CPU isn't stopped in the next tick
+    sys->trace.ticks++;
+    if (((pins & (M6502_SYNC|M6502_RDY)) == M6502_SYNC) && sys->trace.ring) {
+        _c64_trace(sys, pins);
+    }
+    #endif
+    #ifdef C64_HEATMAP
+    // like the opcode fetch above, a read completes when the CPU isn't stopped
+    if (((pins & (M6502_RDY|M6502_RW)) != (M6502_RDY|M6502_RW)) && sys->heatmap) {
+        int kind = C64_HEAT_WRITE;
+        if (pins & M6502_RW) {
+            kind = (pins & M6502_SYNC) ? C64_HEAT_EXEC : C64_HEAT_READ;
         }
+        _c64_heat(sys->heatmap, addr, kind);
     }
+    #endif
+    #ifdef C64_RASTER_PROFILE
+    if (sys->raster_profile) {
+        _c64_raster_profile(sys, cpu_stalled);
+    }
+    #endif
     return pins;
 }
 
@@ -757,16 +2173,33 @@ static void _c64_cpu_port_out(uint8_t data, void* user_data) {
     }
 }
 
+// the byte the VIC-II sees at a 16-bit address
+static inline uint8_t _c64_vic_byte(const c64_t* sys, uint16_t addr) {
+    if ((addr & 0x7000) == 0x1000) {
+        return sys->rom_char[addr & 0x0FFF];
+    }
+    else if (sys->ram_shared & (1ULL << (addr >> 10))) {
+        return sys->ram_src[addr >> 10][addr & 0x03FF];
+    }
+    else {
+        return sys->ram[addr];
+    }
+}
+
 static uint16_t _c64_vic_fetch(uint16_t addr, void* user_data) {
     c64_t* sys = (c64_t*) user_data;
     /*
         Fetch data into the VIC-II.
 
         The VIC-II has a 14-bit address bus and 12-bit data bus, and
-        has a different memory mapping then the CPU (that's why it
-        goes through the mem_vic pagetable):
+        has a different memory mapping then the CPU (the same as the
+        mem_vic pagetable, but decoded here directly instead of
+        looking the pagetable up each fetch):
             - a full 16-bit address is formed by taking the address bits
               14 and 15 from the value written to CIA-1 port A
+            - the character ROM is visible at 0x1000..0x1FFF and
+              0x9000..0x9FFF, everything else is RAM (possibly shared
+              with the forked machine)
             - the lower 8 bits of the VIC-II data bus are connected
               to the shared system data bus, this is used to read
               character mask and pixel data
@@ -774,28 +2207,218 @@ static uint16_t _c64_vic_fetch(uint16_t addr, void* user_data) {
               static color RAM
     */
     addr |= sys->vic_bank_select;
-    uint16_t data = (sys->color_ram[addr & 0x03FF]<<8) | mem_rd(&sys->mem_vic, addr);
+    #ifdef C64_HEATMAP
+    if (sys->heatmap) {
+        _c64_heat(sys->heatmap, addr, C64_HEAT_VIC);
+    }
+    #endif
+    uint16_t data = (sys->color_ram[addr & 0x03FF]<<8) | _c64_vic_byte(sys, addr);
     return data;
 }
 
-static void _c64_update_memory_map(c64_t* sys) {
-    sys->io_mapped = false;
-    uint8_t* read_ptr;
-    // shortcut if HIRAM and LORAM is 0, everything is RAM
-    if ((sys->cpu_port & (C64_CPUPORT_HIRAM|C64_CPUPORT_LORAM)) == 0) {
-        mem_map_ram(&sys->mem_cpu, 0, 0xA000, 0x6000, sys->ram+0xA000);
+// the bank offset of the byte the VIC-II fetches in the idle state
+static inline uint16_t _c64_damage_idle(const c64_t* sys) {
+    return (sys->vic.reg.ctrl_1 & M6569_CTRL1_ECM) ? 0x39FF : 0x3FFF;
+}
+
+// the RAM pages the VIC-II displays, see "Screen Damage"
+static void _c64_damage_watch(c64_t* sys) {
+    const m6569_registers_t* r = &sys->vic.reg;
+    // the video matrix, with the sprite pointers
+    uint64_t watch = 1ULL << (r->mem_ptrs >> 4);
+    if (r->ctrl_1 & M6569_CTRL1_BMM) {
+        watch |= 0xFFULL << (r->mem_ptrs & 0x08);
     }
     else {
-        // A000..BFFF is either RAM-behind-BASIC-ROM or RAM
-        if ((sys->cpu_port & (C64_CPUPORT_HIRAM|C64_CPUPORT_LORAM)) == (C64_CPUPORT_HIRAM|C64_CPUPORT_LORAM)) {
-            read_ptr = sys->rom_basic;
-        }
-        else {
-            read_ptr = sys->ram + 0xA000;
+        watch |= 0x03ULL << (r->mem_ptrs & 0x0E);
+    }
+    // the byte fetched in the idle state, also drawn inside the display window
+    watch |= 1ULL << (_c64_damage_idle(sys) >> 10);
+    // the data of the enabled sprites, at the pointer * 64
+    const uint16_t pointers = sys->vic_bank_select | ((r->mem_ptrs & 0xF0) << 6) | 0x03F8;
+    for (int i = 0; i < M6569_NUM_MOBS; i++) {
+        if (r->me & (1<<i)) {
+            watch |= 1ULL << (_c64_vic_byte(sys, pointers + i) >> 4);
         }
-        mem_map_rw(&sys->mem_cpu, 0, 0xA000, 0x2000, read_ptr, sys->ram+0xA000);
-
-        // E000..FFFF is either RAM-behind-KERNAL-ROM or RAM
+    }
+    // the character ROM in banks 0 and 2
+    if (!(sys->vic_bank_select & 0x4000)) {
+        watch &= ~0xF0ULL;
+    }
+    sys->damage.watch = watch << (sys->vic_bank_select >> 10);
+}
+
+// the whole screen changed, or may have
+static void _c64_damage_all(c64_t* sys) {
+    _c64_damage_watch(sys);
+    sys->damage.rows |= C64_DAMAGE_ALL;
+}
+
+// the raster lines from y to y+h changed, or may have
+static void _c64_damage_raster(c64_t* sys, int y, int h) {
+    // relative to the first text row at raster line 0x30, see c64_damage_lines()
+    const int y0 = y - 0x30;
+    const int y1 = y0 + h;
+    if (y0 < 0) {
+        sys->damage.rows |= C64_DAMAGE_TOP;
+    }
+    if (y1 >= 200) {
+        sys->damage.rows |= C64_DAMAGE_BOTTOM;
+    }
+    if ((y1 >= 0) && (y0 < 200)) {
+        const int first = (y0 < 0) ? 0 : (y0 >> 3);
+        const int last = (y1 >= 200) ? 24 : (y1 >> 3);
+        sys->damage.rows |= (2U << last) - (1U << first);
+    }
+}
+
+// the lines of the sprites in mask changed, or may have
+static void _c64_damage_sprites(c64_t* sys, uint8_t mask) {
+    const m6569_registers_t* r = &sys->vic.reg;
+    for (int i = 0; mask; i++, mask >>= 1) {
+        if (mask & 1) {
+            // the first sprite line is drawn at Y+1
+            _c64_damage_raster(sys, r->mxy[i][1], (r->mye & (1<<i)) ? 42 : 21);
+        }
+    }
+}
+
+// a write to a RAM page the VIC-II displays
+static void _c64_damage_ram(c64_t* sys, uint16_t addr) {
+    const m6569_registers_t* r = &sys->vic.reg;
+    const uint16_t offset = addr & 0x3FFF;
+    const uint16_t matrix = offset - ((r->mem_ptrs & 0xF0) << 6);
+    const bool bitmap_mode = r->ctrl_1 & M6569_CTRL1_BMM;
+    if ((offset == _c64_damage_idle(sys)) ||
+        (!bitmap_mode && ((uint16_t)(offset - ((r->mem_ptrs & 0x0E) << 10)) < 0x0800)))
+    {
+        // the idle state byte, drawn in the lines without a text row, or the character set
+        sys->damage.rows |= C64_DAMAGE_ALL;
+        return;
+    }
+    if (matrix < 1000) {
+        sys->damage.rows |= 1U << (matrix / 40);
+    }
+    else if ((matrix >= 0x03F8) && (matrix < 0x0400)) {
+        // a sprite pointer, the sprite data may be in another page now
+        const uint8_t mask = r->me & (1 << (matrix & 7));
+        if (mask) {
+            _c64_damage_sprites(sys, mask);
+            _c64_damage_watch(sys);
+        }
+    }
+    if (bitmap_mode) {
+        const uint16_t bitmap = offset - ((r->mem_ptrs & 0x08) << 10);
+        if (bitmap < 8000) {
+            sys->damage.rows |= 1U << (bitmap / 320);
+        }
+    }
+    if (r->me) {
+        // the data of the enabled sprites, 63 bytes at the pointer * 64
+        const uint16_t pointers = sys->vic_bank_select | ((r->mem_ptrs & 0xF0) << 6) | 0x03F8;
+        uint8_t mask = 0;
+        for (int i = 0; i < M6569_NUM_MOBS; i++) {
+            if ((r->me & (1<<i)) && ((uint16_t)(offset - (_c64_vic_byte(sys, pointers + i) << 6)) < 63)) {
+                mask |= 1<<i;
+            }
+        }
+        _c64_damage_sprites(sys, mask);
+    }
+}
+
+// a write to the VIC-II register reg, that held old before
+static void _c64_damage_vic(c64_t* sys, uint8_t reg, uint8_t old) {
+    const m6569_registers_t* r = &sys->vic.reg;
+    if (reg < 0x10) {
+        // a sprite position, a new Y coordinate also clears the old lines
+        const int i = reg >> 1;
+        if (r->me & (1<<i)) {
+            _c64_damage_sprites(sys, 1<<i);
+            if (reg & 1) {
+                _c64_damage_raster(sys, old, (r->mye & (1<<i)) ? 42 : 21);
+            }
+        }
+    }
+    else if ((reg == 0x10) || ((reg >= 0x1B) && (reg <= 0x1D))) {
+        // the X coordinate MSB, priority, multicolor or X expansion bit of each sprite
+        _c64_damage_sprites(sys, (old ^ r->regs[reg]) & r->me);
+    }
+    else if (reg == 0x15) {
+        // the sprites enabled
+        _c64_damage_sprites(sys, old ^ r->me);
+        _c64_damage_watch(sys);
+    }
+    else if ((reg == 0x25) || (reg == 0x26)) {
+        // the sprite multicolors
+        _c64_damage_sprites(sys, r->me & r->mmc);
+    }
+    else if ((reg >= 0x27) && (reg < 0x2F)) {
+        // a sprite color
+        _c64_damage_sprites(sys, r->me & (1 << (reg - 0x27)));
+    }
+    else if ((reg != 0x12) && (reg != 0x19) && (reg != 0x1A) && (reg != 0x1E) && (reg != 0x1F) && (reg < 0x2F)) {
+        // but the raster compare, the interrupt, the collision and the unused registers,
+        // the Y expansion included since changing it in the middle of a sprite stretches it
+        _c64_damage_all(sys);
+    }
+}
+
+// a write to the color RAM
+static void _c64_damage_color(c64_t* sys, uint16_t addr) {
+    const uint16_t offset = addr & 0x03FF;
+    if (offset < 1000) {
+        sys->damage.rows |= 1U << (offset / 40);
+    }
+}
+
+// the ROML or ROMH image of the current cartridge bank, the RAM if the bank has none
+static const uint8_t* _c64_cart_rom(c64_t* sys, const uint8_t* const* roms, uint16_t addr) {
+    const uint8_t* rom = roms[sys->cart.bank & (C64_CART_MAX_BANKS - 1)];
+    return rom ? rom : sys->ram + addr;
+}
+
+static void _c64_update_memory_map(c64_t* sys) {
+    sys->io_mapped = false;
+    const uint8_t* read_ptr;
+    const uint8_t lines = sys->cart.lines;
+    const uint8_t mode = sys->cpu_port & (C64_CPUPORT_HIRAM|C64_CPUPORT_LORAM);
+    if (lines == C64_CART_GAME) {
+        // Ultimax cartridge: ROML, IO and ROMH whatever the CPU port says
+        mem_map_rom(&sys->mem_cpu, 0, 0x8000, 0x2000, _c64_cart_rom(sys, sys->cart.roml, 0x8000));
+        mem_map_ram(&sys->mem_cpu, 0, 0xA000, 0x6000, sys->ram+0xA000);
+        mem_map_rom(&sys->mem_cpu, 0, 0xE000, 0x2000, _c64_cart_rom(sys, sys->cart.romh, 0xE000));
+        sys->io_mapped = true;
+        if (sys->ram_shared) {
+            _c64_map_shared_ram(sys, 0x8000);
+        }
+        return;
+    }
+    // 8000..9FFF is either a cartridge ROML bank or RAM
+    if ((lines & C64_CART_EXROM) && (mode == (C64_CPUPORT_HIRAM|C64_CPUPORT_LORAM))) {
+        read_ptr = _c64_cart_rom(sys, sys->cart.roml, 0x8000);
+    }
+    else {
+        read_ptr = sys->ram + 0x8000;
+    }
+    mem_map_rw(&sys->mem_cpu, 0, 0x8000, 0x2000, read_ptr, sys->ram+0x8000);
+    // shortcut if HIRAM and LORAM is 0, everything is RAM
+    if (mode == 0) {
+        mem_map_ram(&sys->mem_cpu, 0, 0xA000, 0x6000, sys->ram+0xA000);
+    }
+    else {
+        // A000..BFFF is either a 16 KB cartridge ROMH bank, RAM-behind-BASIC-ROM or RAM
+        if ((lines & C64_CART_GAME) && (mode & C64_CPUPORT_HIRAM)) {
+            read_ptr = _c64_cart_rom(sys, sys->cart.romh, 0xA000);
+        }
+        else if (mode == (C64_CPUPORT_HIRAM|C64_CPUPORT_LORAM)) {
+            read_ptr = sys->rom_basic;
+        }
+        else {
+            read_ptr = sys->ram + 0xA000;
+        }
+        mem_map_rw(&sys->mem_cpu, 0, 0xA000, 0x2000, read_ptr, sys->ram+0xA000);
+
+        // E000..FFFF is either RAM-behind-KERNAL-ROM or RAM
         if (sys->cpu_port & C64_CPUPORT_HIRAM) {
             read_ptr = sys->rom_kernal;
         }
@@ -812,13 +2435,44 @@ static void _c64_update_memory_map(c64_t* sys) {
             mem_map_rw(&sys->mem_cpu, 0, 0xD000, 0x1000, sys->rom_char, sys->ram+0xD000);
         }
     }
+    if (sys->ram_shared) {
+        _c64_map_shared_ram(sys, 0x8000);
+    }
 }
 
-static void _c64_init_memory_map(c64_t* sys) {
-    // seperate memory mapping for CPU and VIC-II
-    mem_init(&sys->mem_cpu);
-    mem_init(&sys->mem_vic);
+/* the CPU and the VIC-II read the shared RAM pages of a fork in place, but
+   the CPU always writes to the RAM of the fork, after _c64_unshare_ram()
+*/
+static void _c64_map_shared_ram(c64_t* sys, uint16_t from_addr) {
+    for (int page = from_addr >> 10; page < 64; page++) {
+        if (sys->ram_shared & (1ULL << page)) {
+            uint8_t* ram = sys->ram + (page << 10);
+            if (sys->mem_cpu.layers[0][page].read_ptr == ram) {
+                mem_map_rw(&sys->mem_cpu, 0, page << 10, 0x0400, sys->ram_src[page], ram);
+            }
+            mem_map_rw(&sys->mem_vic, 1, page << 10, 0x0400, sys->ram_src[page], ram);
+        }
+    }
+}
+
+/* copy the shared RAM pages in mask into the fork before they are written */
+static void _c64_unshare_ram(c64_t* sys, uint64_t mask) {
+    mask &= sys->ram_shared;
+    for (int page = 0; mask; page++) {
+        if (mask & (1ULL << page)) {
+            uint8_t* ram = sys->ram + (page << 10);
+            memcpy(ram, sys->ram_src[page], 0x0400);
+            if (sys->mem_cpu.layers[0][page].read_ptr == sys->ram_src[page]) {
+                mem_map_ram(&sys->mem_cpu, 0, page << 10, 0x0400, ram);
+            }
+            mem_map_ram(&sys->mem_vic, 1, page << 10, 0x0400, ram);
+            sys->ram_shared &= ~(1ULL << page);
+            mask &= ~(1ULL << page);
+        }
+    }
+}
 
+static void _c64_init_ram(c64_t* sys) {
     /*
         the C64 has a weird RAM init pattern of 64 bytes 00 and 64 bytes FF
         alternating, probably with some randomness sprinkled in
@@ -836,14 +2490,12 @@ static void _c64_init_memory_map(c64_t* sys) {
         }
     }
     CHIPS_ASSERT(i == 0x10000);
+}
 
-    /* setup the initial CPU memory map
-       0000..9FFF and C000.CFFF is always RAM
-    */
-    mem_map_ram(&sys->mem_cpu, 0, 0x0000, 0xA000, sys->ram);
-    mem_map_ram(&sys->mem_cpu, 0, 0xC000, 0x1000, sys->ram+0xC000);
-    // A000..BFFF, D000..DFFF and E000..FFFF are configurable
-    _c64_update_memory_map(sys);
+static void _c64_init_memory_map(c64_t* sys) {
+    // seperate memory mapping for CPU and VIC-II
+    mem_init(&sys->mem_cpu);
+    mem_init(&sys->mem_vic);
 
     /* setup the separate VIC-II memory map (64 KByte RAM) overlayed with
        character ROMS at 0x1000.0x1FFF and 0x9000..0x9FFF
@@ -851,6 +2503,17 @@ static void _c64_init_memory_map(c64_t* sys) {
     mem_map_ram(&sys->mem_vic, 1, 0x0000, 0x10000, sys->ram);
     mem_map_rom(&sys->mem_vic, 0, 0x1000, 0x1000, sys->rom_char);
     mem_map_rom(&sys->mem_vic, 0, 0x9000, 0x1000, sys->rom_char);
+
+    /* setup the initial CPU memory map
+       0000..7FFF and C000.CFFF is always RAM
+    */
+    mem_map_ram(&sys->mem_cpu, 0, 0x0000, 0x8000, sys->ram);
+    mem_map_ram(&sys->mem_cpu, 0, 0xC000, 0x1000, sys->ram+0xC000);
+    if (sys->ram_shared) {
+        _c64_map_shared_ram(sys, 0x0000);
+    }
+    // 8000..BFFF, D000..DFFF and E000..FFFF are configurable
+    _c64_update_memory_map(sys);
 }
 
 static void _c64_init_key_map(c64_t* sys) {
@@ -923,28 +2586,860 @@ static void _c64_init_key_map(c64_t* sys) {
     kbd_register_key(&sys->kbd, C64_KEY_F8      , 3, 0, 1);    // F8
 }
 
-uint32_t c64_exec(c64_t* sys, uint32_t micro_seconds) {
-    CHIPS_ASSERT(sys && sys->valid);
-    uint32_t num_ticks = clk_us_to_ticks(C64_FREQUENCY, micro_seconds);
+/*
+    ROM traps, see "ROM Traps"
+
+    The native versions follow the ROM code instruction by instruction,
+    with the ALU helpers of the CPU emulation so that the flags come out
+    the same. The floating point routines only access the zero page and
+    the stack, and can end with a BASIC error: they run at the opcode
+    fetch on a copy of the first 512 bytes, so that the ROM code can
+    still run if they fail, and what they wrote is copied back when the
+    CPU executes the RTS. The others check at the fetch that they only
+    access RAM, ROM and color RAM, and run when the RTS is executed.
+*/
+#define _C64_TRAP_BLTU (0)      // bit numbers of the C64_TRAP_* masks
+#define _C64_TRAP_MLTPLY (1)
+#define _C64_TRAP_FDIVT (2)
+#define _C64_TRAP_MOVLIN (3)
+#define _C64_TRAP_CLRLIN (4)
+#define _C64_TRAP_BIT(bits, i) (bits[(i) >> 6] & (1ULL << ((i) & 63)))
+
+static int _c64_trap_at(uint16_t addr) {
+    switch (addr) {
+        case 0xA3BF: return _C64_TRAP_BLTU;
+        case 0xBA59: case 0xBA5E: return _C64_TRAP_MLTPLY;
+        case 0xBB12: return _C64_TRAP_FDIVT;
+        case 0xE9C8: return _C64_TRAP_MOVLIN;
+        case 0xE9FF: return _C64_TRAP_CLRLIN;
+        default: return -1;
+    }
+}
+
+// true if the CPU sees the BASIC or KERNAL ROM at the entry point of a trap
+static bool _c64_trap_mapped(c64_t* sys, uint16_t addr) {
+    const uint8_t* rom = (addr < 0xE000) ? sys->rom_basic : sys->rom_kernal;
+    return sys->mem_cpu.page_table[addr >> MEM_PAGE_SHIFT].read_ptr == (rom + (addr & 0x1C00));
+}
+
+// the ROM trap memory index of a CPU address: RAM, then color RAM
+static inline uint32_t _c64_trap_index(c64_t* sys, uint16_t addr) {
+    if (sys->io_mapped && ((addr & 0xFC00) == 0xD800)) {
+        return 0x10000 | (addr & 0x03FF);
+    }
+    return addr;
+}
+
+// the byte at a ROM trap memory index
+static uint8_t _c64_trap_mem(c64_t* sys, uint32_t i) {
+    if (i >= 0x10000) {
+        return sys->color_ram[i & 0x03FF];
+    }
+    const uint32_t page = i >> 10;
+    if (sys->ram_shared & (1ULL << page)) {
+        return sys->ram_src[page][i & 0x03FF];
+    }
+    return sys->ram[i];
+}
+
+// read a byte like the CPU does, only valid for RAM, ROM and color RAM
+static inline uint8_t _c64_trap_rd(c64_t* sys, uint16_t addr) {
+    if (sys->io_mapped && ((addr & 0xFC00) == 0xD800)) {
+        return sys->color_ram[addr & 0x03FF];
+    }
+    return mem_rd(&sys->mem_cpu, addr);
+}
+
+static inline uint16_t _c64_trap_rd16(c64_t* sys, uint16_t addr) {
+    return _c64_trap_rd(sys, addr) | (_c64_trap_rd(sys, addr + 1) << 8);
+}
+
+// write a byte like the CPU does, in the test mode the old value is kept to undo it
+static void _c64_trap_wr(c64_t* sys, uint16_t addr, uint8_t data) {
+    const uint32_t i = _c64_trap_index(sys, addr);
+    if (sys->traps.capture) {
+        c64_trap_verify_t* v = sys->traps.verify;
+        if (!_C64_TRAP_BIT(v->native, i)) {
+            v->native[i >> 6] |= 1ULL << (i & 63);
+            v->before[i] = _c64_trap_mem(sys, i);
+        }
+    }
+    if (i >= 0x10000) {
+        sys->color_ram[i & 0x03FF] = data;
+        _c64_damage_color(sys, addr);
+    }
+    else {
+        const uint64_t page_mask = 1ULL << (addr >> 10);
+        if (sys->ram_shared & page_mask) {
+            _c64_unshare_ram(sys, page_mask);
+        }
+        mem_wr(&sys->mem_cpu, addr, data);
+        sys->ram_dirty |= page_mask;
+        if (sys->damage.watch & page_mask) {
+            _c64_damage_ram(sys, addr);
+        }
+    }
+}
+
+static inline void _c64_trap_push(c64_t* sys, m6502_t* c, uint8_t data) {
+    _c64_trap_wr(sys, 0x0100 | c->S--, data);
+}
+
+// the copy of zero page and stack the floating point routines work on
+static inline void _c64_trap_zp_wr(c64_t* sys, uint16_t addr, uint8_t data) {
+    sys->traps.zp[addr] = data;
+    sys->traps.zp_written[addr >> 6] |= 1ULL << (addr & 63);
+}
+
+static inline void _c64_trap_zp_push(c64_t* sys, m6502_t* c, uint8_t data) {
+    _c64_trap_zp_wr(sys, 0x0100 | c->S--, data);
+}
+
+static inline uint8_t _c64_trap_zp_pull(c64_t* sys, m6502_t* c) {
+    return sys->traps.zp[0x0100 | ++c->S];
+}
+
+// a load, transfer, increment or decrement: sets N and Z
+static inline uint8_t _c64_trap_nz(m6502_t* c, uint8_t v) {
+    c->P = (c->P & ~(M6502_NF|M6502_ZF)) | (v ? (v & M6502_NF) : M6502_ZF);
+    return v;
+}
+
+// true if len bytes from addr are RAM (or ROM when read) the routines can use
+static bool _c64_trap_ram_ok(c64_t* sys, uint16_t addr, uint32_t len) {
+    const uint32_t end = addr + len;
+    if (len == 0) {
+        return true;
+    }
+    // zero page and stack hold the CPU port and the pointers of the routines
+    if ((addr < 0x0200) || (end > 0x10000)) {
+        return false;
+    }
+    if (sys->io_mapped && (addr < 0xE000) && (end > 0xD000)) {
+        return false;
+    }
+    // a write to FF00 can start a REU transfer
+    return !(sys->reu.mem && (end > 0xFF00));
+}
+
+// true if len bytes from addr are color RAM
+static bool _c64_trap_color_ok(c64_t* sys, uint16_t addr, uint32_t len) {
+    return sys->io_mapped && ((addr & 0xFC00) == 0xD800) && (((addr & 0x03FF) + len) <= 0x0400);
+}
+
+// A3BF BLTU: move the bytes from ($5F) up to ($5A) so that they end at ($58), top down
+static bool _c64_trap_bltu_ok(c64_t* sys) {
+    const uint16_t src_end = _c64_trap_rd16(sys, 0x5A);
+    const uint16_t dst_end = _c64_trap_rd16(sys, 0x58);
+    const uint16_t len = src_end - _c64_trap_rd16(sys, 0x5F);
+    // with 0xFFxx bytes the page counter in X wraps around
+    return ((len >> 8) != 0xFF) &&
+        _c64_trap_ram_ok(sys, (uint16_t)(src_end - len), len) &&
+        _c64_trap_ram_ok(sys, (uint16_t)(dst_end - len), len);
+}
+
+static void _c64_trap_bltu(c64_t* sys, m6502_t* c) {
+    c->P |= M6502_CF;
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0x5A));
+    _m6502_sbc(c, _c64_trap_rd(sys, 0x5F));
+    _c64_trap_wr(sys, 0x22, c->A);
+    c->Y = _c64_trap_nz(c, c->A);
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0x5B));
+    _m6502_sbc(c, _c64_trap_rd(sys, 0x60));
+    c->X = _c64_trap_nz(c, c->A);
+    c->X = _c64_trap_nz(c, c->X + 1);
+    c->A = _c64_trap_nz(c, c->Y);
+    bool copy = false;
+    if (c->A != 0) {
+        // A3D0: move both pointers down by the bytes in the last page
+        c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0x5A));
+        c->P |= M6502_CF;
+        _m6502_sbc(c, _c64_trap_rd(sys, 0x22));
+        _c64_trap_wr(sys, 0x5A, c->A);
+        if (!(c->P & M6502_CF)) {
+            _c64_trap_wr(sys, 0x5B, _c64_trap_nz(c, _c64_trap_rd(sys, 0x5B) - 1));
+            c->P |= M6502_CF;
+        }
+        c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0x58));
+        _m6502_sbc(c, _c64_trap_rd(sys, 0x22));
+        _c64_trap_wr(sys, 0x58, c->A);
+        if (!(c->P & M6502_CF)) {
+            _c64_trap_wr(sys, 0x59, _c64_trap_nz(c, _c64_trap_rd(sys, 0x59) - 1));
+        }
+        copy = true;
+    }
+    for (;;) {
+        if (copy) {
+            // A3EC: copy ($5A),Y-1..0 to ($58),Y-1..0
+            const uint16_t src = _c64_trap_rd16(sys, 0x5A);
+            const uint16_t dst = _c64_trap_rd16(sys, 0x58);
+            while (--c->Y != 0) {
+                _c64_trap_wr(sys, dst + c->Y, _c64_trap_rd(sys, src + c->Y));
+            }
+            c->A = _c64_trap_nz(c, _c64_trap_rd(sys, src));
+            _c64_trap_wr(sys, dst, c->A);
+        }
+        // A3F3: next page down
+        _c64_trap_wr(sys, 0x5B, _c64_trap_nz(c, _c64_trap_rd(sys, 0x5B) - 1));
+        _c64_trap_wr(sys, 0x59, _c64_trap_nz(c, _c64_trap_rd(sys, 0x59) - 1));
+        c->X = _c64_trap_nz(c, c->X - 1);
+        if (c->X == 0) {
+            break;
+        }
+        copy = true;
+    }
+}
+
+// BA59 MLTPLY: add FAC2 (6A..6D) to the result (26..29, 70) for each bit set in A, from bit 0
+static void _c64_trap_mltply(c64_t* sys, m6502_t* c, bool zero_check) {
+    uint8_t* zp = sys->traps.zp;
+    if (zero_check && (c->P & M6502_ZF)) {
+        // JMP $B983 MULSHF: with a zero byte the result only shifts right by 8 bits
+        c->X = _c64_trap_nz(c, 0x25);
+        do {
+            c->Y = _c64_trap_nz(c, zp[0x29]);
+            _c64_trap_zp_wr(sys, 0x70, c->Y);
+            c->Y = _c64_trap_nz(c, zp[0x28]);
+            _c64_trap_zp_wr(sys, 0x29, c->Y);
+            c->Y = _c64_trap_nz(c, zp[0x27]);
+            _c64_trap_zp_wr(sys, 0x28, c->Y);
+            c->Y = _c64_trap_nz(c, zp[0x26]);
+            _c64_trap_zp_wr(sys, 0x27, c->Y);
+            c->Y = _c64_trap_nz(c, zp[0x68]);
+            _c64_trap_zp_wr(sys, 0x26, c->Y);
+            _m6502_adc(c, 0x08);
+        } while (c->P & (M6502_NF|M6502_ZF));
+        _m6502_sbc(c, 0x08);
+        c->Y = _c64_trap_nz(c, c->A);
+        c->A = _c64_trap_nz(c, zp[0x70]);
+        if (!(c->P & M6502_CF)) {
+            // B9A6: shift right by the remaining bits, keeping the sign of 26
+            do {
+                _c64_trap_zp_wr(sys, 0x26, _m6502_asl(c, zp[0x26]));
+                if (c->P & M6502_CF) {
+                    _c64_trap_zp_wr(sys, 0x26, _c64_trap_nz(c, zp[0x26] + 1));
+                }
+                _c64_trap_zp_wr(sys, 0x26, _m6502_ror(c, zp[0x26]));
+                _c64_trap_zp_wr(sys, 0x26, _m6502_ror(c, zp[0x26]));
+                _c64_trap_zp_wr(sys, 0x27, _m6502_ror(c, zp[0x27]));
+                _c64_trap_zp_wr(sys, 0x28, _m6502_ror(c, zp[0x28]));
+                _c64_trap_zp_wr(sys, 0x29, _m6502_ror(c, zp[0x29]));
+                c->A = _m6502_ror(c, c->A);
+                c->Y = _c64_trap_nz(c, c->Y + 1);
+            } while (c->Y != 0);
+        }
+        c->P &= ~M6502_CF;
+        return;
+    }
+    // BA5E: bit 7 set in Y ends the loop after 8 bits
+    c->A = _m6502_lsr(c, c->A);
+    c->A = _c64_trap_nz(c, c->A | 0x80);
+    do {
+        c->Y = _c64_trap_nz(c, c->A);
+        if (c->P & M6502_CF) {
+            c->P &= ~M6502_CF;
+            for (uint16_t i = 3, addr = 0x29; i < 4; i--, addr--) {
+                c->A = _c64_trap_nz(c, zp[addr]);
+                _m6502_adc(c, zp[0x6A + i]);
+                _c64_trap_zp_wr(sys, addr, c->A);
+            }
+        }
+        // BA7D
+        _c64_trap_zp_wr(sys, 0x26, _m6502_ror(c, zp[0x26]));
+        _c64_trap_zp_wr(sys, 0x27, _m6502_ror(c, zp[0x27]));
+        _c64_trap_zp_wr(sys, 0x28, _m6502_ror(c, zp[0x28]));
+        _c64_trap_zp_wr(sys, 0x29, _m6502_ror(c, zp[0x29]));
+        _c64_trap_zp_wr(sys, 0x70, _m6502_ror(c, zp[0x70]));
+        c->A = _c64_trap_nz(c, c->Y);
+        c->A = _m6502_lsr(c, c->A);
+    } while (c->A != 0);
+}
+
+// B938: shift the mantissa of FAC1 right into a new bit, false on overflow
+static bool _c64_trap_fp_carry(c64_t* sys, m6502_t* c) {
+    uint8_t* zp = sys->traps.zp;
+    _c64_trap_zp_wr(sys, 0x61, _c64_trap_nz(c, zp[0x61] + 1));
+    if (c->P & M6502_ZF) {
+        return false;
+    }
+    for (uint16_t addr = 0x62; addr <= 0x65; addr++) {
+        _c64_trap_zp_wr(sys, addr, _m6502_ror(c, zp[addr]));
+    }
+    _c64_trap_zp_wr(sys, 0x70, _m6502_ror(c, zp[0x70]));
+    return true;
+}
+
+// B8F7: FAC1 = 0
+static void _c64_trap_fp_zero(c64_t* sys, m6502_t* c) {
+    c->A = _c64_trap_nz(c, 0x00);
+    _c64_trap_zp_wr(sys, 0x61, c->A);
+    _c64_trap_zp_wr(sys, 0x66, c->A);
+}
+
+// B8D7 NORMAL: normalize FAC1, false on overflow
+static bool _c64_trap_fp_normal(c64_t* sys, m6502_t* c) {
+    uint8_t* zp = sys->traps.zp;
+    c->Y = _c64_trap_nz(c, 0x00);
+    c->A = _c64_trap_nz(c, c->Y);
+    c->P &= ~M6502_CF;
+    for (;;) {
+        // B8DB: shift by whole bytes first
+        c->X = _c64_trap_nz(c, zp[0x62]);
+        if (c->X != 0) {
+            break;
+        }
+        for (uint16_t addr = 0x62; addr <= 0x64; addr++) {
+            c->X = _c64_trap_nz(c, zp[addr + 1]);
+            _c64_trap_zp_wr(sys, addr, c->X);
+        }
+        c->X = _c64_trap_nz(c, zp[0x70]);
+        _c64_trap_zp_wr(sys, 0x65, c->X);
+        _c64_trap_zp_wr(sys, 0x70, c->Y);
+        _m6502_adc(c, 0x08);
+        _m6502_cmp(c, c->A, 0x20);
+        if (c->P & M6502_ZF) {
+            _c64_trap_fp_zero(sys, c);
+            return true;
+        }
+    }
+    // B929: then bit by bit
+    while (!(c->P & M6502_NF)) {
+        _m6502_adc(c, 0x01);
+        _c64_trap_zp_wr(sys, 0x70, _m6502_asl(c, zp[0x70]));
+        for (uint16_t addr = 0x65; addr >= 0x62; addr--) {
+            _c64_trap_zp_wr(sys, addr, _m6502_rol(c, zp[addr]));
+        }
+    }
+    c->P |= M6502_CF;
+    _m6502_sbc(c, zp[0x61]);
+    if (c->P & M6502_CF) {
+        _c64_trap_fp_zero(sys, c);
+        return true;
+    }
+    c->A = _c64_trap_nz(c, c->A ^ 0xFF);
+    _m6502_adc(c, 0x01);
+    _c64_trap_zp_wr(sys, 0x61, c->A);
+    if (!(c->P & M6502_CF)) {
+        return true;
+    }
+    return _c64_trap_fp_carry(sys, c);
+}
+
+// BB12 FDIVT: FAC1 = FAC2 / FAC1, false on division by zero and overflow
+static bool _c64_trap_fdivt(c64_t* sys, m6502_t* c) {
+    uint8_t* zp = sys->traps.zp;
+    if (c->P & M6502_ZF) {
+        return false;
+    }
+    // JSR $BC1B ROUND: round FAC1 with its rounding byte
+    _c64_trap_zp_push(sys, c, 0xBB);
+    _c64_trap_zp_push(sys, c, 0x16);
+    c->A = _c64_trap_nz(c, zp[0x61]);
+    if (c->A != 0) {
+        _c64_trap_zp_wr(sys, 0x70, _m6502_asl(c, zp[0x70]));
+        if (c->P & M6502_CF) {
+            // JSR $B96F: increment the mantissa
+            _c64_trap_zp_push(sys, c, 0xBC);
+            _c64_trap_zp_push(sys, c, 0x25);
+            for (uint16_t addr = 0x65; addr >= 0x62; addr--) {
+                _c64_trap_zp_wr(sys, addr, _c64_trap_nz(c, zp[addr] + 1));
+                if (zp[addr] != 0) {
+                    break;
+                }
+            }
+            c->S += 2;
+            if ((c->P & M6502_ZF) && !_c64_trap_fp_carry(sys, c)) {
+                return false;
+            }
+        }
+    }
+    c->S += 2;
+    // BB17: negate the exponent of FAC1
+    c->A = _c64_trap_nz(c, 0x00);
+    c->P |= M6502_CF;
+    _m6502_sbc(c, zp[0x61]);
+    _c64_trap_zp_wr(sys, 0x61, c->A);
+    // JSR $BAB7 MULDIV: add the exponent of FAC2
+    _c64_trap_zp_push(sys, c, 0xBB);
+    _c64_trap_zp_push(sys, c, 0x20);
+    c->A = _c64_trap_nz(c, zp[0x69]);
+    bool zero = (c->A == 0);
+    if (!zero) {
+        c->P &= ~M6502_CF;
+        _m6502_adc(c, zp[0x61]);
+        if (c->P & M6502_CF) {
+            if (c->P & M6502_NF) {
+                return false;
+            }
+            // the BIT $1410 only skips the BPL, the ADC sets its flags again
+            c->P &= ~M6502_CF;
+        }
+        else {
+            zero = !(c->P & M6502_NF);
+        }
+    }
+    if (zero) {
+        // BADA: return from FDIVT itself with FAC1 = 0
+        c->A = _c64_trap_nz(c, _c64_trap_zp_pull(sys, c));
+        c->A = _c64_trap_nz(c, _c64_trap_zp_pull(sys, c));
+        _c64_trap_fp_zero(sys, c);
+        return true;
+    }
+    _m6502_adc(c, 0x80);
+    _c64_trap_zp_wr(sys, 0x61, c->A);
+    if (c->A != 0) {
+        c->A = _c64_trap_nz(c, zp[0x6F]);
+    }
+    _c64_trap_zp_wr(sys, 0x66, c->A);
+    c->S += 2;
+    // BB21
+    _c64_trap_zp_wr(sys, 0x61, _c64_trap_nz(c, zp[0x61] + 1));
+    if (c->P & M6502_ZF) {
+        return false;
+    }
+    // BB25: the quotient goes into 26..29 and the rounding byte, a bit at a time
+    c->X = _c64_trap_nz(c, 0xFC);
+    c->A = _c64_trap_nz(c, 0x01);
+    bool compare = true;
+    for (;;) {
+        if (compare) {
+            // BB29: compare the mantissas of FAC2 and FAC1
+            for (uint16_t i = 0; i < 4; i++) {
+                c->Y = _c64_trap_nz(c, zp[0x6A + i]);
+                _m6502_cmp(c, c->Y, zp[0x62 + i]);
+                if (!(c->P & M6502_ZF)) {
+                    break;
+                }
+            }
+        }
+        // BB3F
+        _c64_trap_zp_push(sys, c, c->P | M6502_XF);
+        c->A = _m6502_rol(c, c->A);
+        if (c->P & M6502_CF) {
+            c->X = _c64_trap_nz(c, c->X + 1);
+            _c64_trap_zp_wr(sys, (0x29 + c->X) & 0xFF, c->A);
+            if (c->X == 0) {
+                c->A = _c64_trap_nz(c, 0x40);
+            }
+            else if (!(c->X & 0x80)) {
+                break;
+            }
+            else {
+                c->A = _c64_trap_nz(c, 0x01);
+            }
+        }
+        // BB4C
+        c->P = (_c64_trap_zp_pull(sys, c) | M6502_BF) & ~M6502_XF;
+        if (c->P & M6502_CF) {
+            // BB5D: FAC2 -= FAC1
+            c->Y = _c64_trap_nz(c, c->A);
+            for (uint16_t i = 3; i < 4; i--) {
+                c->A = _c64_trap_nz(c, zp[0x6A + i]);
+                _m6502_sbc(c, zp[0x62 + i]);
+                _c64_trap_zp_wr(sys, 0x6A + i, c->A);
+            }
+            c->A = _c64_trap_nz(c, c->Y);
+        }
+        // BB4F: FAC2 <<= 1
+        _c64_trap_zp_wr(sys, 0x6D, _m6502_asl(c, zp[0x6D]));
+        _c64_trap_zp_wr(sys, 0x6C, _m6502_rol(c, zp[0x6C]));
+        _c64_trap_zp_wr(sys, 0x6B, _m6502_rol(c, zp[0x6B]));
+        _c64_trap_zp_wr(sys, 0x6A, _m6502_rol(c, zp[0x6A]));
+        compare = !(c->P & M6502_CF) && (c->P & M6502_NF);
+    }
+    // BB7E: the last two bits are the rounding byte
+    for (int i = 0; i < 6; i++) {
+        c->A = _m6502_asl(c, c->A);
+    }
+    _c64_trap_zp_wr(sys, 0x70, c->A);
+    c->P = (_c64_trap_zp_pull(sys, c) | M6502_BF) & ~M6502_XF;
+    // BB8F: copy the quotient into FAC1 and normalize it
+    for (uint16_t i = 0; i < 4; i++) {
+        c->A = _c64_trap_nz(c, zp[0x26 + i]);
+        _c64_trap_zp_wr(sys, 0x62 + i, c->A);
+    }
+    return _c64_trap_fp_normal(sys, c);
+}
+
+// E9C8 MOVLIN: copy the screen line at ($AC), the high byte in A, to the one at ($D1), with the colors
+static bool _c64_trap_movlin_ok(c64_t* sys) {
+    const uint8_t hi = (sys->cpu.A & 0x03) | _c64_trap_rd(sys, 0x0288);
+    const uint16_t src = _c64_trap_rd(sys, 0xAC) | (hi << 8);
+    const uint16_t dst = _c64_trap_rd16(sys, 0xD1);
+    return _c64_trap_ram_ok(sys, src, 40) && _c64_trap_ram_ok(sys, dst, 40) &&
+        _c64_trap_color_ok(sys, (src & 0x03FF) | 0xD800, 40) &&
+        _c64_trap_color_ok(sys, (dst & 0x03FF) | 0xD800, 40);
+}
+
+// E9F0 and EA24 set the color line pointer
+static void _c64_trap_color_ptr(c64_t* sys, m6502_t* c) {
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0xD1));
+    _c64_trap_wr(sys, 0xF3, c->A);
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0xD2));
+    c->A = _c64_trap_nz(c, (c->A & 0x03) | 0xD8);
+    _c64_trap_wr(sys, 0xF4, c->A);
+}
+
+static void _c64_trap_movlin(c64_t* sys, m6502_t* c) {
+    c->A = _c64_trap_nz(c, c->A & 0x03);
+    c->A = _c64_trap_nz(c, c->A | _c64_trap_rd(sys, 0x0288));
+    _c64_trap_wr(sys, 0xAD, c->A);
+    // JSR $E9E0, that does a JSR $EA24 first
+    _c64_trap_push(sys, c, 0xE9);
+    _c64_trap_push(sys, c, 0xD1);
+    _c64_trap_push(sys, c, 0xE9);
+    _c64_trap_push(sys, c, 0xE2);
+    _c64_trap_color_ptr(sys, c);
+    c->S += 2;
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0xAC));
+    _c64_trap_wr(sys, 0xAE, c->A);
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0xAD));
+    c->A = _c64_trap_nz(c, (c->A & 0x03) | 0xD8);
+    _c64_trap_wr(sys, 0xAF, c->A);
+    c->S += 2;
+    // E9D2
+    const uint16_t src = _c64_trap_rd16(sys, 0xAC);
+    const uint16_t dst = _c64_trap_rd16(sys, 0xD1);
+    const uint16_t color_src = _c64_trap_rd16(sys, 0xAE);
+    const uint16_t color_dst = _c64_trap_rd16(sys, 0xF3);
+    c->Y = 0x27;
+    do {
+        _c64_trap_wr(sys, dst + c->Y, _c64_trap_rd(sys, src + c->Y));
+        c->A = _c64_trap_rd(sys, color_src + c->Y);
+        _c64_trap_wr(sys, color_dst + c->Y, c->A);
+    } while (--c->Y != 0xFF);
+    _c64_trap_nz(c, c->Y);
+}
+
+// E9FF CLRLIN: clear the screen line X with the current color
+static bool _c64_trap_clrlin_ok(c64_t* sys) {
+    const uint8_t x = sys->cpu.X;
+    if (x >= 25) {
+        return false;
+    }
+    const uint16_t dst = _c64_trap_rd(sys, 0xECF0 + x) |
+        (((_c64_trap_rd(sys, 0xD9 + x) & 0x03) | _c64_trap_rd(sys, 0x0288)) << 8);
+    return _c64_trap_ram_ok(sys, dst, 40) && _c64_trap_color_ok(sys, (dst & 0x03FF) | 0xD800, 40);
+}
+
+static void _c64_trap_clrlin(c64_t* sys, m6502_t* c) {
+    c->Y = _c64_trap_nz(c, 0x27);
+    // JSR $E9F0: the screen line pointer from the line tables
+    _c64_trap_push(sys, c, 0xEA);
+    _c64_trap_push(sys, c, 0x03);
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0xECF0 + c->X));
+    _c64_trap_wr(sys, 0xD1, c->A);
+    c->A = _c64_trap_nz(c, _c64_trap_rd(sys, 0xD9 + c->X));
+    c->A = _c64_trap_nz(c, c->A & 0x03);
+    c->A = _c64_trap_nz(c, c->A | _c64_trap_rd(sys, 0x0288));
+    _c64_trap_wr(sys, 0xD2, c->A);
+    c->S += 2;
+    // JSR $EA24
+    _c64_trap_push(sys, c, 0xEA);
+    _c64_trap_push(sys, c, 0x06);
+    _c64_trap_color_ptr(sys, c);
+    c->S += 2;
+    // EA07: the JSR $E4DA for each character pushes the same return address
+    _c64_trap_push(sys, c, 0xEA);
+    _c64_trap_push(sys, c, 0x09);
+    c->S += 2;
+    const uint16_t dst = _c64_trap_rd16(sys, 0xD1);
+    const uint16_t color_dst = _c64_trap_rd16(sys, 0xF3);
+    do {
+        _c64_trap_wr(sys, color_dst + c->Y, _c64_trap_rd(sys, 0x0286));
+        _c64_trap_wr(sys, dst + c->Y, 0x20);
+    } while (--c->Y != 0xFF);
+    c->A = 0x20;
+    _c64_trap_nz(c, c->Y);
+}
+
+// at the opcode fetch: true if the native version can replace the ROM code
+static bool _c64_trap_prepare(c64_t* sys, int trap, uint16_t addr) {
+    switch (trap) {
+        case _C64_TRAP_BLTU: return _c64_trap_bltu_ok(sys);
+        case _C64_TRAP_MOVLIN: return _c64_trap_movlin_ok(sys);
+        case _C64_TRAP_CLRLIN: return _c64_trap_clrlin_ok(sys);
+        default: {
+            // zero page and stack are always RAM
+            m6502_t c = sys->cpu;
+            memcpy(sys->traps.zp, sys->mem_cpu.page_table[0].read_ptr, sizeof(sys->traps.zp));
+            memset(sys->traps.zp_written, 0, sizeof(sys->traps.zp_written));
+            if (trap == _C64_TRAP_MLTPLY) {
+                _c64_trap_mltply(sys, &c, addr == 0xBA59);
+            }
+            else if (!_c64_trap_fdivt(sys, &c)) {
+                return false;
+            }
+            sys->traps.a = c.A;
+            sys->traps.x = c.X;
+            sys->traps.y = c.Y;
+            sys->traps.p = c.P;
+            return true;
+        }
+    }
+}
+
+// when the CPU executes the RTS in place of the first opcode: do what the ROM code would
+static void _c64_trap_run(c64_t* sys, int trap) {
+    m6502_t* c = &sys->cpu;
+    switch (trap) {
+        case _C64_TRAP_BLTU: _c64_trap_bltu(sys, c); break;
+        case _C64_TRAP_MOVLIN: _c64_trap_movlin(sys, c); break;
+        case _C64_TRAP_CLRLIN: _c64_trap_clrlin(sys, c); break;
+        default:
+            for (uint16_t addr = 0; addr < 0x0200; addr++) {
+                if (_C64_TRAP_BIT(sys->traps.zp_written, addr)) {
+                    _c64_trap_wr(sys, addr, sys->traps.zp[addr]);
+                }
+            }
+            c->A = sys->traps.a;
+            c->X = sys->traps.x;
+            c->Y = sys->traps.y;
+            c->P = sys->traps.p;
+            break;
+    }
+}
+
+// test mode: note what the native version does at the fetch and undo it, then let the ROM code run
+static void _c64_trap_verify_start(c64_t* sys, int trap, uint64_t pins) {
+    c64_trap_verify_t* v = sys->traps.verify;
+    m6502_t* c = &sys->cpu;
+    const uint16_t addr = M6502_GET_ADDR(pins);
+    if (!_c64_trap_prepare(sys, trap, addr)) {
+        return;
+    }
+    const uint8_t a = c->A, x = c->X, y = c->Y, p = c->P;
+    memset(v->native, 0, sizeof(v->native));
+    sys->traps.capture = true;
+    _c64_trap_run(sys, trap);
+    sys->traps.capture = false;
+    v->a = c->A;
+    v->x = c->X;
+    v->y = c->Y;
+    v->p = c->P;
+    c->A = a;
+    c->X = x;
+    c->Y = y;
+    c->P = p;
+    for (uint32_t i = 0; i < C64_TRAP_MEM_SIZE; i++) {
+        if (_C64_TRAP_BIT(v->native, i)) {
+            v->expect[i] = _c64_trap_mem(sys, i);
+            // the page was copied if shared when written
+            if (i >= 0x10000) {
+                sys->color_ram[i & 0x03FF] = v->before[i];
+            }
+            else {
+                sys->ram[i] = v->before[i];
+            }
+        }
+    }
+    memset(v->rom, 0, sizeof(v->rom));
+    memset(v->clobbered, 0, sizeof(v->clobbered));
+    v->state = _C64_VERIFY_START;
+    v->trap = (uint8_t) trap;
+    v->opcode = M6502_GET_DATA(pins);
+    v->depth = 0;
+    v->s = c->S;
+    v->ret = (mem_rd(&sys->mem_cpu, 0x0100 | (uint8_t)(c->S + 1)) |
+        (mem_rd(&sys->mem_cpu, 0x0100 | (uint8_t)(c->S + 2)) << 8)) + 1;
+}
+
+// test mode: compare with what the ROM code did when it returns
+static void _c64_trap_verify_end(c64_t* sys) {
+    c64_trap_verify_t* v = sys->traps.verify;
+    const m6502_t* c = &sys->cpu;
+    bool match = (c->A == v->a) && (c->X == v->x) && (c->Y == v->y) &&
+        (((c->P ^ v->p) & ~(M6502_BF|M6502_XF)) == 0);
+    for (uint32_t w = 0; w < (C64_TRAP_MEM_SIZE/64); w++) {
+        if (v->native[w] != v->rom[w]) {
+            match = false;
+        }
+        const uint64_t bits = v->native[w] & ~v->clobbered[w];
+        for (uint32_t b = 0; bits && (b < 64); b++) {
+            const uint32_t i = (w << 6) | b;
+            if ((bits & (1ULL << b)) && (_c64_trap_mem(sys, i) != v->expect[i])) {
+                match = false;
+            }
+        }
+    }
+    sys->traps.stats.calls[v->trap]++;
+    if (!match) {
+        sys->traps.stats.mismatches[v->trap]++;
+    }
+    v->state = _C64_VERIFY_IDLE;
+}
+
+// test mode: record the writes of the ROM code, and of the interrupt handlers meanwhile
+static void _c64_trap_verify_tick(c64_t* sys, uint64_t in_pins, uint64_t pins) {
+    c64_trap_verify_t* v = sys->traps.verify;
+    const m6502_t* c = &sys->cpu;
+    if (v->state == _C64_VERIFY_START) {
+        // like a trap, only if no interrupt took over the fetch
+        v->state = ((c->IR >> 3) == v->opcode) ? _C64_VERIFY_ROM : _C64_VERIFY_IDLE;
+        return;
+    }
+    if ((in_pins & (M6502_RDY|M6502_RW)) != (M6502_RDY|M6502_RW)) {
+        if (c->IR == ((0x00<<3)|1)) {
+            if (c->brk_flags & M6502_BRK_RESET) {
+                v->state = _C64_VERIFY_IDLE;
+                return;
+            }
+            v->depth++;
+        }
+        else if ((c->IR == ((0x40<<3)|6)) && (v->depth > 0)) {
+            v->depth--;
+        }
+    }
+    if (!(pins & M6502_RW)) {
+        const uint32_t i = _c64_trap_index(sys, M6502_GET_ADDR(pins));
+        uint64_t* bits = (v->depth > 0) ? v->clobbered : v->rom;
+        bits[i >> 6] |= 1ULL << (i & 63);
+    }
+    if ((v->depth == 0) && ((pins & (M6502_SYNC|M6502_RDY)) == M6502_SYNC) &&
+        (M6502_GET_ADDR(pins) == v->ret) && (c->S == (uint8_t)(v->s + 2)))
+    {
+        _c64_trap_verify_end(sys);
+    }
+}
+
+// after each tick with the ROM traps or their test mode
+static uint64_t _c64_traps_tick(c64_t* sys, uint64_t in_pins, uint64_t pins) {
+    c64_traps_t* t = &sys->traps;
+    if (t->pending) {
+        // the CPU executes the RTS, unless an interrupt took over the fetch
+        if (sys->cpu.IR == ((0x60<<3)|1)) {
+            _c64_trap_run(sys, t->trap);
+            t->stats.calls[t->trap]++;
+        }
+        t->pending = false;
+    }
+    if (t->verify && (t->verify->state != _C64_VERIFY_IDLE)) {
+        _c64_trap_verify_tick(sys, in_pins, pins);
+    }
+    else if (((pins & (M6502_SYNC|M6502_RDY)) == M6502_SYNC) && (M6502_GET_ADDR(pins) >= 0xA000)) {
+        // the opcode fetch completes, the CPU decodes it in the next tick
+        const uint16_t addr = M6502_GET_ADDR(pins);
+        const int trap = _c64_trap_at(addr);
+        if ((trap >= 0) && (t->mask & (1 << trap)) && _c64_trap_mapped(sys, addr)) {
+            if (t->verify) {
+                _c64_trap_verify_start(sys, trap, pins);
+            }
+            else if (_c64_trap_prepare(sys, trap, addr)) {
+                t->pending = true;
+                t->trap = (uint8_t) trap;
+                t->opcode = M6502_GET_DATA(pins);
+                M6502_SET_DATA(pins, 0x60);
+            }
+        }
+    }
+    return pins;
+}
+
+static inline _C64_ALWAYS_INLINE uint32_t _c64_exec_loop(c64_t* sys, uint32_t num_ticks, const int features) {
     uint64_t pins = sys->pins;
-    if (0 == sys->debug.callback.func) {
+    uint32_t ticks = 0;
+    if (!(features & _C64_EXEC_DEBUG)) {
         // run without debug callback
-        for (uint32_t ticks = 0; ticks < num_ticks; ticks++) {
-            pins = _c64_tick(sys, pins);
+        for (; ticks < num_ticks; ticks++) {
+            const uint64_t in_pins = pins;
+            pins = _c64_tick(sys, pins, features);
+            if (features & _C64_EXEC_TRAPS) {
+                pins = _c64_traps_tick(sys, in_pins, pins);
+            }
         }
     }
     else {
         // run with debug callback
-        for (uint32_t ticks = 0; (ticks < num_ticks) && !(*sys->debug.stopped); ticks++) {
-            pins = _c64_tick(sys, pins);
+        for (; (ticks < num_ticks) && !(*sys->debug.stopped); ticks++) {
+            const uint64_t in_pins = pins;
+            pins = _c64_tick(sys, pins, features);
+            if (features & _C64_EXEC_TRAPS) {
+                pins = _c64_traps_tick(sys, in_pins, pins);
+            }
             sys->debug.callback.func(sys->debug.callback.user_data, pins);
         }
     }
+    if (sys->traps.pending) {
+        // the next call may run in another tier, give the CPU its opcode back
+        M6502_SET_DATA(pins, sys->traps.opcode);
+        sys->traps.pending = false;
+    }
     sys->pins = pins;
+    return ticks;
+}
+
+#ifndef C64_NO_EXEC_VARIANTS
+#define _C64_EXEC_VARIANT(f) static uint32_t _c64_exec_##f(c64_t* sys, uint32_t num_ticks) { return _c64_exec_loop(sys, num_ticks, f); }
+_C64_EXEC_VARIANT(0)  _C64_EXEC_VARIANT(1)  _C64_EXEC_VARIANT(2)  _C64_EXEC_VARIANT(3)
+_C64_EXEC_VARIANT(4)  _C64_EXEC_VARIANT(5)  _C64_EXEC_VARIANT(6)  _C64_EXEC_VARIANT(7)
+_C64_EXEC_VARIANT(8)  _C64_EXEC_VARIANT(9)  _C64_EXEC_VARIANT(10) _C64_EXEC_VARIANT(11)
+_C64_EXEC_VARIANT(12) _C64_EXEC_VARIANT(13) _C64_EXEC_VARIANT(14) _C64_EXEC_VARIANT(15)
+_C64_EXEC_VARIANT(16) _C64_EXEC_VARIANT(17) _C64_EXEC_VARIANT(18) _C64_EXEC_VARIANT(19)
+_C64_EXEC_VARIANT(20) _C64_EXEC_VARIANT(21) _C64_EXEC_VARIANT(22) _C64_EXEC_VARIANT(23)
+_C64_EXEC_VARIANT(24) _C64_EXEC_VARIANT(25) _C64_EXEC_VARIANT(26) _C64_EXEC_VARIANT(27)
+_C64_EXEC_VARIANT(28) _C64_EXEC_VARIANT(29) _C64_EXEC_VARIANT(30) _C64_EXEC_VARIANT(31)
+
+static uint32_t (* const _c64_exec_variants[_C64_EXEC_VARIANTS])(c64_t*, uint32_t) = {
+    _c64_exec_0,  _c64_exec_1,  _c64_exec_2,  _c64_exec_3,
+    _c64_exec_4,  _c64_exec_5,  _c64_exec_6,  _c64_exec_7,
+    _c64_exec_8,  _c64_exec_9,  _c64_exec_10, _c64_exec_11,
+    _c64_exec_12, _c64_exec_13, _c64_exec_14, _c64_exec_15,
+    _c64_exec_16, _c64_exec_17, _c64_exec_18, _c64_exec_19,
+    _c64_exec_20, _c64_exec_21, _c64_exec_22, _c64_exec_23,
+    _c64_exec_24, _c64_exec_25, _c64_exec_26, _c64_exec_27,
+    _c64_exec_28, _c64_exec_29, _c64_exec_30, _c64_exec_31,
+};
+#endif
+
+// the features the tick loop needs, the same for the whole c64_exec() call
+static int _c64_exec_features(c64_t* sys) {
+    int features = 0;
+    if (sys->debug.callback.func) {
+        features |= _C64_EXEC_DEBUG;
+    }
+    if (sys->audio.callback.func) {
+        features |= _C64_EXEC_AUDIO;
+    }
+    if (sys->vic.crt_set_pixel) {
+        features |= _C64_EXEC_VIDEO;
+    }
+    if (sys->c1541.valid) {
+        features |= _C64_EXEC_DRIVE;
+    }
+    if (sys->traps.mask && (sys->traps.verify || (sys->vic.render.mode == M6569_RENDER_FRAME))) {
+        features |= _C64_EXEC_TRAPS;
+    }
+    return features;
+}
+
+static uint32_t _c64_exec_ticks(c64_t* sys, uint32_t num_ticks) {
+    #ifdef C64_NO_EXEC_VARIANTS
+    uint32_t ticks = _c64_exec_loop(sys, num_ticks, _c64_exec_features(sys));
+    #else
+    uint32_t ticks = _c64_exec_variants[_c64_exec_features(sys)](sys, num_ticks);
+    #endif
+    if (sys->drive_sync.enabled) {
+        _c64_drive_publish(&sys->drive_sync);
+    }
+    c64_video_sync(sys);
+    return ticks;
+}
+
+uint32_t c64_exec(c64_t* sys, uint32_t micro_seconds) {
+    CHIPS_ASSERT(sys && sys->valid && (sys->num_forks == 0));
+    uint32_t num_ticks = clk_us_to_ticks(C64_FREQUENCY, micro_seconds);
+    _c64_exec_ticks(sys, num_ticks);
     kbd_update(&sys->kbd, micro_seconds);
     return num_ticks;
 }
 
+uint32_t c64_exec_ticks(c64_t* sys, uint32_t num_ticks) {
+    CHIPS_ASSERT(sys && sys->valid && (sys->num_forks == 0));
+    uint32_t ticks = _c64_exec_ticks(sys, num_ticks);
+    kbd_update(&sys->kbd, (uint32_t)(((uint64_t)ticks * 1000000) / C64_FREQUENCY));
+    return ticks;
+}
+
 void c64_key_down(c64_t* sys, int key_code) {
     CHIPS_ASSERT(sys && sys->valid);
     if (sys->joystick_type == C64_JOYSTICKTYPE_NONE) {
@@ -1011,6 +3506,83 @@ void c64_key_up(c64_t* sys, int key_code) {
     }
 }
 
+void c64_set_accuracy(c64_t* sys, c64_accuracy_t accuracy) {
+    CHIPS_ASSERT(sys && sys->valid);
+    // the cycle by cycle decoding can't be threaded
+    CHIPS_ASSERT(!(sys->video_sync.enabled && (accuracy == C64_ACCURACY_CYCLE)));
+    m6569_set_render_mode(&sys->vic, (int) accuracy);
+    // the raster effects appear or disappear
+    _c64_damage_all(sys);
+}
+
+c64_accuracy_t c64_accuracy(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return (c64_accuracy_t) sys->vic.render.next_mode;
+}
+
+uint32_t c64_set_traps(c64_t* sys, uint32_t mask) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->traps.mask = mask & sys->traps.usable;
+    if (sys->traps.verify) {
+        sys->traps.verify->state = _C64_VERIFY_IDLE;
+    }
+    return sys->traps.mask;
+}
+
+c64_trap_stats_t c64_trap_stats(const c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return sys->traps.stats;
+}
+
+uint32_t c64_damage(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    const uint32_t rows = sys->damage.rows | sys->damage.prev[0] | sys->damage.prev[1];
+    sys->damage.prev[1] = sys->damage.prev[0];
+    sys->damage.prev[0] = sys->damage.rows;
+    sys->damage.rows = 0;
+    return rows;
+}
+
+bool c64_damage_lines(uint32_t rows, int* y0, int* y1) {
+    CHIPS_ASSERT(y0 && y1);
+    if (rows & C64_DAMAGE_ALL) {
+        *y0 = 0;
+        *y1 = _C64_SCREEN_HEIGHT;
+        return true;
+    }
+    int top = _C64_SCREEN_HEIGHT, bottom = 0;
+    if (rows & C64_DAMAGE_TOP) {
+        top = 0;
+        bottom = _C64_TEXT_Y;
+    }
+    if (rows & ((1U << 25) - 1)) {
+        int first = 0, last = 24;
+        while (!(rows & (1U << first))) {
+            first++;
+        }
+        while (!(rows & (1U << last))) {
+            last--;
+        }
+        // row N starts at raster line 0x30 + N*8 + YSCROLL
+        if (top > _C64_TEXT_Y + first * 8) {
+            top = _C64_TEXT_Y + first * 8;
+        }
+        bottom = _C64_TEXT_Y + last * 8 + 8 + 7;
+    }
+    if (rows & C64_DAMAGE_BOTTOM) {
+        if (top > _C64_TEXT_Y + 200) {
+            top = _C64_TEXT_Y + 200;
+        }
+        bottom = _C64_SCREEN_HEIGHT;
+    }
+    if (top >= bottom) {
+        return false;
+    }
+    *y0 = top;
+    *y1 = bottom;
+    return true;
+}
+
 void c64_set_joystick_type(c64_t* sys, c64_joystick_type_t type) {
     CHIPS_ASSERT(sys && sys->valid);
     sys->joystick_type = type;
@@ -1027,6 +3599,29 @@ void c64_joystick(c64_t* sys, uint8_t joy1_mask, uint8_t joy2_mask) {
     sys->joy_joy2_mask = joy2_mask;
 }
 
+void c64_mem_write(c64_t* sys, uint16_t addr, uint8_t data) {
+    CHIPS_ASSERT(sys && sys->valid && (sys->num_forks == 0));
+    if (sys->io_mapped && ((addr & 0xFC00) == 0xD800)) {
+        sys->color_ram[addr & 0x03FF] = data;
+        _c64_damage_color(sys, addr);
+        return;
+    }
+    const uint64_t page_mask = 1ULL << (addr >> 10);
+    if (sys->ram_shared & page_mask) {
+        _c64_unshare_ram(sys, page_mask);
+    }
+    mem_wr(&sys->mem_cpu, addr, data);
+    sys->ram_dirty |= page_mask;
+    if (sys->damage.watch & page_mask) {
+        _c64_damage_ram(sys, addr);
+    }
+}
+
+static void _c64_mem_write16(c64_t* sys, uint16_t addr, uint16_t data) {
+    c64_mem_write(sys, addr, (uint8_t)data);
+    c64_mem_write(sys, addr+1, (uint8_t)(data>>8));
+}
+
 bool c64_quickload(c64_t* sys, chips_range_t data) {
     CHIPS_ASSERT(sys && sys->valid && data.ptr);
     if (data.size < 2) {
@@ -1038,19 +3633,125 @@ bool c64_quickload(c64_t* sys, chips_range_t data) {
     const uint16_t end_addr = start_addr + (data.size - 2);
     uint16_t addr = start_addr;
     while (addr < end_addr) {
-        mem_wr(&sys->mem_cpu, addr++, *ptr++);
+        c64_mem_write(sys, addr++, *ptr++);
     }
 
     // update the BASIC pointers
-    mem_wr16(&sys->mem_cpu, 0x2d, end_addr);
-    mem_wr16(&sys->mem_cpu, 0x2f, end_addr);
-    mem_wr16(&sys->mem_cpu, 0x31, end_addr);
-    mem_wr16(&sys->mem_cpu, 0x33, end_addr);
-    mem_wr16(&sys->mem_cpu, 0xae, end_addr);
+    _c64_mem_write16(sys, 0x2d, end_addr);
+    _c64_mem_write16(sys, 0x2f, end_addr);
+    _c64_mem_write16(sys, 0x31, end_addr);
+    _c64_mem_write16(sys, 0x33, end_addr);
+    _c64_mem_write16(sys, 0xae, end_addr);
 
     return true;
 }
 
+bool c64_insert_disc(c64_t* sys, chips_range_t data) {
+    CHIPS_ASSERT(sys && sys->valid && sys->c1541.valid);
+    c64_drive_sync(sys);
+    return c1541_insert_disc(&sys->c1541, data);
+}
+
+void c64_remove_disc(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid && sys->c1541.valid);
+    c64_drive_sync(sys);
+    c1541_remove_disc(&sys->c1541);
+}
+
+static uint16_t _c64_be16(const uint8_t* ptr) {
+    return (uint16_t)((ptr[0]<<8) | ptr[1]);
+}
+
+static uint32_t _c64_be32(const uint8_t* ptr) {
+    return ((uint32_t)ptr[0]<<24) | ((uint32_t)ptr[1]<<16) | ((uint32_t)ptr[2]<<8) | ptr[3];
+}
+
+bool c64_insert_cart(c64_t* sys, chips_range_t data) {
+    CHIPS_ASSERT(sys && sys->valid && data.ptr);
+    /*
+        The CRT file format: a header with the hardware type and the state
+        of the EXROM and GAME lines (0 if pulled low), followed by CHIP
+        packets, each with a bank number, a load address and a ROM image.
+        All the numbers are big endian.
+    */
+    const uint8_t* ptr = (const uint8_t*) data.ptr;
+    const size_t size = data.size;
+    if ((size < 0x40) || (0 != memcmp(ptr, "C64 CARTRIDGE   ", 16))) {
+        return false;
+    }
+    const uint32_t header_size = _c64_be32(ptr + 0x10);
+    const uint16_t type = _c64_be16(ptr + 0x16);
+    if ((type != C64_CART_NORMAL) && (type != C64_CART_OCEAN) &&
+        (type != C64_CART_MAGIC_DESK) && (type != C64_CART_EASYFLASH))
+    {
+        return false;
+    }
+    c64_cart_t cart;
+    memset(&cart, 0, sizeof(cart));
+    cart.inserted = true;
+    cart.type = (uint8_t) type;
+    cart.reset_lines = (ptr[0x18] ? 0 : C64_CART_EXROM) | (ptr[0x19] ? 0 : C64_CART_GAME);
+    cart.hash = _c64_rom_hash(_C64_ROM_HASH_INIT, data);
+    size_t pos = (header_size < 0x40) ? 0x40 : header_size;
+    bool found = false;
+    while ((pos + 0x10) <= size) {
+        const uint8_t* chip = ptr + pos;
+        const uint32_t chip_size = _c64_be32(chip + 4);
+        const uint16_t bank = _c64_be16(chip + 0x0A);
+        const uint16_t load_addr = _c64_be16(chip + 0x0C);
+        const uint16_t rom_size = _c64_be16(chip + 0x0E);
+        if ((0 != memcmp(chip, "CHIP", 4)) || (chip_size < (0x10u + rom_size)) || (chip_size > (size - pos))) {
+            return false;
+        }
+        if (bank < C64_CART_MAX_BANKS) {
+            const uint8_t* rom = chip + 0x10;
+            if ((load_addr == 0x8000) && (rom_size == 0x4000)) {
+                cart.roml[bank] = rom;
+                cart.romh[bank] = rom + 0x2000;
+            }
+            else if ((load_addr == 0x8000) && (rom_size == 0x2000)) {
+                cart.roml[bank] = rom;
+            }
+            else if (((load_addr == 0xA000) || (load_addr == 0xE000)) && (rom_size == 0x2000)) {
+                cart.romh[bank] = rom;
+            }
+            else {
+                return false;
+            }
+            found = true;
+        }
+        pos += chip_size;
+    }
+    if (!found) {
+        return false;
+    }
+    if (type == C64_CART_OCEAN) {
+        // a single 8 KB bank visible at ROML and ROMH, whatever the load address
+        for (int bank = 0; bank < C64_CART_MAX_BANKS; bank++) {
+            if (!cart.roml[bank]) {
+                cart.roml[bank] = cart.romh[bank];
+            }
+            cart.romh[bank] = cart.roml[bank];
+        }
+    }
+    c64_drive_sync(sys);
+    sys->cart = cart;
+    c64_reset(sys);
+    return true;
+}
+
+void c64_remove_cart(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    c64_drive_sync(sys);
+    memset(&sys->cart, 0, sizeof(sys->cart));
+    c64_reset(sys);
+}
+
+bool c64_cart_inserted(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return sys->cart.inserted;
+}
+
 chips_display_info_t c64_display_info(c64_t* sys) {
     chips_display_info_t res = {
         .frame = {
@@ -1082,73 +3783,224 @@ chips_display_info_t c64_display_info(c64_t* sys) {
 
 uint32_t c64_save_snapshot(c64_t* sys, c64_t* dst) {
     CHIPS_ASSERT(sys && dst);
+    c64_drive_sync(sys);
     *dst = *sys;
     chips_debug_snapshot_onsave(&dst->debug);
     chips_audio_callback_snapshot_onsave(&dst->audio.callback);
     m6502_snapshot_onsave(&dst->cpu);
     m6569_snapshot_onsave(&dst->vic);
-    mem_snapshot_onsave(&dst->mem_cpu, sys);
-    mem_snapshot_onsave(&dst->mem_vic, sys);
+    // the memory maps point into the ROM images of this instance, they
+    // are rebuilt from the CPU port when the snapshot is loaded
+    mem_init(&dst->mem_cpu);
+    mem_init(&dst->mem_vic);
+    dst->rom_char = dst->rom_basic = dst->rom_kernal = 0;
+    memset(dst->cart.roml, 0, sizeof(dst->cart.roml));
+    memset(dst->cart.romh, 0, sizeof(dst->cart.romh));
+    // the snapshot of a fork gets its own copy of the shared RAM pages
+    for (int page = 0; page < 64; page++) {
+        if (sys->ram_shared & (1ULL << page)) {
+            memcpy(&dst->ram[page << 10], sys->ram_src[page], 0x0400);
+        }
+        dst->ram_src[page] = 0;
+    }
+    dst->ram_shared = 0;
+    dst->num_forks = 0;
+    dst->fork_base = 0;
+    memset(dst->reu_shared, 0, sizeof(dst->reu_shared));
+    memset(dst->reu_dirty, 0, sizeof(dst->reu_dirty));
+    memset(dst->reu_src, 0, sizeof(dst->reu_src));
+    memset(&dst->trace, 0, sizeof(dst->trace));
+    dst->heatmap = 0;
+    dst->raster_profile = 0;
+    dst->reu.mem = 0;
+    dst->traps.verify = 0;
+    if (sys->c1541.valid) {
+        c1541_snapshot_onsave(&dst->c1541);
+    }
     return C64_SNAPSHOT_VERSION;
 }
 
 bool c64_load_snapshot(c64_t* sys, uint32_t version, c64_t* src) {
     CHIPS_ASSERT(sys && src);
-    if (version != C64_SNAPSHOT_VERSION) {
+    if ((version != C64_SNAPSHOT_VERSION) || (src->rom_hash != sys->rom_hash) ||
+        (src->cart.hash != sys->cart.hash) || (src->reu.size != sys->reu.size))
+    {
         return false;
     }
+    CHIPS_ASSERT(sys->num_forks == 0);
+    c64_drive_sync(sys);
     static c64_t im;
     im = *src;
+    // a fork stays a fork of the same machine, but with all its RAM
+    im.fork_base = sys->fork_base;
+    im.trace = sys->trace;
+    im.heatmap = sys->heatmap;
+    im.raster_profile = sys->raster_profile;
+    // like the accuracy, the ROM traps aren't part of the snapshot
+    im.traps = sys->traps;
+    if (im.traps.verify) {
+        im.traps.verify->state = _C64_VERIFY_IDLE;
+    }
+    // the REU memory isn't in the snapshot, only the registers
+    im.reu.mem = sys->reu.mem;
+    im.reu.size = sys->reu.size;
+    memcpy(im.reu_shared, sys->reu_shared, sizeof(im.reu_shared));
+    memcpy(im.reu_dirty, sys->reu_dirty, sizeof(im.reu_dirty));
+    memcpy(im.reu_src, sys->reu_src, sizeof(im.reu_src));
     chips_debug_snapshot_onload(&im.debug, &sys->debug);
     chips_audio_callback_snapshot_onload(&im.audio.callback, &sys->audio.callback);
     m6502_snapshot_onload(&im.cpu, &sys->cpu);
     m6569_snapshot_onload(&im.vic, &sys->vic);
-    mem_snapshot_onload(&im.mem_cpu, sys);
-    mem_snapshot_onload(&im.mem_vic, sys);
-    *sys = im;
+    im.rom_char = sys->rom_char;
+    im.rom_basic = sys->rom_basic;
+    im.rom_kernal = sys->rom_kernal;
+    memcpy(im.cart.roml, sys->cart.roml, sizeof(im.cart.roml));
+    memcpy(im.cart.romh, sys->cart.romh, sizeof(im.cart.romh));
+    if (im.c1541.valid) {
+        c1541_snapshot_onload(&im.c1541, &sys->c1541);
+    }
+    // the thread synchronization state belongs to the running instance
+    memcpy(sys, &im, offsetof(c64_t, drive_sync));
+    _c64_init_memory_map(sys);
+    _c64_damage_all(sys);
+    sys->drive_sync.drive_out = sys->c1541.iec_out;
     return true;
 }
 
+void c64_restore_dirty(c64_t* sys, const c64_t* base) {
+    CHIPS_ASSERT(sys && base && base->valid && (sys->num_forks == 0));
+    // the REU pages still shared in base get their content back with the
+    // page map, the others were overwritten in the REU memory itself
+    for (int i = 0; i < 4; i++) {
+        CHIPS_ASSERT(0 == (sys->reu_dirty[i] & ~base->reu_shared[i]));
+    }
+    c64_drive_sync(sys);
+    const uint64_t dirty = sys->ram_dirty;
+    const c64_trace_t trace = sys->trace;
+    c64_heatmap_t* heatmap = sys->heatmap;
+    c64_raster_profile_t* raster_profile = sys->raster_profile;
+    const c64_traps_t traps = sys->traps;
+    // the state around the RAM is small and always copied, the copied
+    // pointers are valid because base is a copy of this same instance
+    memcpy(sys, base, offsetof(c64_t, ram));
+    sys->trace = trace;
+    sys->heatmap = heatmap;
+    sys->raster_profile = raster_profile;
+    memcpy(&sys->joystick_type, &base->joystick_type,
+        offsetof(c64_t, c1541) - offsetof(c64_t, joystick_type));
+    sys->traps = traps;
+    if (sys->traps.verify) {
+        sys->traps.verify->state = _C64_VERIFY_IDLE;
+    }
+    for (int page = 0; page < 64; page++) {
+        if (dirty & (1ULL << page)) {
+            memcpy(&sys->ram[page << 10], &base->ram[page << 10], 1 << 10);
+        }
+    }
+    sys->ram_dirty = 0;
+    memset(sys->reu_dirty, 0, sizeof(sys->reu_dirty));
+    _c64_damage_all(sys);
+    if (sys->c1541.valid) {
+        sys->c1541 = base->c1541;
+        sys->drive_sync.drive_out = sys->c1541.iec_out;
+    }
+}
+
+void c64_fork(c64_t* sys, c64_t* fork) {
+    // a fork needs its own REU memory, see c64_fork_reu()
+    CHIPS_ASSERT(sys && (0 == sys->reu.mem));
+    c64_fork_reu(sys, fork, (chips_range_t){0});
+}
+
+void c64_fork_reu(c64_t* sys, c64_t* fork, chips_range_t reu) {
+    CHIPS_ASSERT(sys && sys->valid && fork && (fork != sys));
+    CHIPS_ASSERT((reu.ptr != 0) == (sys->reu.mem != 0) && (reu.size == sys->reu.size));
+    c64_drive_sync(sys);
+    // everything but the RAM and the thread synchronization
+    memcpy(fork, sys, offsetof(c64_t, ram));
+    memcpy(&fork->joystick_type, &sys->joystick_type,
+        offsetof(c64_t, c1541) - offsetof(c64_t, joystick_type));
+    memset(&fork->drive_sync, 0, sizeof(fork->drive_sync));
+    memset(&fork->video_sync, 0, sizeof(fork->video_sync));
+    fork->cpu.user_data = fork;
+    fork->vic.mem.user_data = fork;
+    fork->vic.line_cb = 0;
+    memset(&fork->trace, 0, sizeof(fork->trace));
+    fork->heatmap = 0;
+    fork->raster_profile = 0;
+    fork->traps.verify = 0;
+    memset(&fork->traps.stats, 0, sizeof(fork->traps.stats));
+    for (int page = 0; page < 64; page++) {
+        if (!(sys->ram_shared & (1ULL << page))) {
+            fork->ram_src[page] = sys->ram + (page << 10);
+        }
+    }
+    fork->ram_shared = ~0ULL;
+    fork->reu.mem = (uint8_t*) reu.ptr;
+    const uint32_t reu_pages = sys->reu.size >> _C64_REU_PAGE_SHIFT;
+    for (uint32_t page = 0; page < reu_pages; page++) {
+        const uint64_t page_mask = 1ULL << (page & 63);
+        if (!(sys->reu_shared[page >> 6] & page_mask)) {
+            fork->reu_src[page] = sys->reu.mem + (page << _C64_REU_PAGE_SHIFT);
+        }
+        fork->reu_shared[page >> 6] |= page_mask;
+    }
+    memset(fork->reu_dirty, 0, sizeof(fork->reu_dirty));
+    fork->num_forks = 0;
+    fork->fork_base = &sys->num_forks;
+    sys->num_forks += 1;
+    _c64_init_memory_map(fork);
+    _c64_damage_all(fork);
+    if (sys->c1541.valid) {
+        fork->c1541 = sys->c1541;
+        fork->iec_port = sys->iec_out | sys->c1541.iec_out;
+        c1541_relocate(&fork->c1541, &fork->iec_port);
+    }
+    else {
+        fork->c1541.valid = false;
+    }
+}
+
 void c64_basic_run(c64_t* sys) {
     CHIPS_ASSERT(sys);
     // write RUN into the keyboard buffer
     uint16_t keybuf = 0x277;
-    mem_wr(&sys->mem_cpu, keybuf++, 'R');
-    mem_wr(&sys->mem_cpu, keybuf++, 'U');
-    mem_wr(&sys->mem_cpu, keybuf++, 'N');
-    mem_wr(&sys->mem_cpu, keybuf++, 0x0D);
+    c64_mem_write(sys, keybuf++, 'R');
+    c64_mem_write(sys, keybuf++, 'U');
+    c64_mem_write(sys, keybuf++, 'N');
+    c64_mem_write(sys, keybuf++, 0x0D);
     // write number of characters, this kicks off evaluation
-    mem_wr(&sys->mem_cpu, 0xC6, 4);
+    c64_mem_write(sys, 0xC6, 4);
 }
 
 void c64_basic_load(c64_t* sys) {
     CHIPS_ASSERT(sys);
     // write LOAD
     uint16_t keybuf = 0x277;
-    mem_wr(&sys->mem_cpu, keybuf++, 'L');
-    mem_wr(&sys->mem_cpu, keybuf++, 'O');
-    mem_wr(&sys->mem_cpu, keybuf++, 'A');
-    mem_wr(&sys->mem_cpu, keybuf++, 'D');
-    mem_wr(&sys->mem_cpu, keybuf++, 0x0D);
+    c64_mem_write(sys, keybuf++, 'L');
+    c64_mem_write(sys, keybuf++, 'O');
+    c64_mem_write(sys, keybuf++, 'A');
+    c64_mem_write(sys, keybuf++, 'D');
+    c64_mem_write(sys, keybuf++, 0x0D);
     // write number of characters, this kicks off evaluation
-    mem_wr(&sys->mem_cpu, 0xC6, 5);
+    c64_mem_write(sys, 0xC6, 5);
 }
 
 void c64_basic_syscall(c64_t* sys, uint16_t addr) {
     CHIPS_ASSERT(sys);
     // write SYS xxxx[Return] into the keyboard buffer (up to 10 chars)
     uint16_t keybuf = 0x277;
-    mem_wr(&sys->mem_cpu, keybuf++, 'S');
-    mem_wr(&sys->mem_cpu, keybuf++, 'Y');
-    mem_wr(&sys->mem_cpu, keybuf++, 'S');
-    mem_wr(&sys->mem_cpu, keybuf++, ((addr / 10000) % 10) + '0');
-    mem_wr(&sys->mem_cpu, keybuf++, ((addr / 1000) % 10) + '0');
-    mem_wr(&sys->mem_cpu, keybuf++, ((addr / 100) % 10) + '0');
-    mem_wr(&sys->mem_cpu, keybuf++, ((addr / 10) % 10) + '0');
-    mem_wr(&sys->mem_cpu, keybuf++, ((addr / 1) % 10) + '0');
-    mem_wr(&sys->mem_cpu, keybuf++, 0x0D);
+    c64_mem_write(sys, keybuf++, 'S');
+    c64_mem_write(sys, keybuf++, 'Y');
+    c64_mem_write(sys, keybuf++, 'S');
+    c64_mem_write(sys, keybuf++, ((addr / 10000) % 10) + '0');
+    c64_mem_write(sys, keybuf++, ((addr / 1000) % 10) + '0');
+    c64_mem_write(sys, keybuf++, ((addr / 100) % 10) + '0');
+    c64_mem_write(sys, keybuf++, ((addr / 10) % 10) + '0');
+    c64_mem_write(sys, keybuf++, ((addr / 1) % 10) + '0');
+    c64_mem_write(sys, keybuf++, 0x0D);
     // write number of characters, this kicks off evaluation
-    mem_wr(&sys->mem_cpu, 0xC6, 9);
+    c64_mem_write(sys, 0xC6, 9);
 }
 
 uint16_t c64_syscall_return_addr(void) {
@@ -0,0 +1,603 @@
+/* control.c
+ * Drive the emulator from scripts and test drivers.
+ *
+ * With --control <path> the emulator accepts clients on a Unix domain
+ * socket, speaking a small text protocol modeled after the Redis one:
+ * every request is a line with a command and its space separated
+ * arguments, every reply uses the RESP format:
+ *
+ *   +OK                status reply
+ *   -ERR <message>     error reply
+ *   :<number>          integer reply
+ *   $<len>\r\n<data>   bulk reply, followed by \r\n
+ *
+ * Clients can send many requests at once without waiting for the replies
+ * (pipelining): all the requests found in the input buffer are executed
+ * in a row and their replies are written back with a single write, so
+ * thousands of peek/poke checks only cost one round trip.
+ *
+ * Numbers are decimal, or hexadecimal with a $ or 0x prefix. Commands:
+ *
+ *   PING                       +PONG
+ *   RUN <cycles>               run N cycles, replies with the cycles run
+ *   UNTIL <pc> [<max cycles>]  run until the CPU fetches an opcode at pc
+ *   PEEK <addr> [<len>]        read memory as seen by the CPU, hex encoded
+ *   POKE <addr> <hex bytes>    write memory as the CPU would
+ *   KEY <key>                  press and release a key (char or name)
+ *   TYPE <text>                put text in the KERNAL keyboard buffer
+ *   TYPELN <text>              like TYPE, followed by RETURN
+ *   LOAD <path>                load a PRG file, replies with its address
+ *   SNAPSHOT SAVE|LOAD <slot>  save or restore the machine state
+ *   ACCURACY [<tier>]          get or set the accuracy: CYCLE, LINE, FRAME
+ *   TRAPS [ON|OFF]             ROM traps calls/mismatches, or enable them
+ *   TRACE <path>               save the instruction trace (see --trace)
+ *   HEATMAP SAVE <prefix>      save the memory heatmap (see --heatmap)
+ *   HEATMAP RESET              clear the memory heatmap counters
+ *   SCREEN                     the text screen, 25 lines of 40 chars
+ *   REGS                       CPU registers
+ *   STATS                      VIC-II bus usage in the last frame
+ *   RESET                      reset the machine
+ *   QUIT                       close the connection
+ *
+ * Registers, memory and screen are only meaningful at the boundary of
+ * the emulated time slices: commands are executed between frames, or,
+ * with --headless, the machine only runs when asked to. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "c64-kitty.h"
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_MAX_ARGS 16
+#define CONTROL_MAX_QUERY (1024*1024)   // Max incomplete request bytes.
+#define CONTROL_MAX_REPLY (1024*1024)   // Stop reading above this backlog.
+#define CONTROL_MAX_PEEK 65536
+#define CONTROL_SNAPSHOT_SLOTS 16
+
+typedef struct {
+    int fd;
+    obuf query;         // Requests read but not yet executed.
+    obuf reply;         // Replies not yet written.
+    size_t reply_pos;   // Already written part of 'reply'.
+    int close_asap;     // Close after writing the pending replies.
+    int eof;            // The client is done sending requests.
+} control_client;
+
+static int ControlFd = -1;
+static char *ControlPath = NULL;
+static control_client Clients[CONTROL_MAX_CLIENTS];
+static int NumClients = 0;
+static c64_t *Snapshots[CONTROL_SNAPSHOT_SLOTS];
+static uint32_t SnapshotVersion[CONTROL_SNAPSHOT_SLOTS];
+
+/* ================================ Helpers ================================= */
+
+static void reply_bulk(obuf *r, const char *p, size_t len) {
+    obuf_printf(r, "$%zu\r\n", len);
+    obuf_append(r, p, len);
+    obuf_append(r, "\r\n", 2);
+}
+
+/* Parse a number, decimal or hex with a "$" or "0x" prefix. Returns 0 on
+ * success, -1 if the string is not a valid number. */
+static int parse_number(const char *s, long *val) {
+    int base = 10;
+    char *end;
+
+    if (s[0] == '$') {
+        s++;
+        base = 16;
+    } else if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+        base = 16;
+    }
+    if (*s == '\0') return -1;
+    errno = 0;
+    *val = strtol(s, &end, base);
+    if (errno || *end != '\0') return -1;
+    return 0;
+}
+
+/* Memory as seen by the CPU, plus the color RAM when the IO area is
+ * mapped. The other IO registers can't be accessed outside of a bus
+ * cycle, so the RAM under them is returned instead. */
+static uint8_t control_peek(c64_t *c64, uint16_t addr) {
+    if (c64->io_mapped && addr >= 0xD800 && addr < 0xDC00)
+        return c64->color_ram[addr & 0x3FF] | 0xF0;
+    return mem_rd(&c64->mem_cpu, addr);
+}
+
+/* Map a key name, or a single character, to a C64 key code. Returns
+ * -1 for unknown keys. */
+static int control_key_code(const char *name) {
+    static const struct { const char *name; int code; } keys[] = {
+        {"RETURN", C64_KEY_RETURN}, {"SPACE", C64_KEY_SPACE},
+        {"DEL", C64_KEY_DEL}, {"INST", C64_KEY_INST},
+        {"HOME", C64_KEY_HOME}, {"CLR", C64_KEY_CLR},
+        {"STOP", C64_KEY_STOP}, {"RUN", C64_KEY_RUN},
+        {"RESTORE", C64_KEY_RESTORE}, {"CBM", C64_KEY_CBM},
+        {"CTRL", C64_KEY_CTRL}, {"UP", C64_KEY_CSRUP},
+        {"DOWN", C64_KEY_CSRDOWN}, {"LEFT", C64_KEY_CSRLEFT},
+        {"RIGHT", C64_KEY_CSRRIGHT}, {"F1", C64_KEY_F1},
+        {"F2", C64_KEY_F2}, {"F3", C64_KEY_F3}, {"F4", C64_KEY_F4},
+        {"F5", C64_KEY_F5}, {"F6", C64_KEY_F6}, {"F7", C64_KEY_F7},
+        {"F8", C64_KEY_F8}, {"ARROW", C64_KEY_LEFT},
+    };
+
+    if (name[0] && name[1] == '\0') {
+        int c = (unsigned char)name[0];
+        if (islower(c)) c = toupper(c);
+        else if (isupper(c)) c = tolower(c);
+        return c;
+    }
+    for (size_t j = 0; j < sizeof(keys)/sizeof(keys[0]); j++)
+        if (!strcasecmp(name, keys[j].name)) return keys[j].code;
+    return -1;
+}
+
+/* Turn a screen code into the closest ASCII character. */
+static char screen_code_to_ascii(uint8_t c) {
+    c &= 0x7F;  // Reverse characters look the same in text.
+    if (c < 32) return c+64;    // @, letters, [ £ ] ↑ ←
+    if (c < 64) return c;       // Space, digits, punctuation.
+    return '.';                 // Graphic characters.
+}
+
+/* Put text into the KERNAL keyboard buffer, like c64_basic_run() does.
+ * Returns the number of characters queued (the buffer holds 10). */
+static int control_type(c64_t *c64, const char *text, int newline) {
+    int len = mem_rd(&c64->mem_cpu, 0xC6);
+    for (; *text && len < 10; text++) {
+        int c = (unsigned char)*text;
+        if (islower(c)) c = toupper(c);
+        c64_mem_write(c64, 0x277+len++, c);
+    }
+    if (newline && len < 10) c64_mem_write(c64, 0x277+len++, 0x0D);
+    c64_mem_write(c64, 0xC6, len);
+    return len;
+}
+
+/* Load a PRG file, returning its load address, or -1 on error. */
+static long control_load(c64_t *c64, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return -1;
+
+    static uint8_t buf[65536+2];
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    if (len < 2) return -1;
+    if (!c64_quickload(c64, (chips_range_t){ .ptr = buf, .size = len }))
+        return -1;
+    return buf[0] | (buf[1] << 8);
+}
+
+/* Debug callback used by UNTIL: stop when an opcode is fetched at pc. */
+typedef struct {
+    uint16_t pc;
+    bool stopped;
+} control_until_t;
+
+static void control_until_cb(void *user_data, uint64_t pins) {
+    control_until_t *u = user_data;
+    if ((pins & M6502_SYNC) && M6502_GET_ADDR(pins) == u->pc) u->stopped = true;
+}
+
+/* ============================ Command execution =========================== */
+
+static void control_exec(control_client *c, c64_t *c64, int argc, char **argv) {
+    obuf *r = &c->reply;
+    const char *cmd = argv[0];
+    long n, m;
+
+    if (!strcasecmp(cmd,"PING") && argc == 1) {
+        obuf_printf(r, "+PONG\r\n");
+    } else if (!strcasecmp(cmd,"RUN") && argc == 2) {
+        if (parse_number(argv[1], &n) == -1 || n < 0 || n > UINT32_MAX)
+            goto badnum;
+        obuf_printf(r, ":%u\r\n", c64_exec_ticks(c64, n));
+    } else if (!strcasecmp(cmd,"UNTIL") && (argc == 2 || argc == 3)) {
+        if (parse_number(argv[1], &n) == -1 || n < 0 || n > 0xFFFF)
+            goto badnum;
+        m = C64_FREQUENCY * 10; // Default: give up after 10 seconds.
+        if (argc == 3 && (parse_number(argv[2], &m) == -1 || m < 0 ||
+                          m > UINT32_MAX)) goto badnum;
+
+        control_until_t u = { .pc = n, .stopped = false };
+        chips_debug_t saved = c64->debug;
+        c64->debug.callback.func = control_until_cb;
+        c64->debug.callback.user_data = &u;
+        c64->debug.stopped = &u.stopped;
+        uint32_t ticks = c64_exec_ticks(c64, m);
+        c64->debug = saved;
+        if (u.stopped) {
+            obuf_printf(r, ":%u\r\n", ticks);
+        } else {
+            obuf_printf(r, "-ERR PC not reached in %u cycles\r\n", ticks);
+        }
+    } else if (!strcasecmp(cmd,"PEEK") && (argc == 2 || argc == 3)) {
+        m = 1;
+        if (parse_number(argv[1], &n) == -1 || n < 0 || n > 0xFFFF ||
+            (argc == 3 && parse_number(argv[2], &m) == -1) ||
+            m < 0 || m > CONTROL_MAX_PEEK) goto badnum;
+
+        static char hex[CONTROL_MAX_PEEK*2];
+        for (long j = 0; j < m; j++) {
+            uint8_t val = control_peek(c64, (n+j) & 0xFFFF);
+            hex[j*2] = "0123456789abcdef"[val>>4];
+            hex[j*2+1] = "0123456789abcdef"[val&15];
+        }
+        reply_bulk(r, hex, m*2);
+    } else if (!strcasecmp(cmd,"POKE") && argc == 3) {
+        size_t len = strlen(argv[2]);
+        if (parse_number(argv[1], &n) == -1 || n < 0 || n > 0xFFFF ||
+            len % 2) goto badnum;
+        for (size_t j = 0; j < len; j += 2) {
+            char byte[3] = {argv[2][j], argv[2][j+1], 0};
+            if (!isxdigit((unsigned char)byte[0]) ||
+                !isxdigit((unsigned char)byte[1])) goto badnum;
+            c64_mem_write(c64, (n+j/2) & 0xFFFF, strtol(byte, NULL, 16));
+        }
+        obuf_printf(r, ":%zu\r\n", len/2);
+    } else if (!strcasecmp(cmd,"KEY") && argc == 2) {
+        int key = control_key_code(argv[1]);
+        if (key == -1) {
+            obuf_printf(r, "-ERR unknown key\r\n");
+            return;
+        }
+        c64_key_down(c64, key);
+        c64_key_up(c64, key);
+        obuf_printf(r, "+OK\r\n");
+    } else if ((!strcasecmp(cmd,"TYPE") || !strcasecmp(cmd,"TYPELN")) &&
+               argc == 2)
+    {
+        // The text is the rest of the line, spaces included, see
+        // control_process_query().
+        obuf_printf(r, ":%d\r\n", control_type(c64, argv[1],
+                                               !strcasecmp(cmd,"TYPELN")));
+    } else if (!strcasecmp(cmd,"LOAD") && argc == 2) {
+        long addr = control_load(c64, argv[1]);
+        if (addr == -1) {
+            obuf_printf(r, "-ERR can't load %s\r\n", argv[1]);
+        } else {
+            obuf_printf(r, ":%ld\r\n", addr);
+        }
+    } else if (!strcasecmp(cmd,"SNAPSHOT") && argc == 3) {
+        if (parse_number(argv[2], &n) == -1 || n < 0 ||
+            n >= CONTROL_SNAPSHOT_SLOTS) goto badnum;
+        if (!strcasecmp(argv[1],"SAVE")) {
+            if (Snapshots[n] == NULL) Snapshots[n] = aligned_alloc(64, sizeof(c64_t));
+            if (Snapshots[n] == NULL) {
+                obuf_printf(r, "-ERR out of memory\r\n");
+                return;
+            }
+            SnapshotVersion[n] = c64_save_snapshot(c64, Snapshots[n]);
+            obuf_printf(r, "+OK\r\n");
+        } else if (!strcasecmp(argv[1],"LOAD")) {
+            if (Snapshots[n] == NULL ||
+                !c64_load_snapshot(c64, SnapshotVersion[n], Snapshots[n]))
+            {
+                obuf_printf(r, "-ERR no snapshot in slot %ld\r\n", n);
+                return;
+            }
+            obuf_printf(r, "+OK\r\n");
+        } else {
+            obuf_printf(r, "-ERR SNAPSHOT wants SAVE or LOAD\r\n");
+        }
+    } else if (!strcasecmp(cmd,"ACCURACY") && (argc == 1 || argc == 2)) {
+        static const char *names[] = {"CYCLE", "LINE", "FRAME"};
+        if (argc == 1) {
+            const char *name = names[c64_accuracy(c64)];
+            reply_bulk(r, name, strlen(name));
+            return;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (!strcasecmp(argv[1],names[j])) {
+                if (c64->video_sync.enabled && j == C64_ACCURACY_CYCLE) {
+                    obuf_printf(r, "-ERR CYCLE can't be used with the "
+                                   "video thread\r\n");
+                    return;
+                }
+                // Takes effect at the start of the next frame.
+                c64_set_accuracy(c64, (c64_accuracy_t)j);
+                obuf_printf(r, "+OK\r\n");
+                return;
+            }
+        }
+        obuf_printf(r, "-ERR ACCURACY wants CYCLE, LINE or FRAME\r\n");
+    } else if (!strcasecmp(cmd,"TRAPS") && (argc == 1 || argc == 2)) {
+        static const char *names[C64_NUM_TRAPS] =
+            {"bltu", "mltply", "fdivt", "movlin", "clrlin"};
+        if (argc == 2) {
+            if (!strcasecmp(argv[1],"ON")) {
+                c64_set_traps(c64, C64_TRAPS_ALL);
+            } else if (!strcasecmp(argv[1],"OFF")) {
+                c64_set_traps(c64, 0);
+            } else {
+                obuf_printf(r, "-ERR TRAPS wants ON or OFF\r\n");
+                return;
+            }
+            obuf_printf(r, "+OK\r\n");
+            return;
+        }
+        char text[256];
+        int len = 0;
+        c64_trap_stats_t s = c64_trap_stats(c64);
+        for (int j = 0; j < C64_NUM_TRAPS; j++) {
+            len += snprintf(text+len, sizeof(text)-len, "%s%s=%llu/%llu",
+                j ? " " : "", names[j], (unsigned long long)s.calls[j],
+                (unsigned long long)s.mismatches[j]);
+        }
+        reply_bulk(r, text, len);
+    } else if (!strcasecmp(cmd,"TRACE") && argc == 2) {
+        if (c64->trace.ring == NULL) {
+            obuf_printf(r, "-ERR instruction trace not enabled\r\n");
+        } else if (trace_save(c64, argv[1]) == -1) {
+            obuf_printf(r, "-ERR can't save %s: %s\r\n", argv[1],
+                strerror(errno));
+        } else {
+            obuf_printf(r, "+OK\r\n");
+        }
+    } else if (!strcasecmp(cmd,"HEATMAP") && argc >= 2) {
+        if (c64->heatmap == NULL) {
+            obuf_printf(r, "-ERR memory heatmap not enabled\r\n");
+        } else if (!strcasecmp(argv[1],"RESET") && argc == 2) {
+            heatmap_reset(c64);
+            obuf_printf(r, "+OK\r\n");
+        } else if (!strcasecmp(argv[1],"SAVE") && argc == 3) {
+            if (heatmap_save(c64, argv[2]) == -1) {
+                obuf_printf(r, "-ERR can't save %s: %s\r\n", argv[2],
+                    strerror(errno));
+            } else {
+                obuf_printf(r, "+OK\r\n");
+            }
+        } else {
+            obuf_printf(r, "-ERR HEATMAP wants SAVE <prefix> or RESET\r\n");
+        }
+    } else if (!strcasecmp(cmd,"SCREEN") && argc == 1) {
+        char text[25*41];
+        uint16_t vm = c64->vic_bank_select |
+                      ((c64->vic.reg.mem_ptrs >> 4) << 10);
+        for (int y = 0; y < 25; y++) {
+            for (int x = 0; x < 40; x++) {
+                uint8_t code = mem_rd(&c64->mem_vic, (vm+y*40+x) & 0xFFFF);
+                text[y*41+x] = screen_code_to_ascii(code);
+            }
+            text[y*41+40] = '\n';
+        }
+        reply_bulk(r, text, sizeof(text));
+    } else if (!strcasecmp(cmd,"REGS") && argc == 1) {
+        char regs[64];
+        int len = snprintf(regs, sizeof(regs),
+            "PC=%04x A=%02x X=%02x Y=%02x S=%02x P=%02x",
+            c64->cpu.PC, c64->cpu.A, c64->cpu.X, c64->cpu.Y,
+            c64->cpu.S, c64->cpu.P);
+        reply_bulk(r, regs, len);
+    } else if (!strcasecmp(cmd,"STATS") && argc == 1) {
+        char stats[128];
+        m6569_stats_t s = c64_vic_stats(c64);
+        int len = snprintf(stats, sizeof(stats),
+            "badlines=%u sprite_dma=%u ba=%u stalled=%u",
+            s.badlines, s.sprite_dma, s.ba, s.stalled);
+        reply_bulk(r, stats, len);
+    } else if (!strcasecmp(cmd,"RESET") && argc == 1) {
+        c64_reset(c64);
+        obuf_printf(r, "+OK\r\n");
+    } else if (!strcasecmp(cmd,"QUIT") && argc == 1) {
+        obuf_printf(r, "+OK\r\n");
+        c->close_asap = 1;
+    } else {
+        obuf_printf(r, "-ERR unknown command or wrong number of arguments\r\n");
+    }
+    return;
+
+badnum:
+    obuf_printf(r, "-ERR invalid number or range\r\n");
+}
+
+/* Execute all the complete request lines in the client query buffer. */
+static void control_process_query(control_client *c, c64_t *c64) {
+    size_t pos = 0;
+
+    while (!c->close_asap) {
+        char *line = c->query.buf + pos;
+        char *nl = memchr(line, '\n', c->query.len - pos);
+        if (nl == NULL) break;
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+        pos = nl - c->query.buf + 1;
+
+        // Split in place, but the text of TYPE and TYPELN, that is the
+        // rest of the line after the separator following the command.
+        char *argv[CONTROL_MAX_ARGS];
+        int argc = 0;
+        char *end = line + strlen(line);
+        char *p = strtok(line, " \t");
+        if (p && (!strcasecmp(p,"TYPE") || !strcasecmp(p,"TYPELN"))) {
+            char *text = p + strlen(p);
+            argv[argc++] = p;
+            argv[argc++] = text < end ? text+1 : text;
+            p = NULL;
+        }
+        while (p && argc < CONTROL_MAX_ARGS) {
+            argv[argc++] = p;
+            p = strtok(NULL, " \t");
+        }
+        if (argc) control_exec(c, c64, argc, argv);
+    }
+
+    // Keep the incomplete line, if any, for the next read.
+    memmove(c->query.buf, c->query.buf + pos, c->query.len - pos);
+    c->query.len -= pos;
+}
+
+/* ================================ Networking ============================== */
+
+/* Start accepting control clients at the specified Unix socket path.
+ * Returns 0 on success, -1 on error (and errno is set). */
+int control_listen(const char *path) {
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+        listen(fd, 16) == -1 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    ControlFd = fd;
+    ControlPath = strdup(path);
+    return 0;
+}
+
+static void control_free_client(int j) {
+    close(Clients[j].fd);
+    obuf_free(&Clients[j].query);
+    obuf_free(&Clients[j].reply);
+    Clients[j] = Clients[--NumClients];
+}
+
+/* Write pending replies. Returns -1 if the client went away. */
+static int control_flush(control_client *c) {
+    while (c->reply_pos < c->reply.len) {
+        ssize_t n = write(c->fd, c->reply.buf + c->reply_pos,
+                          c->reply.len - c->reply_pos);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->reply_pos += n;
+    }
+    // Drop what was written, so that the buffer only holds the unsent
+    // replies of a slow reader.
+    memmove(c->reply.buf, c->reply.buf + c->reply_pos,
+            c->reply.len - c->reply_pos);
+    c->reply.len -= c->reply_pos;
+    c->reply_pos = 0;
+    return 0;
+}
+
+/* Accept clients and execute their requests. With timeout_ms set to -1
+ * waits for the next request (this is how --headless sessions run),
+ * otherwise returns after timeout_ms milliseconds at most (use 0 from
+ * the frames loop). */
+void control_poll(void *c64, int timeout_ms) {
+    if (ControlFd == -1) return;
+
+    struct pollfd pfd[CONTROL_MAX_CLIENTS+1];
+    pfd[0].fd = ControlFd;
+    pfd[0].events = POLLIN;
+    for (int j = 0; j < NumClients; j++) {
+        pfd[j+1].fd = Clients[j].fd;
+        pfd[j+1].events = 0;
+        if (!Clients[j].eof && Clients[j].reply.len <= CONTROL_MAX_REPLY)
+            pfd[j+1].events |= POLLIN;
+        if (Clients[j].reply.len) pfd[j+1].events |= POLLOUT;
+    }
+    if (poll(pfd, NumClients+1, timeout_ms) <= 0) return;
+
+    // Accept new clients.
+    while (1) {
+        int fd = accept(ControlFd, NULL, NULL);
+        if (fd == -1) break;
+        if (NumClients == CONTROL_MAX_CLIENTS ||
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+        {
+            close(fd);
+            continue;
+        }
+        memset(Clients+NumClients, 0, sizeof(control_client));
+        Clients[NumClients++].fd = fd;
+    }
+
+    // Read and execute requests, then write all the replies at once.
+    for (int j = 0; j < NumClients; j++) {
+        control_client *c = Clients+j;
+        int gone = 0;
+        char buf[16384];
+
+        // Execute the complete lines after each read, so that a long
+        // batch is not limited by CONTROL_MAX_QUERY, only a single line
+        // is. Stop reading while the client doesn't read its replies.
+        while (!gone && !c->eof && c->reply.len <= CONTROL_MAX_REPLY) {
+            ssize_t n = read(c->fd, buf, sizeof(buf));
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) {
+                gone = 1;
+                break;
+            }
+            if (n == 0) {
+                // Half closed (or closed): still execute what was sent,
+                // including a last line without newline, and write the
+                // replies before closing.
+                c->eof = 1;
+                if (c->query.len) obuf_append(&c->query, "\n", 1);
+            } else {
+                obuf_append(&c->query, buf, n);
+            }
+            control_process_query(c, c64);
+            if (c->query.len > CONTROL_MAX_QUERY) gone = 1;
+        }
+        if (!gone) {
+            gone = control_flush(c) == -1 ||
+                   ((c->close_asap || c->eof) && c->reply.len == 0);
+        }
+        if (gone) control_free_client(j--);
+    }
+}
+
+void control_cleanup(void) {
+    while (NumClients) control_free_client(0);
+    for (int j = 0; j < CONTROL_SNAPSHOT_SLOTS; j++) {
+        free(Snapshots[j]);
+        Snapshots[j] = NULL;
+    }
+    if (ControlFd != -1) {
+        close(ControlFd);
+        unlink(ControlPath);
+        free(ControlPath);
+        ControlFd = -1;
+    }
+}
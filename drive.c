@@ -0,0 +1,75 @@
+/* drive.c
+ * Run the emulated 1541 floppy drive on its own thread, so that a busy
+ * drive does not slow down the C64 emulation. The two machines are kept
+ * in sync by c64.h itself (see the "Running the Floppy Drive on its own
+ * Thread" section there), this file just provides the thread. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "c64-kitty.h"
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+
+/* When the C64 stops for a while, for instance between two frames, the
+ * drive thread soon runs out of work: after that many empty steps it
+ * starts sleeping DRIVE_NAP_USEC between steps instead of yielding the
+ * CPU. The yielding phase is long enough to cover the short waits of a
+ * C64 that is running, so that reads of the serial bus are not delayed
+ * by the naps. */
+#define DRIVE_YIELD_STEPS 20000
+#define DRIVE_NAP_USEC 200
+
+static pthread_t DriveThread;
+static volatile int DriveStop = 0;
+static int DriveRunning = 0;
+
+static void *drive_thread_main(void *arg) {
+    c64_t *c64 = arg;
+    int idle = 0;
+
+    while (!__atomic_load_n(&DriveStop, __ATOMIC_RELAXED)) {
+        if (c64_drive_step(c64)) {
+            idle = 0;
+        } else if (idle < DRIVE_YIELD_STEPS) {
+            idle++;
+            sched_yield();
+        } else {
+            usleep(DRIVE_NAP_USEC);
+        }
+    }
+    return NULL;
+}
+
+/* Start ticking the drive of 'c64', initialized with c1541_threaded set.
+ * Returns 0 on success, -1 if the thread can't be created. */
+int drive_thread_start(void *c64) {
+    DriveStop = 0;
+    if (pthread_create(&DriveThread, NULL, drive_thread_main, c64) != 0)
+        return -1;
+    DriveRunning = 1;
+    return 0;
+}
+
+/* Stop the drive thread: from now on the C64 can't be ticked anymore. */
+void drive_thread_stop(void) {
+    if (!DriveRunning) return;
+    __atomic_store_n(&DriveStop, 1, __ATOMIC_RELAXED);
+    pthread_join(DriveThread, NULL);
+    DriveRunning = 0;
+}
@@ -0,0 +1,122 @@
+/* heatmap.c
+ * Save the memory access counters collected by c64.h (compiled with
+ * C64_HEATMAP, see "Memory Heatmap" there) as a 256x256 image, one pixel
+ * per byte of the 64k address space, and as a CSV file.
+ *
+ * In the image each row is a 256 byte page, from 0x0000 at the top to
+ * 0xFF00 at the bottom. Writes are red, executed opcodes green, and reads
+ * (of the CPU and of the VIC-II) blue, with a logarithmic scale so that
+ * the data touched once per frame still shows next to a busy loop. If
+ * only the per page counters are collected, all the pixels of a row have
+ * the color of the page. The PPM format is used, since any image viewer
+ * or converter can read it and it takes a few lines to write. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "c64-kitty.h"
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+
+#define HEATMAP_RED 0
+#define HEATMAP_GREEN 1
+#define HEATMAP_BLUE 2
+
+/* Return the counters of 'addr' for the three colors of the image. */
+static void heatmap_rgb(const c64_heatmap_t *h, int addr, uint64_t rgb[3]) {
+    const uint64_t *c = h->byte ? h->byte[addr] : h->page[addr >> 8];
+    rgb[HEATMAP_RED] = c[C64_HEAT_WRITE];
+    rgb[HEATMAP_GREEN] = c[C64_HEAT_EXEC];
+    rgb[HEATMAP_BLUE] = c[C64_HEAT_READ] + c[C64_HEAT_VIC];
+}
+
+/* Write the image into 'filename'. Returns 0 on success, -1 on error. */
+static int heatmap_save_ppm(const c64_heatmap_t *h, const char *filename) {
+    static uint8_t img[256*256*3];
+    uint64_t max[3] = {0, 0, 0};
+    uint64_t rgb[3];
+
+    for (int addr = 0; addr < 0x10000; addr++) {
+        heatmap_rgb(h, addr, rgb);
+        for (int j = 0; j < 3; j++)
+            if (rgb[j] > max[j]) max[j] = rgb[j];
+    }
+    for (int addr = 0; addr < 0x10000; addr++) {
+        heatmap_rgb(h, addr, rgb);
+        for (int j = 0; j < 3; j++) {
+            img[addr*3+j] = max[j] ?
+                (uint8_t)(255 * log1p(rgb[j]) / log1p(max[j])) : 0;
+        }
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) return -1;
+    fprintf(fp, "P6\n256 256\n255\n");
+    fwrite(img, 1, sizeof(img), fp);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Write the counters into 'filename', a row for each page, followed by a
+ * row for each byte accessed at least once if the per byte counters are
+ * collected. Returns 0 on success, -1 on error. */
+static int heatmap_save_csv(const c64_heatmap_t *h, const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) return -1;
+    fprintf(fp, "address,size,read,write,exec,vic\n");
+    for (int page = 0; page < 256; page++) {
+        const uint64_t *c = h->page[page];
+        fprintf(fp, "0x%04X,256,%llu,%llu,%llu,%llu\n", page << 8,
+            (unsigned long long)c[C64_HEAT_READ],
+            (unsigned long long)c[C64_HEAT_WRITE],
+            (unsigned long long)c[C64_HEAT_EXEC],
+            (unsigned long long)c[C64_HEAT_VIC]);
+    }
+    for (int addr = 0; h->byte && addr < 0x10000; addr++) {
+        const uint64_t *c = h->byte[addr];
+        if ((c[C64_HEAT_READ] | c[C64_HEAT_WRITE] |
+             c[C64_HEAT_EXEC] | c[C64_HEAT_VIC]) == 0) continue;
+        fprintf(fp, "0x%04X,1,%llu,%llu,%llu,%llu\n", addr,
+            (unsigned long long)c[C64_HEAT_READ],
+            (unsigned long long)c[C64_HEAT_WRITE],
+            (unsigned long long)c[C64_HEAT_EXEC],
+            (unsigned long long)c[C64_HEAT_VIC]);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Save the memory access counters of 'c64' into '<prefix>.ppm' and
+ * '<prefix>.csv'. Returns 0 on success, -1 on error (and errno is set),
+ * or if the machine was not initialized with a heatmap. */
+int heatmap_save(void *c64, const char *prefix) {
+    c64_t *sys = c64;
+    if (sys->heatmap == NULL) return -1;
+
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s.ppm", prefix);
+    if (heatmap_save_ppm(sys->heatmap, filename) == -1) return -1;
+    snprintf(filename, sizeof(filename), "%s.csv", prefix);
+    return heatmap_save_csv(sys->heatmap, filename);
+}
+
+/* Clear the memory access counters of 'c64', if any. */
+void heatmap_reset(void *c64) {
+    c64_t *sys = c64;
+    c64_heatmap_t *h = sys->heatmap;
+    if (h == NULL) return;
+    memset(h->page, 0, sizeof(h->page));
+    if (h->byte) memset(h->byte, 0, 0x10000 * sizeof(h->byte[0]));
+}
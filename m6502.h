@@ -390,6 +390,27 @@ uint16_t m6502_pc(m6502_t* cpu);
 /* M6510: check for IO port access to address 0 or 1 */
 #define M6510_CHECK_IO(p) (((p)&0xFFFEULL)==0)
 
+/* the tick of a read cycle with M6502_RDY active: the CPU doesn't move,
+   only the interrupt inputs are latched. m6502_tick() does the same, this
+   is inline for system tick loops that already tested RDY (the VIC-II
+   keeps it active for up to 43 ticks in a row) */
+static inline uint64_t m6502_stall(m6502_t* c, uint64_t pins) {
+    // interrupt detection also works in RDY phases, but only NMI is "sticky"
+
+    // NMI is edge-triggered
+    if (0 != ((pins & (pins ^ c->PINS)) & M6502_NMI)) {
+        c->nmi_pip |= 0x100;
+    }
+    // IRQ test is level triggered
+    if ((pins & M6502_IRQ) && (0 == (c->P & M6502_IF))) {
+        c->irq_pip |= 0x100;
+    }
+    M6510_SET_PORT(pins, c->io_pins);
+    c->PINS = pins;
+    c->irq_pip <<= 1;
+    return pins;
+}
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -707,7 +728,10 @@ void m6502_snapshot_onload(m6502_t* snapshot, m6502_t* sys) {
 
 uint64_t m6502_tick(m6502_t* c, uint64_t pins) {
     if (pins & (M6502_SYNC|M6502_IRQ|M6502_NMI|M6502_RDY|M6502_RES)) {
-        // interrupt detection also works in RDY phases, but only NMI is "sticky"
+        // RDY pin is only checked during read cycles
+        if ((pins & (M6502_RW|M6502_RDY)) == (M6502_RW|M6502_RDY)) {
+            return m6502_stall(c, pins);
+        }
 
         // NMI is edge-triggered
         if (0 != ((pins & (pins ^ c->PINS)) & M6502_NMI)) {
@@ -717,14 +741,6 @@ uint64_t m6502_tick(m6502_t* c, uint64_t pins) {
         if ((pins & M6502_IRQ) && (0 == (c->P & M6502_IF))) {
             c->irq_pip |= 0x100;
         }
-
-        // RDY pin is only checked during read cycles
-        if ((pins & (M6502_RW|M6502_RDY)) == (M6502_RW|M6502_RDY)) {
-            M6510_SET_PORT(pins, c->io_pins);
-            c->PINS = pins;
-            c->irq_pip <<= 1;
-            return pins;
-        }
         if (pins & M6502_SYNC) {
             // load new instruction into 'instruction register' and restart tick counter
             c->IR = _GD()<<3;
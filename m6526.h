@@ -40,14 +40,50 @@
     ## NOT IMPLEMENTED:
 
     - PC pin
-    - time of day clock
-    - serial port
+    - serial port input mode (only output mode is emulated)
     - no external counter trigger via CNT pin
 
+    ## Time Of Day Clock
+
+    The TOD clock counts pulses on the TOD pin, the system is expected to
+    set the pin for one tick at the power line frequency (50 or 60 Hz,
+    selected by CRA bit 7). The pin is only looked at when it changes,
+    so the clock costs nothing in the ticks in between.
+
+    Like on the real chip, reading the hours register latches the time
+    until the 10ths register is read, and writing the hours register stops
+    the clock until the 10ths register is written. With CRB bit 7 set,
+    writes go to the alarm instead, which sets ICR bit 2 when matched.
+    After reset the clock is stopped at 1:00:00.0 AM.
+
+    ## Serial Port
+
+    In output mode (CRA bit 6) a byte written to the SDR is shifted out,
+    MSB first, on the SP pin, with the CNT pin toggling on each timer A
+    underflow. After 16 underflows (8 bits) ICR bit 3 is set, and a byte
+    written to the SDR in the meantime is shifted out next. Everything
+    happens on timer A underflows, which is when the chip is ticked
+    precisely anyway (see below).
+
     ## LINKS:
     - https://ist.uwaterloo.ca/~schepers/MJK/cia6526.html
     - https://ist.uwaterloo.ca/~schepers/MJK/cia6526.html
 
+    ## Idle Fast Path
+
+    Most of the time both timers are either stopped or counting down far
+    away from an underflow, and nothing is going on in the delay pipelines.
+    When m6526_tick() finds the chip in such a steady state it computes
+    how many cycles are left until the next timer underflow, and skips the
+    timer and pipeline emulation for those cycles: the timer counters are
+    advanced in bulk (by the 'lag' cycles accumulated so far) as soon as
+    the chip needs to be ticked precisely again, that is, on an underflow,
+    on register access (CS active) or when the FLAG or TOD pins change.
+    The port and IRQ pins are still updated in every cycle.
+
+    Note that because of this, while 'idle' is not zero the timer counters
+    lag behind by 'lag' cycles.
+
     TODO: Documentation
 
     ## zlib/libpng license
@@ -228,6 +264,26 @@ typedef struct {
     uint32_t pip;
 } m6526_timer_t;
 
+// time of day clock state
+typedef struct {
+    uint8_t time[4];    // 10ths, seconds, minutes, hours in BCD (bit 7 of hours is PM)
+    uint8_t alarm[4];   // alarm time, same format
+    uint8_t latch[4];   // time latched when reading the hours register
+    uint8_t pulses;     // TOD pin pulses since the last 10th of second
+    bool latched;       // register reads return latch until 10ths are read
+    bool stopped;       // stopped by writing hours until 10ths are written
+    bool pin;           // last state of TOD pin, to detect edge
+} m6526_tod_t;
+
+// serial port state
+typedef struct {
+    uint8_t data;       // serial data register
+    uint8_t shift;      // shift register, bit 7 is on the SP pin
+    uint8_t count;      // timer A underflows left to shift out the current byte
+    bool pending;       // data register written while shifting
+    bool cnt;           // CNT pin output state
+} m6526_sdr_t;
+
 // interrupt state
 typedef struct {
     uint8_t imr;            // interrupt mask
@@ -248,6 +304,10 @@ typedef struct {
     m6526_timer_t ta;
     m6526_timer_t tb;
     m6526_int_t intr;
+    m6526_tod_t tod;
+    m6526_sdr_t sdr;
+    uint32_t idle;      // number of cycles the fast path can still skip
+    uint32_t lag;       // number of cycles counting timers are behind
     uint64_t pins;
 } m6526_t;
 
@@ -301,6 +361,16 @@ static void _m6526_init_timer(m6526_timer_t* t) {
     t->pip = 0;
 }
 
+static void _m6526_init_tod(m6526_tod_t* tod) {
+    memset(tod, 0, sizeof(*tod));
+    tod->time[3] = 0x01;
+    tod->stopped = true;
+}
+
+static void _m6526_init_sdr(m6526_sdr_t* sdr) {
+    memset(sdr, 0, sizeof(*sdr));
+}
+
 static void _m6526_init_interrupt(m6526_int_t* intr) {
     intr->imr = 0;
     intr->imr1 = 0;
@@ -317,6 +387,8 @@ void m6526_init(m6526_t* c) {
     _m6526_init_timer(&c->ta);
     _m6526_init_timer(&c->tb);
     _m6526_init_interrupt(&c->intr);
+    _m6526_init_tod(&c->tod);
+    _m6526_init_sdr(&c->sdr);
     c->ta.latch = 0xFFFF;
     c->tb.latch = 0xFFFF;
 }
@@ -328,6 +400,10 @@ void m6526_reset(m6526_t* c) {
     _m6526_init_timer(&c->ta);
     _m6526_init_timer(&c->tb);
     _m6526_init_interrupt(&c->intr);
+    _m6526_init_tod(&c->tod);
+    _m6526_init_sdr(&c->sdr);
+    c->idle = 0;
+    c->lag = 0;
     c->pins = 0;
 }
 
@@ -385,9 +461,148 @@ static inline uint64_t _m6526_write_port_pins(m6526_t* c, uint64_t pins) {
     c->pa.pins = c->pa.reg | (c->pa.inp & ~c->pa.ddr);
     c->pb.pins = _m6526_merge_pb67(c, c->pb.reg | (c->pb.inp & ~c->pb.ddr));
     M6526_SET_PAB(pins, c->pa.pins, c->pb.pins);
+    /* in serial output mode, the SP and CNT pins are outputs */
+    if (M6526_TA_SPMODE_OUTPUT(c->ta.cr)) {
+        pins &= ~(M6526_SP|M6526_CNT);
+        if (c->sdr.shift & (1<<7)) {
+            pins |= M6526_SP;
+        }
+        if (c->sdr.cnt) {
+            pins |= M6526_CNT;
+        }
+    }
     return pins;
 }
 
+/*--- time of day clock implementation ---*/
+static inline uint8_t _m6526_bcd_inc(uint8_t val) {
+    val++;
+    if ((val & 0x0F) == 0x0A) {
+        val += 6;
+    }
+    return val;
+}
+
+static void _m6526_check_alarm(m6526_t* c) {
+    if (0 == memcmp(c->tod.time, c->tod.alarm, sizeof(c->tod.time))) {
+        c->intr.icr |= (1<<2);
+    }
+}
+
+/* called on each TOD pin pulse */
+static void _m6526_tick_tod(m6526_t* c) {
+    m6526_tod_t* tod = &c->tod;
+    if (tod->stopped) {
+        return;
+    }
+    /* 5 pulses per 10th of second at 50 Hz, 6 at 60 Hz */
+    if (++tod->pulses < (M6526_TA_TODIN_50HZ(c->ta.cr) ? 5 : 6)) {
+        return;
+    }
+    tod->pulses = 0;
+    uint8_t* t = tod->time;
+    t[0] = (t[0] + 1) & 0x0F;
+    if (t[0] == 10) {
+        t[0] = 0;
+        t[1] = _m6526_bcd_inc(t[1]);
+        if (t[1] >= 0x60) {
+            t[1] = 0;
+            t[2] = _m6526_bcd_inc(t[2]);
+            if (t[2] >= 0x60) {
+                t[2] = 0;
+                uint8_t pm = t[3] & 0x80;
+                uint8_t hr = t[3] & 0x1F;
+                if (hr == 0x11) {
+                    hr = 0x12;
+                    pm ^= 0x80;
+                }
+                else if (hr == 0x12) {
+                    hr = 0x01;
+                }
+                else {
+                    hr = _m6526_bcd_inc(hr);
+                }
+                t[3] = pm | hr;
+            }
+        }
+    }
+    _m6526_check_alarm(c);
+}
+
+static uint8_t _m6526_read_tod(m6526_t* c, uint8_t reg) {
+    m6526_tod_t* tod = &c->tod;
+    if (reg == 3) {
+        /* reading hours latches the time until 10ths are read */
+        if (!tod->latched) {
+            memcpy(tod->latch, tod->time, sizeof(tod->latch));
+            tod->latched = true;
+        }
+    }
+    const uint8_t data = tod->latched ? tod->latch[reg] : tod->time[reg];
+    if (reg == 0) {
+        tod->latched = false;
+    }
+    return data;
+}
+
+static void _m6526_write_tod(m6526_t* c, uint8_t reg, uint8_t data) {
+    static const uint8_t masks[4] = { 0x0F, 0x7F, 0x7F, 0x9F };
+    m6526_tod_t* tod = &c->tod;
+    data &= masks[reg];
+    if (M6526_TB_ALARM_ALARM(c->tb.cr)) {
+        tod->alarm[reg] = data;
+    }
+    else {
+        tod->time[reg] = data;
+        /* writing hours stops the clock until 10ths are written */
+        if (reg == 3) {
+            tod->stopped = true;
+        }
+        else if (reg == 0) {
+            tod->stopped = false;
+            tod->pulses = 0;
+        }
+    }
+    _m6526_check_alarm(c);
+}
+
+/*--- serial port implementation ---*/
+
+/* called on each timer A underflow in output mode */
+static void _m6526_tick_sdr(m6526_t* c) {
+    m6526_sdr_t* sdr = &c->sdr;
+    if (sdr->count == 0) {
+        return;
+    }
+    /* shift out the next bit on the falling CNT edge */
+    sdr->cnt = !sdr->cnt;
+    if (!sdr->cnt) {
+        sdr->shift <<= 1;
+    }
+    if (--sdr->count == 0) {
+        c->intr.icr |= (1<<3);
+        if (sdr->pending) {
+            sdr->pending = false;
+            sdr->shift = sdr->data;
+            sdr->count = 16;
+        }
+    }
+}
+
+static void _m6526_write_sdr(m6526_t* c, uint8_t data) {
+    m6526_sdr_t* sdr = &c->sdr;
+    sdr->data = data;
+    if (M6526_TA_SPMODE_OUTPUT(c->ta.cr)) {
+        if (sdr->count == 0) {
+            sdr->shift = data;
+            sdr->count = 16;
+        }
+        else {
+            sdr->pending = true;
+        }
+    }
+}
+
 /*--- interrupt implementation ---*/
 static void _m6526_write_icr(m6526_t* c, uint8_t data) {
     /* from datasheet: When writing to the MASK register, if bit 7 (SET/CLEAR)
@@ -447,7 +662,15 @@ static uint64_t _m6526_update_irq(m6526_t* c, uint64_t pins) {
     }
     c->intr.flag = 0 != (pins & M6526_FLAG);
 
-    /* FIXME: ALARM, SP interrupt conditions */
+    /* serial port shifts out on timer A underflow */
+    if (c->ta.t_out && M6526_TA_SPMODE_OUTPUT(c->ta.cr)) {
+        _m6526_tick_sdr(c);
+    }
+    /* time of day clock input */
+    if ((pins & M6526_TOD) && (!c->tod.pin)) {
+        _m6526_tick_tod(c);
+    }
+    c->tod.pin = 0 != (pins & M6526_TOD);
 
     /* handle main interrupt bit */
     if (_M6526_PIP_TEST(c->intr.pip, M6526_PIP_IRQ, 0)) {
@@ -605,6 +828,15 @@ static uint8_t _m6526_read(m6526_t* c, uint8_t addr) {
         case M6526_REG_TBHI:
             data = c->tb.counter >> 8;
             break;
+        case M6526_REG_TOD10TH:
+        case M6526_REG_TODSEC:
+        case M6526_REG_TODMIN:
+        case M6526_REG_TODHR:
+            data = _m6526_read_tod(c, addr - M6526_REG_TOD10TH);
+            break;
+        case M6526_REG_SDR:
+            data = c->sdr.data;
+            break;
         case M6526_REG_ICR:
             data = _m6526_read_icr(c);
             break;
@@ -654,10 +886,25 @@ static void _m6526_write(m6526_t* c, uint8_t addr, uint8_t data) {
                 _M6526_PIP_SET(c->tb.pip, M6526_PIP_TIMER_LOAD, 1);
             }
             break;
+        case M6526_REG_TOD10TH:
+        case M6526_REG_TODSEC:
+        case M6526_REG_TODMIN:
+        case M6526_REG_TODHR:
+            _m6526_write_tod(c, addr - M6526_REG_TOD10TH, data);
+            break;
+        case M6526_REG_SDR:
+            _m6526_write_sdr(c, data);
+            break;
         case M6526_REG_ICR:
             _m6526_write_icr(c, data);
             break;
         case M6526_REG_CRA:
+            /* switching the serial port direction aborts a transfer */
+            if ((c->ta.cr ^ data) & (1<<6)) {
+                c->sdr.count = 0;
+                c->sdr.pending = false;
+                c->sdr.cnt = false;
+            }
             _m6526_write_cr(&c->ta, data);
             break;
         case M6526_REG_CRB:
@@ -666,7 +913,89 @@ static void _m6526_write(m6526_t* c, uint8_t addr, uint8_t data) {
     }
 }
 
+/*--- idle fast path ---*/
+#define _M6526_PIP_COUNTING (3)     // steady counter pipeline of a counting timer
+
+/* return true if a timer's delay-pipelines stay the same from tick to tick */
+static inline bool _m6526_timer_steady(const m6526_timer_t* t, bool counting) {
+    if (t->t_out || M6526_FORCE_LOAD(t->cr)) {
+        return false;
+    }
+    const uint32_t pip = (counting ? _M6526_PIP_COUNTING : 0) |
+                         (M6526_RUNMODE_ONESHOT(t->cr) ? (1<<M6526_PIP_TIMER_ONESHOT) : 0);
+    return t->pip == pip;
+}
+
+/* number of ticks until a counting timer underflows, minus one */
+static inline uint32_t _m6526_timer_idle(const m6526_timer_t* t) {
+    return (t->pip & _M6526_PIP_COUNTING) ? (t->counter ? t->counter - 1u : 0u) : 0xFFFFFFFFu;
+}
+
+/* compute how many of the next ticks can be skipped, zero if the chip
+   is not in a steady state
+*/
+static uint32_t _m6526_idle_ticks(const m6526_t* c) {
+    const bool ta_counting = M6526_TIMER_STARTED(c->ta.cr) && M6526_TA_INMODE_PHI2(c->ta.cr);
+    const bool tb_counting = M6526_TIMER_STARTED(c->tb.cr) && M6526_TB_INMODE_PHI2(c->tb.cr);
+    if (!_m6526_timer_steady(&c->ta, ta_counting) || !_m6526_timer_steady(&c->tb, tb_counting)) {
+        return 0;
+    }
+    /* the interrupt pipeline must either be empty, or keep requesting an
+       interrupt which is already flagged in the ICR
+    */
+    if (c->intr.imr != c->intr.imr1) {
+        return 0;
+    }
+    if (c->intr.icr & c->intr.imr) {
+        if ((c->intr.pip != (1<<M6526_PIP_IRQ)) || !(c->intr.icr & (1<<7))) {
+            return 0;
+        }
+    }
+    else if (c->intr.pip != 0) {
+        return 0;
+    }
+    uint32_t idle = _m6526_timer_idle(&c->ta);
+    const uint32_t tb_idle = _m6526_timer_idle(&c->tb);
+    if (tb_idle < idle) {
+        idle = tb_idle;
+    }
+    return idle;
+}
+
+/* advance the counting timers by the cycles skipped in the fast path */
+static inline void _m6526_catch_up(m6526_t* c) {
+    if (c->lag > 0) {
+        if (c->ta.pip & _M6526_PIP_COUNTING) {
+            c->ta.counter -= c->lag;
+        }
+        if (c->tb.pip & _M6526_PIP_COUNTING) {
+            c->tb.counter -= c->lag;
+        }
+        c->lag = 0;
+    }
+    c->idle = 0;
+}
+
 uint64_t m6526_tick(m6526_t* c, uint64_t pins) {
+    if (c->idle && !(pins & M6526_CS) &&
+        (c->intr.flag == (0 != (pins & M6526_FLAG))) &&
+        (c->tod.pin == (0 != (pins & M6526_TOD))))
+    {
+        /* nothing changes, except for the port pins and counters */
+        c->idle--;
+        c->lag++;
+        _m6526_read_port_pins(c, pins);
+        pins = _m6526_write_port_pins(c, pins);
+        if (c->intr.icr & (1<<7)) {
+            pins |= M6526_IRQ;
+        }
+        else {
+            pins &= ~M6526_IRQ;
+        }
+        c->pins = pins;
+        return pins;
+    }
+    _m6526_catch_up(c);
     pins = _m6526_tick(c, pins);
     if (pins & M6526_CS) {
         uint8_t addr = pins & M6526_RS;
@@ -679,6 +1008,7 @@ uint64_t m6526_tick(m6526_t* c, uint64_t pins) {
             _m6526_write(c, addr, data);
         }
     }
+    c->idle = _m6526_idle_ticks(c);
     c->pins = pins;
     return pins;
 }
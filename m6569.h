@@ -39,6 +39,42 @@
 
     TODO: Documentation
 
+    ## Render Modes
+
+    By default pixels are decoded cycle by cycle, like the real chip does,
+    which is also the most expensive part of the emulation. With
+    m6569_set_render_mode() pixels can instead be produced once per raster
+    line (M6569_RENDER_LINE), from the graphics data and border state
+    recorded during the line, or once per frame (M6569_RENDER_FRAME),
+    directly from video memory and the registers at the end of the frame.
+
+    The chip state machine (badlines, sprite DMA, BA/AEC, raster interrupts)
+    runs cycle by cycle in every mode, so the timing seen by the CPU does not
+    change. A line records the register writes happening while it is
+    displayed, with their position, so colors and graphics modes changed in
+    the middle of a line still show where they should, but a horizontal
+    scroll change or a sprite moved after it started displaying only take
+    effect on the next line. The frame mode loses all the effects of writes
+    in the middle of the frame. Sprite collisions are detected when the line
+    (or frame) is rendered. The mode is switched at the start of the next
+    frame.
+
+    The recorded lines (m6569_line_t) don't depend on the chip state, so
+    with m6569_desc_t.line_cb set they are passed to the callback instead,
+    which can output them later with m6569_render_line(), even on another
+    thread. The collisions are still detected right away, on a cheaper path
+    that doesn't compute the colors.
+
+    ## Bus Statistics
+
+    The chip counts how much of the bus it takes from the CPU in each
+    frame (from raster line 0 to the end of line 311): the bad lines, the
+    cycles it fetches sprite data (two for each sprite in each line), the
+    cycles BA is active, and, of those, the cycles in which the CPU is
+    really stopped, since the CPU only stops at a read access. Note that
+    BA (and so RDY) becomes active 3 cycles before the chip takes the bus.
+    m6569_frame_stats() returns the counters of the last complete frame.
+
     ## zlib/libpng license
 
     Copyright (c) 2018 Andre Weissflog
@@ -172,6 +208,33 @@ static const uint32_t _m6569_colors[16] = {
 // memory fetch callback, used to feed pixel- and color-data into the m6569
 typedef uint16_t (*m6569_fetch_t)(uint16_t addr, void* user_data);
 
+#define M6569_LINE_REGS     (0x2F)  // registers 0x00..0x2E affect what a line displays
+#define M6569_LINE_WRITES   (32)    // register writes recorded per line, more than the CPU can do
+
+// a register write in the visible part of a raster line
+typedef struct {
+    uint8_t x;                  // visible tick of the write, the new value is displayed from the next tick
+    uint8_t reg;
+    uint8_t data;
+} m6569_line_write_t;
+
+// what a visible raster line displays, the input of m6569_render_line()
+typedef struct {
+    uint16_t y;                 // framebuffer line
+    uint8_t xscroll;            // horizontal scroll when the line started
+    uint8_t mob_mask;           // sprites displayed in the line
+    uint32_t mob_data[8];       // sprite data of the line in bits 31..8
+    uint16_t c_data[40];        // video matrix values of the line (0 in idle state)
+    uint8_t g_data[40];         // graphics data of the line
+    uint8_t border[M6569_HTOTAL];   // border color of each visible tick, 0xFF if no border
+    uint8_t regs[M6569_LINE_REGS];  // register values when the line started
+    uint8_t num_writes;
+    m6569_line_write_t writes[M6569_LINE_WRITES];   // register writes during the line
+} m6569_line_t;
+
+// optional callback taking the recorded lines instead of m6569_render_line(), for instance to render them on another thread
+typedef void (*m6569_line_cb_t)(const m6569_line_t* line, void* user_data);
+
 // setup parameters for m6569_init() function
 typedef struct {
     // pointer and size of external framebuffer (at least M6569_FRAMEBUFFER_SIZE_BYTES big)
@@ -182,8 +245,13 @@ typedef struct {
     m6569_fetch_t fetch_cb;
     // optional user-data for fetch callback
     void* user_data;
+    // optional pixel output callback, pixels are decoded but not output when zero
     void (*crt_set_pixel)(void *fbptr, int x, int y, uint32_t c);
     void *crt_set_pixel_fb;
+    // initial render mode (M6569_RENDER_*), default is M6569_RENDER_CYCLE
+    int render_mode;
+    // optional, gets the lines to output when not decoding cycle by cycle (called with user_data)
+    m6569_line_cb_t line_cb;
 } m6569_desc_t;
 
 // register bank
@@ -317,6 +385,26 @@ typedef struct {
     uint8_t colors[8][4];       // 0: unused, 1: multicolor0, 2: main color, 3: multicolor
 } m6569_sprite_unit_t;
 
+// bus usage counters, see "Bus Statistics"
+typedef struct {
+    uint32_t badlines;          // bad lines
+    uint32_t sprite_dma;        // cycles the bus is taken for sprite p- and s-accesses
+    uint32_t ba;                // cycles with BA active
+    uint32_t stalled;           // cycles with BA active and a CPU read access on the bus, so the CPU is stopped
+} m6569_stats_t;
+
+// render modes, see m6569_set_render_mode()
+#define M6569_RENDER_CYCLE  (0)     // decode pixels cycle by cycle (default)
+#define M6569_RENDER_LINE   (1)     // render each raster line at its end
+#define M6569_RENDER_FRAME  (2)     // render the whole frame at its end
+
+// line renderer state, used when pixels are not decoded cycle by cycle
+typedef struct {
+    uint8_t mode;               // current render mode
+    uint8_t next_mode;          // render mode used from the next frame on
+    m6569_line_t line;          // the line being recorded
+} m6569_render_unit_t;
+
 // the m6569 state structure
 typedef struct {
     bool debug_vis;             // toggle this to switch debug visualization on/off
@@ -328,9 +416,13 @@ typedef struct {
     m6569_graphics_unit_t gunit;
     m6569_sprite_unit_t sunit;
     m6569_video_matrix_t vm;
+    m6569_render_unit_t render;
+    m6569_stats_t stats;        // bus usage of the frame in progress
+    m6569_stats_t frame_stats;  // bus usage of the last complete frame
     uint64_t pins;
     void (*crt_set_pixel)(void *fbptr, int x, int y, uint32_t c);
     void *crt_set_pixel_fb;
+    m6569_line_cb_t line_cb;
 } m6569_t;
 
 // initialize a new m6569_t instance
@@ -339,6 +431,14 @@ void m6569_init(m6569_t* vic, const m6569_desc_t* desc);
 void m6569_reset(m6569_t* vic);
 // tick the m6569 instance
 uint64_t m6569_tick(m6569_t* vic, uint64_t pins);
+// tick the m6569_t instance without calling crt_set_pixel (sprite collisions are still detected)
+uint64_t m6569_tick_novideo(m6569_t* vic, uint64_t pins);
+// select how pixels are produced (M6569_RENDER_*), takes effect at the start of the next frame
+void m6569_set_render_mode(m6569_t* vic, int mode);
+// output a line recorded when not decoding cycle by cycle, only reads the display setup of vic (safe from another thread)
+void m6569_render_line(const m6569_t* vic, const m6569_line_t* line);
+// get the bus usage counters of the last complete frame
+m6569_stats_t m6569_frame_stats(const m6569_t* vic);
 // get the visible screen rect in pixels
 chips_rect_t m6569_screen(m6569_t* vic);
 // get the color palette
@@ -418,6 +518,9 @@ void m6569_init(m6569_t* vic, const m6569_desc_t* desc) {
     vic->mem.user_data = desc->user_data;
     vic->crt_set_pixel = desc->crt_set_pixel;
     vic->crt_set_pixel_fb = desc->crt_set_pixel_fb;
+    vic->line_cb = desc->line_cb;
+    CHIPS_ASSERT((desc->render_mode >= M6569_RENDER_CYCLE) && (desc->render_mode <= M6569_RENDER_FRAME));
+    vic->render.mode = vic->render.next_mode = (uint8_t) desc->render_mode;
 }
 
 /*--- reset ------------------------------------------------------------------*/
@@ -474,6 +577,8 @@ void m6569_reset(m6569_t* vic) {
     _m6569_reset_video_matrix_unit(&vic->vm);
     _m6569_reset_graphics_unit(&vic->gunit);
     _m6569_reset_sprite_unit(&vic->sunit);
+    memset(&vic->stats, 0, sizeof(vic->stats));
+    memset(&vic->frame_stats, 0, sizeof(vic->frame_stats));
 }
 
 /*--- register read/writes ---------------------------------------------------*/
@@ -585,6 +690,23 @@ static uint64_t _m6569_read(m6569_t* vic, uint64_t pins) {
     return pins;
 }
 
+/* In M6569_RENDER_LINE mode, remember the register writes happening in the
+   visible part of a line.
+*/
+static inline void _m6569_render_write(m6569_t* vic, uint8_t reg, uint8_t data) {
+    if ((vic->crt.x >= vic->crt.vis_x0) && (vic->crt.x < vic->crt.vis_x1) &&
+        (vic->crt.y >= vic->crt.vis_y0) && (vic->crt.y < vic->crt.vis_y1))
+    {
+        m6569_line_t* line = &vic->render.line;
+        if (line->num_writes < M6569_LINE_WRITES) {
+            line->writes[line->num_writes].x = (uint8_t)(vic->crt.x - vic->crt.vis_x0);
+            line->writes[line->num_writes].reg = reg;
+            line->writes[line->num_writes].data = data;
+            line->num_writes++;
+        }
+    }
+}
+
 // write chip registers
 static void _m6569_write(m6569_t* vic, uint64_t pins) {
     m6569_registers_t* r = &vic->reg;
@@ -722,6 +844,9 @@ static void _m6569_write(m6569_t* vic, uint64_t pins) {
     }
     if (write) {
         r->regs[r_addr] = data;
+        if ((vic->render.mode == M6569_RENDER_LINE) && (r_addr < M6569_LINE_REGS)) {
+            _m6569_render_write(vic, r_addr, data);
+        }
     }
 }
 
@@ -978,6 +1103,7 @@ static inline uint64_t _m6569_sunit_dma_ba(m6569_t* vic, uint32_t s_index, uint6
 static inline uint64_t _m6569_sunit_dma_aec(m6569_t* vic, uint32_t s_index, uint64_t pins) {
     if (vic->sunit.dma_enabled[s_index]) {
         pins |= M6569_AEC;
+        vic->stats.sprite_dma++;
     }
     return pins;
 }
@@ -1097,7 +1223,7 @@ static inline uint8_t _m6569_color_multiplex(uint16_t bmc, uint16_t sc, uint8_t
 }
 
 // decode the next 8 pixels
-static inline void _m6569_decode_pixels(m6569_t* vic, int x, int y, uint8_t g_data, uint8_t hpos) {
+static inline void _m6569_decode_pixels(m6569_t* vic, int x, int y, uint8_t g_data, uint8_t hpos, const bool video) {
 
     m6569_sprite_unit_t* su = &vic->sunit;
     for (size_t i = 0; i < 8; i++) {
@@ -1150,7 +1276,314 @@ static inline void _m6569_decode_pixels(m6569_t* vic, int x, int y, uint8_t g_da
             case 4: bmc = _m6569_gunit_decode_mode4(vic); break;
         }
         _m6569_test_mob_data_col(vic, bmc, sc);
-        vic->crt_set_pixel(vic->crt_set_pixel_fb, x+i, y, _m6569_colors[brd ? brd_color : _m6569_color_multiplex(bmc, sc, mdp)]);
+        if (video && vic->crt_set_pixel) {
+            vic->crt_set_pixel(vic->crt_set_pixel_fb, x+i, y, _m6569_colors[brd ? brd_color : _m6569_color_multiplex(bmc, sc, mdp)]);
+        }
+    }
+}
+
+/*--- line renderer ----------------------------------------------------------*/
+
+/* decode a pixel of graphics data (bit 0..7 of g) like the graphics
+   sequencer does, the result has the same format as _m6569_gunit_decode_mode*()
+*/
+static inline uint16_t _m6569_line_gfx(uint8_t mode, const uint16_t* bg, uint8_t g, uint16_t c, int bit) {
+    const bool fg = 0 != (g & (0x80>>bit));
+    const uint8_t bits = (g >> (6 - (bit & 6))) & 3;
+    switch (mode) {
+        case 0:
+            return fg ? (0xFF00 | ((c>>8) & 0xF)) : bg[0];
+        case 1:
+            if (c & (1<<11)) {
+                return (bits == 3) ? (0xFF00 | ((c>>8) & 0x7)) : bg[bits];
+            }
+            return fg ? (0xFF00 | ((c>>8) & 0x7)) : bg[0];
+        case 2:
+            return fg ? (0xFF00 | ((c>>4) & 0xF)) : (c & 0xF);
+        case 3:
+            switch (bits) {
+                case 0: return bg[0];
+                case 1: return (c>>4) & 0xF;
+                case 2: return 0xFF00 | (c & 0xF);
+                default: return 0xFF00 | ((c>>8) & 0xF);
+            }
+        case 4:
+            return fg ? (0xFF00 | ((c>>8) & 0xF)) : bg[(c>>6) & 3];
+        default:
+            // invalid modes output black background pixels
+            return 0;
+    }
+}
+
+// the graphics mode and background colors (see _m6569_write()) from the registers of a line
+static inline uint8_t _m6569_line_mode(const uint8_t* r, uint16_t* bg) {
+    bg[0] = r[0x21];
+    bg[1] = r[0x22];
+    bg[2] = 0xFF00 | r[0x23];
+    bg[3] = 0xFF00 | r[0x24];
+    return ((r[0x11]&(M6569_CTRL1_ECM|M6569_CTRL1_BMM))|(r[0x16]&M6569_CTRL2_MCM))>>4;
+}
+
+// first pixel of sprite i in a line, like _m6569_io_update_sunit() computes it
+static inline int _m6569_line_mob_x(const m6569_t* vic, const uint8_t* r, int i) {
+    const int xpos = (((r[0x10]>>i) & 1)<<8) | r[i*2];
+    return ((xpos / 8) + 13 - 4 - vic->crt.vis_x0) * M6569_PIXELS_PER_TICK + (xpos & 7);
+}
+
+/* Render a recorded raster line into the framebuffer (when output is
+   true), and find its sprite collisions (when mob_col is not NULL):
+   mob_col[0] gets the sprites that collided with other sprites, and
+   mob_col[1] the ones that collided with foreground graphics. The pixels
+   are the same that the cycle by cycle decoding produces, apart from the
+   limits described in "Render Modes".
+*/
+static void _m6569_line(const m6569_t* vic, const m6569_line_t* line, bool output, uint8_t* mob_col) {
+    uint8_t r[M6569_LINE_REGS];
+    memcpy(r, line->regs, sizeof(r));
+    uint16_t bg[4];
+    uint8_t mode = _m6569_line_mode(r, bg);
+    // graphics, the first character is fetched in tick 16
+    const int gx = (16 - 4 - vic->crt.vis_x0) * M6569_PIXELS_PER_TICK + line->xscroll;
+    int mob_x[8];
+    for (int i = 0; i < 8; i++) {
+        mob_x[i] = _m6569_line_mob_x(vic, r, i);
+    }
+    uint8_t mcm = 0, mbc = 0;
+    int w = 0;
+    for (int x = 0; x < vic->crt.vis_w; x++) {
+        // register writes are displayed from the tick after
+        if ((w < line->num_writes) && (line->writes[w].x < x)) {
+            do {
+                const m6569_line_write_t* wr = &line->writes[w++];
+                r[wr->reg] = wr->data;
+                if (wr->reg <= 0x10) {
+                    // sprites not displayed yet can still move
+                    for (int i = 0; i < 8; i++) {
+                        if (mob_x[i] >= x*M6569_PIXELS_PER_TICK) {
+                            mob_x[i] = _m6569_line_mob_x(vic, r, i);
+                        }
+                    }
+                }
+            } while ((w < line->num_writes) && (line->writes[w].x < x));
+            mode = _m6569_line_mode(r, bg);
+        }
+        const uint8_t mxe = r[0x1D];
+        const uint8_t mmc = r[0x1C];
+        const uint8_t brd = line->border[x];
+        for (int p = 0; p < M6569_PIXELS_PER_TICK; p++) {
+            const int px = x*M6569_PIXELS_PER_TICK + p;
+            const int gp = px - gx;
+            const uint16_t bmc = ((gp >= 0) && (gp < 320)) ?
+                _m6569_line_gfx(mode, bg, line->g_data[gp>>3], line->c_data[gp>>3], gp & 7) :
+                _m6569_line_gfx(mode, bg, 0, 0, 0);
+            // sprites, lower numbers have higher priority
+            uint16_t sc = 0;
+            uint8_t cov = 0;
+            for (int i = 0; (i < 8) && (line->mob_mask >> i); i++) {
+                const int d = px - mob_x[i];
+                if ((0 == (line->mob_mask & (1<<i))) || (d < 0) || (d >= ((mxe & (1<<i)) ? 48 : 24))) {
+                    continue;
+                }
+                const int b = (mxe & (1<<i)) ? (d>>1) : d;
+                uint8_t c;
+                if (mmc & (1<<i)) {
+                    const uint32_t ci = (line->mob_data[i] >> (30 - (b & ~1))) & 3;
+                    if (ci == 0) {
+                        continue;
+                    }
+                    c = r[(ci == 2) ? (0x27 + i) : ((ci == 1) ? 0x25 : 0x26)];
+                }
+                else {
+                    if (0 == (line->mob_data[i] & (1u<<(31-b)))) {
+                        continue;
+                    }
+                    c = r[0x27 + i];
+                }
+                if (cov == 0) {
+                    sc = c;
+                }
+                cov |= (1<<i);
+            }
+            if (cov) {
+                sc |= cov<<8;
+                if (cov & (cov - 1)) {
+                    mcm |= cov;
+                }
+                if (bmc & 0xFF00) {
+                    mbc |= cov;
+                }
+            }
+            if (output) {
+                const uint8_t c = (brd != 0xFF) ? brd : _m6569_color_multiplex(bmc, sc, r[0x1B]);
+                vic->crt_set_pixel(vic->crt_set_pixel_fb, px, line->y, _m6569_colors[c & 0xF]);
+            }
+        }
+    }
+    if (mob_col) {
+        mob_col[0] = mcm;
+        mob_col[1] = mbc;
+    }
+}
+
+void m6569_render_line(const m6569_t* vic, const m6569_line_t* line) {
+    CHIPS_ASSERT(vic && line && vic->crt_set_pixel);
+    _m6569_line(vic, line, true, 0);
+}
+
+/* A line was recorded: output it (or pass it to the line callback), and
+   detect its sprite collisions.
+*/
+static void _m6569_line_done(m6569_t* vic, bool video) {
+    const m6569_line_t* line = &vic->render.line;
+    const bool output = video && vic->crt_set_pixel;
+    uint8_t mob_col[2] = { 0, 0 };
+    if (output && !vic->line_cb) {
+        _m6569_line(vic, line, true, mob_col);
+    }
+    else {
+        if (line->mob_mask) {
+            _m6569_line(vic, line, false, mob_col);
+        }
+        if (output) {
+            vic->line_cb(line, vic->mem.user_data);
+        }
+    }
+    if (mob_col[0]) {
+        vic->reg.mcm |= mob_col[0];
+        vic->reg.int_latch |= M6569_INT_IMMC;
+    }
+    if (mob_col[1]) {
+        vic->reg.mcd |= mob_col[1];
+        vic->reg.int_latch |= M6569_INT_IMBC;
+    }
+}
+
+/* In M6569_RENDER_LINE mode, record what the line renderer needs for the
+   current visible tick, and render the line at its last visible tick.
+*/
+static inline void _m6569_render_tick(m6569_t* vic, size_t x, size_t y, uint8_t g_data, const bool video) {
+    m6569_line_t* line = &vic->render.line;
+    const uint8_t hpos = vic->rs.h_count;
+    if (x == 0) {
+        /* all the sprite data of the line was fetched by now, the shifters
+           are emptied like the sprite sequencer does when displaying them
+        */
+        m6569_sprite_unit_t* su = &vic->sunit;
+        line->y = (uint16_t)y;
+        line->mob_mask = 0;
+        for (size_t i = 0; i < 8; i++) {
+            if (su->disp_enabled[i]) {
+                line->mob_mask |= (1<<i);
+                line->mob_data[i] = su->shift[i];
+                su->shift[i] = 0;
+            }
+        }
+        memcpy(line->regs, vic->reg.regs, sizeof(line->regs));
+        line->num_writes = 0;
+    }
+    if ((hpos >= 16) && (hpos < 56)) {
+        if (hpos == 16) {
+            line->xscroll = vic->reg.ctrl_2 & M6569_CTRL2_XSCROLL;
+        }
+        line->g_data[hpos - 16] = g_data;
+        line->c_data[hpos - 16] = vic->gunit.enabled ? vic->vm.line[vic->vm.vmli] : 0;
+    }
+    if (vic->brd.vert | vic->brd.main) {
+        line->border[x] = vic->brd.main ? vic->brd.bc : (uint8_t)vic->gunit.bg[0];
+    }
+    else {
+        line->border[x] = 0xFF;
+    }
+    if (x == (size_t)(vic->crt.vis_w - 1)) {
+        _m6569_line_done(vic, video);
+    }
+}
+
+/* In M6569_RENDER_FRAME mode, render the frame that just ended directly
+   from video memory, with the register values at the end of the frame.
+*/
+static void _m6569_render_frame(m6569_t* vic, bool video) {
+    const bool output = video && vic->crt_set_pixel;
+    if (!output && !vic->reg.me) {
+        return;
+    }
+    m6569_line_t* ru = &vic->render.line;
+    const m6569_memory_unit_t* m = &vic->mem;
+    const bool den = 0 != (vic->reg.ctrl_1 & M6569_CTRL1_DEN);
+    const bool bmm = 0 != (vic->reg.ctrl_1 & M6569_CTRL1_BMM);
+    const uint16_t first_badline = 0x30 + (vic->reg.ctrl_1 & M6569_CTRL1_YSCROLL);
+    const uint8_t i_data = (uint8_t) m->fetch_cb(m->i_addr, m->user_data);
+    uint8_t p_data[8];
+    for (int i = 0; i < 8; i++) {
+        p_data[i] = (uint8_t) m->fetch_cb(m->p_addr_or + i, m->user_data);
+    }
+    ru->xscroll = vic->reg.ctrl_2 & M6569_CTRL2_XSCROLL;
+    memcpy(ru->regs, vic->reg.regs, sizeof(ru->regs));
+    ru->num_writes = 0;
+    for (int y = 0; y < vic->crt.vis_h; y++) {
+        ru->y = (uint16_t)y;
+        // the CRT beam retrace happens at raster line _M6569_VRETRACEPOS
+        const int rast = (_M6569_VRETRACEPOS + vic->crt.vis_y0 + y) % M6569_VTOTAL;
+
+        // sprites, displayed from the line after their Y coordinate matches
+        ru->mob_mask = 0;
+        for (int i = 0; i < 8; i++) {
+            if (0 == (vic->reg.me & (1<<i))) {
+                continue;
+            }
+            const int height = (vic->reg.mye & (1<<i)) ? 42 : 21;
+            for (int start = vic->reg.mxy[i][1]; start < M6569_VTOTAL; start += 256) {
+                const int d = rast - start - 1;
+                if ((d >= 0) && (d < height)) {
+                    const uint16_t addr = (p_data[i]<<6) | (((vic->reg.mye & (1<<i)) ? (d>>1) : d) * 3);
+                    uint32_t data = 0;
+                    for (int k = 0; k < 3; k++) {
+                        data = (data<<8) | (uint8_t) m->fetch_cb(addr + k, m->user_data);
+                    }
+                    ru->mob_mask |= (1<<i);
+                    ru->mob_data[i] = data<<8;
+                    break;
+                }
+            }
+        }
+        if (!output && !ru->mob_mask) {
+            continue;
+        }
+
+        // border
+        const bool open = den && (rast >= vic->brd.top) && (rast < vic->brd.bottom);
+        for (int x = 0; x < vic->crt.vis_w; x++) {
+            const int hpos = vic->crt.vis_x0 + x + 4;
+            const bool brd = !open || (hpos < vic->brd.left) || (hpos >= vic->brd.right);
+            ru->border[x] = brd ? vic->brd.bc : 0xFF;
+        }
+
+        // graphics, 25 character rows starting at the first badline
+        const int row_line = rast - first_badline;
+        if (den && (row_line >= 0) && (row_line < 25*8)) {
+            const uint16_t vc = (row_line >> 3) * 40;
+            const uint16_t rc = row_line & 7;
+            for (int i = 0; i < 40; i++) {
+                const uint16_t c = m->fetch_cb((vc + i) | m->c_addr_or, m->user_data) & 0x0FFF;
+                uint16_t addr;
+                if (bmm) {
+                    addr = ((vc + i)<<3) | rc;
+                    addr = (addr | (m->g_addr_or & (1<<13))) & m->g_addr_and;
+                }
+                else {
+                    addr = ((c & 0xFF)<<3) | rc;
+                    addr = (addr | m->g_addr_or) & m->g_addr_and;
+                }
+                ru->c_data[i] = c;
+                ru->g_data[i] = (uint8_t) m->fetch_cb(addr, m->user_data);
+            }
+        }
+        else {
+            memset(ru->c_data, 0, sizeof(ru->c_data));
+            memset(ru->g_data, i_data, sizeof(ru->g_data));
+        }
+
+        _m6569_line_done(vic, video);
     }
 }
 
@@ -1212,6 +1645,8 @@ static inline void _m6569_rs_next_rasterline(m6569_t* vic) {
     if (vic->rs.v_count == (M6569_VTOTAL-1)) {
         vic->rs.v_count = 0;
         vic->rs.vc_base = 0;
+        vic->frame_stats = vic->stats;
+        memset(&vic->stats, 0, sizeof(vic->stats));
     }
     else {
         vic->rs.v_count++;
@@ -1304,10 +1739,15 @@ static inline void _m6569_rs_rewind_vc_vmli_rc(m6569_t* vic) {
     }
 }
 
-static inline void _m6569_crt_next_crtline(m6569_t* vic) {
+static inline void _m6569_crt_next_crtline(m6569_t* vic, const bool video) {
     vic->crt.x = 0;
     if (vic->rs.v_count == _M6569_VRETRACEPOS) {
         vic->crt.y = 0;
+        // a new frame starts, this is where the render mode can change
+        if (vic->render.mode == M6569_RENDER_FRAME) {
+            _m6569_render_frame(vic, video);
+        }
+        vic->render.mode = vic->render.next_mode;
     }
     else {
         vic->crt.y++;
@@ -1441,8 +1881,11 @@ static inline uint64_t _m6569_aec(uint64_t pins) {
     return pins | M6569_AEC;
 }
 
-// internal tick function
-static uint64_t _m6569_tick(m6569_t* vic, uint64_t pins) {
+// internal tick function, specialized with and without pixel output
+#if defined(__GNUC__)
+__attribute__((always_inline))
+#endif
+static inline uint64_t _m6569_tick(m6569_t* vic, uint64_t pins, const bool video) {
     pins &= ~M6569_BA;
     uint8_t g_data = 0x00;
     _m6569_rs_update_badline(vic);
@@ -1474,7 +1917,7 @@ static uint64_t _m6569_tick(m6569_t* vic, uint64_t pins) {
             pins = _m6569_sunit_dma_ba(vic, 5, pins);
             break;
         case 4:
-            _m6569_crt_next_crtline(vic);
+            _m6569_crt_next_crtline(vic, video);
             g_data = _m6569_s_i_access(vic, 4);
             _m6569_s_access(vic, 4);
             pins = _m6569_sunit_dma_aec(vic, 4, pins);
@@ -1625,6 +2068,7 @@ static uint64_t _m6569_tick(m6569_t* vic, uint64_t pins) {
             pins = _m6569_sunit_dma_ba(vic, 3, pins);
             break;
         case 63:    /* HTOTAL */
+            vic->stats.badlines += vic->rs.badline;
             _m6569_rs_next_rasterline(vic);
             _m6569_rs_check_irq(vic);
             g_data = _m6569_s_i_access(vic, 2);
@@ -1647,6 +2091,10 @@ static uint64_t _m6569_tick(m6569_t* vic, uint64_t pins) {
         pins |= M6569_IRQ;
     }
 
+    //--- bus usage, the CPU is stopped in the next tick if reading
+    vic->stats.ba += (pins & M6569_BA) != 0;
+    vic->stats.stalled += (pins & (M6569_BA|M6569_RW)) == (M6569_BA|M6569_RW);
+
     //--- decode pixels into framebuffer
     #if 0
     if (vic->debug_vis) {
@@ -1662,17 +2110,18 @@ static uint64_t _m6569_tick(m6569_t* vic, uint64_t pins) {
     {
         const size_t x = vic->crt.x - vic->crt.vis_x0;
         const size_t y = vic->crt.y - vic->crt.vis_y0;
-        _m6569_decode_pixels(vic, x*8, y, g_data, vic->rs.h_count);
+        if (vic->render.mode == M6569_RENDER_CYCLE) {
+            _m6569_decode_pixels(vic, x*8, y, g_data, vic->rs.h_count, video);
+        }
+        else if (vic->render.mode == M6569_RENDER_LINE) {
+            _m6569_render_tick(vic, x, y, g_data, video);
+        }
     }
     vic->vm.vmli = vic->vm.next_vmli;
     return pins;
 }
 
-// all-in-one tick function
-uint64_t m6569_tick(m6569_t* vic, uint64_t pins) {
-    // per-tick actions
-    pins = _m6569_tick(vic, pins);
-
+static inline uint64_t _m6569_tick_rw(m6569_t* vic, uint64_t pins) {
     // register read/writes
     if (pins & M6569_CS) {
         if (pins & M6569_RW) {
@@ -1686,6 +2135,28 @@ uint64_t m6569_tick(m6569_t* vic, uint64_t pins) {
     return pins;
 }
 
+// all-in-one tick function
+uint64_t m6569_tick(m6569_t* vic, uint64_t pins) {
+    // per-tick actions
+    pins = _m6569_tick(vic, pins, true);
+    return _m6569_tick_rw(vic, pins);
+}
+
+uint64_t m6569_tick_novideo(m6569_t* vic, uint64_t pins) {
+    pins = _m6569_tick(vic, pins, false);
+    return _m6569_tick_rw(vic, pins);
+}
+
+m6569_stats_t m6569_frame_stats(const m6569_t* vic) {
+    CHIPS_ASSERT(vic);
+    return vic->frame_stats;
+}
+
+void m6569_set_render_mode(m6569_t* vic, int mode) {
+    CHIPS_ASSERT(vic && (mode >= M6569_RENDER_CYCLE) && (mode <= M6569_RENDER_FRAME));
+    vic->render.next_mode = (uint8_t) mode;
+}
+
 chips_rect_t m6569_screen(m6569_t* vic) {
     CHIPS_ASSERT(vic);
     return (chips_rect_t){
@@ -1767,6 +2238,7 @@ void m6569_snapshot_onsave(m6569_t* snapshot) {
     snapshot->mem.fetch_cb = 0;
     snapshot->mem.user_data = 0;
     snapshot->crt.fb = 0;
+    snapshot->line_cb = 0;
 }
 
 void m6569_snapshot_onload(m6569_t* snapshot, m6569_t* sys) {
@@ -1774,6 +2246,10 @@ void m6569_snapshot_onload(m6569_t* snapshot, m6569_t* sys) {
     snapshot->mem.fetch_cb = sys->mem.fetch_cb;
     snapshot->mem.user_data = sys->mem.user_data;
     snapshot->crt.fb = sys->crt.fb;
+    snapshot->line_cb = sys->line_cb;
+    // the render mode is a host setting, not part of the machine state
+    snapshot->render.mode = sys->render.mode;
+    snapshot->render.next_mode = sys->render.next_mode;
 }
 
 #endif // CHIPS_IMPL
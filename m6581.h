@@ -36,6 +36,11 @@
     The emulation has an additional "virtual pin" which is set to active
     whenever a new sample is ready (M6581_SAMPLE).
 
+    When nobody listens, m6581_tick_silent() can be called instead of
+    m6581_tick(): the oscillators and envelope generators still run, so
+    that the OSC3 and ENV3 registers read the same, but the filter, the
+    mixer and the sample output are skipped.
+
     ## Links
 
     - http://blog.kevtris.org/?p=13
@@ -248,6 +253,8 @@ void m6581_init(m6581_t* sid, const m6581_desc_t* desc);
 void m6581_reset(m6581_t* sid);
 // tick a m6581_t instance
 uint64_t m6581_tick(m6581_t* sid, uint64_t pins);
+// tick m6581_t instance without generating audio samples
+uint64_t m6581_tick_silent(m6581_t* sid, uint64_t pins);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -644,8 +651,8 @@ static inline int _m6581_filter_output(m6581_filter_t* f, int vi) {
     return vf * (1<<7);
 }
 
-/* tick the sound generation, return true when new sample ready */
-static uint64_t _m6581_tick(m6581_t* sid, uint64_t pins) {
+/* tick the bus and the voices, everything the CPU can observe */
+static inline void _m6581_tick_voices(m6581_t* sid) {
     /* decay the last written register value */
     if (sid->bus_decay > 0) {
         if (--sid->bus_decay == 0) {
@@ -661,6 +668,12 @@ static uint64_t _m6581_tick(m6581_t* sid, uint64_t pins) {
     for (int i = 0; i < 3; i++) {
         _m6581_voice_sync(sid, i);
     }
+}
+
+/* tick the sound generation, return true when new sample ready */
+static uint64_t _m6581_tick(m6581_t* sid, uint64_t pins) {
+    _m6581_tick_voices(sid);
+
     /* filter */
     int sum_filtered_outp = 0;
     int sum_outp = 0;
@@ -815,13 +828,7 @@ static void _m6581_write(m6581_t* sid, uint64_t pins) {
 }
 
 /* the all-in-one tick function */
-uint64_t m6581_tick(m6581_t* sid, uint64_t pins) {
-    CHIPS_ASSERT(sid);
-
-    /* first perform the regular per-tick actions */
-    pins = _m6581_tick(sid, pins);
-
-    /* register read/write */
+static inline uint64_t _m6581_tick_rw(m6581_t* sid, uint64_t pins) {
     if (pins & M6581_CS) {
         if (pins & M6581_RW) {
             pins = _m6581_read(sid, pins);
@@ -834,4 +841,20 @@ uint64_t m6581_tick(m6581_t* sid, uint64_t pins) {
     return pins;
 }
 
+uint64_t m6581_tick(m6581_t* sid, uint64_t pins) {
+    CHIPS_ASSERT(sid);
+
+    /* first perform the regular per-tick actions */
+    pins = _m6581_tick(sid, pins);
+
+    /* register read/write */
+    return _m6581_tick_rw(sid, pins);
+}
+
+uint64_t m6581_tick_silent(m6581_t* sid, uint64_t pins) {
+    CHIPS_ASSERT(sid);
+    _m6581_tick_voices(sid);
+    return _m6581_tick_rw(sid, pins & ~M6581_SAMPLE);
+}
+
 #endif /* CHIPS_IMPL */
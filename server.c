@@ -0,0 +1,365 @@
+/* server.c
+ * Share one running emulator with many terminals.
+ *
+ * With --listen the emulator accepts viewers on a Unix domain socket.
+ * A viewer is just "c64-kitty --attach <path>" running in some other
+ * terminal: it receives the same Kitty escape sequences the emulator
+ * would write to its own terminal, and sends keystrokes back, unless
+ * it attached with --observe. Like tmux, pressing ESC in the viewer
+ * detaches it, and the emulator keeps running.
+ *
+ * Each frame is encoded only once by the caller for every kind of frame
+ * some viewer needs (see FRAME_* in c64-kitty.h), and the same buffers
+ * are queued to all the viewers. Sockets are non blocking, so a viewer
+ * that can't keep up never slows down the emulator or the other viewers:
+ * when its backlog grows too much, its lag policy decides if it should
+ * skip frames and later get a full refresh, or be disconnected. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "c64-kitty.h"
+
+#define SERVER_MAX_VIEWERS 32
+#define SERVER_MAX_BACKLOG (1024*1024)  // Max pending bytes per viewer.
+#define VIEWER_HELLO "C64VIEWER"        // Sent by viewers upon connection.
+
+/* Viewer states. */
+#define VIEWER_HELLO_WAIT 0 // Connected, hello line not yet received.
+#define VIEWER_NEW 1        // Needs FRAME_CREATE.
+#define VIEWER_STALE 2      // Has the image, but lost frames: FRAME_FULL.
+#define VIEWER_SYNCED 3     // Up to date: FRAME_DELTA is enough.
+
+typedef struct {
+    int fd;
+    int state;
+    int observer;       // Read only viewer: input is discarded.
+    int lag_policy;     // VIEWER_LAG_*
+    char hello[64];     // Hello line accumulated so far.
+    size_t hello_len;
+    obuf out;           // Output not yet accepted by the socket.
+    size_t out_pos;     // Already written part of 'out'.
+} viewer;
+
+static int ListenFd = -1;
+static char *ListenPath = NULL;
+static viewer Viewers[SERVER_MAX_VIEWERS];
+static int NumViewers = 0;
+
+/* ============================== Output buffers ============================ */
+
+void obuf_append(obuf *b, const void *p, size_t len) {
+    if (b->len + len > b->alloc) {
+        size_t alloc = b->alloc ? b->alloc : 4096;
+        while (alloc < b->len + len) alloc *= 2;
+        b->buf = realloc(b->buf, alloc);
+        if (b->buf == NULL) {
+            fprintf(stderr, "Out of memory allocating %zu bytes\n", alloc);
+            exit(1);
+        }
+        b->alloc = alloc;
+    }
+    memcpy(b->buf + b->len, p, len);
+    b->len += len;
+}
+
+void obuf_printf(obuf *b, const char *fmt, ...) {
+    char tmp[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if (len >= (int)sizeof(tmp)) len = sizeof(tmp)-1;
+    obuf_append(b, tmp, len);
+}
+
+void obuf_free(obuf *b) {
+    free(b->buf);
+    b->buf = NULL;
+    b->len = b->alloc = 0;
+}
+
+/* ================================ Server side ============================= */
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Start listening for viewers at the specified Unix socket path.
+ * Returns 0 on success, -1 on error (and errno is set). */
+int server_listen(const char *path) {
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+        listen(fd, 16) == -1 ||
+        set_nonblocking(fd) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Writing to a viewer that went away must not kill the emulator.
+    signal(SIGPIPE, SIG_IGN);
+    ListenFd = fd;
+    ListenPath = strdup(path);
+    return 0;
+}
+
+static void viewer_free(int j) {
+    close(Viewers[j].fd);
+    obuf_free(&Viewers[j].out);
+    Viewers[j] = Viewers[--NumViewers];
+}
+
+/* Write as much pending output as the socket accepts without blocking.
+ * Returns -1 if the viewer went away. */
+static int viewer_flush(viewer *v) {
+    while (v->out_pos < v->out.len) {
+        ssize_t n = write(v->fd, v->out.buf + v->out_pos,
+                          v->out.len - v->out_pos);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        v->out_pos += n;
+    }
+    // Drop what was written, so that a viewer always a bit behind does not
+    // make 'out' grow forever.
+    memmove(v->out.buf, v->out.buf + v->out_pos, v->out.len - v->out_pos);
+    v->out.len -= v->out_pos;
+    v->out_pos = 0;
+    return 0;
+}
+
+/* Parse the hello line sent by viewers upon connection:
+ *
+ *   C64VIEWER <observer:0|1> <lag policy:0|1>\n
+ *
+ * Returns the number of bytes consumed, or -1 on protocol error. */
+static int viewer_read_hello(viewer *v, const char *buf, size_t len) {
+    size_t j;
+    for (j = 0; j < len; j++) {
+        if (buf[j] == '\n') break;
+        if (v->hello_len == sizeof(v->hello)-1) return -1;
+        v->hello[v->hello_len++] = buf[j];
+    }
+    if (j == len) return len;   // Hello line not complete yet.
+
+    int observer, lag_policy;
+    v->hello[v->hello_len] = '\0';
+    if (sscanf(v->hello, VIEWER_HELLO " %d %d", &observer, &lag_policy) != 2)
+        return -1;
+    v->observer = observer != 0;
+    v->lag_policy = lag_policy == VIEWER_LAG_KICK ? VIEWER_LAG_KICK :
+                                                    VIEWER_LAG_RESYNC;
+    v->state = VIEWER_NEW;
+    return j+1;
+}
+
+/* Accept new viewers, flush pending output, and pass the keystrokes
+ * received by non observer viewers to 'cb'. Called once per frame. */
+void server_poll(viewer_input_cb cb, void *user_data) {
+    if (ListenFd == -1) return;
+
+    // Accept new viewers.
+    while (1) {
+        int fd = accept(ListenFd, NULL, NULL);
+        if (fd == -1) break;
+        if (NumViewers == SERVER_MAX_VIEWERS || set_nonblocking(fd) == -1) {
+            close(fd);
+            continue;
+        }
+        viewer *v = Viewers+NumViewers++;
+        memset(v, 0, sizeof(*v));
+        v->fd = fd;
+        v->state = VIEWER_HELLO_WAIT;
+    }
+
+    // Read input and flush output.
+    for (int j = 0; j < NumViewers; j++) {
+        viewer *v = Viewers+j;
+        int gone = 0;
+        char buf[256];
+
+        while (1) {
+            ssize_t n = read(v->fd, buf, sizeof(buf));
+            if (n == 0 || (n == -1 && errno != EAGAIN &&
+                           errno != EWOULDBLOCK && errno != EINTR))
+            {
+                gone = 1;
+                break;
+            }
+            if (n == -1) break;
+
+            int start = 0;
+            if (v->state == VIEWER_HELLO_WAIT) {
+                start = viewer_read_hello(v, buf, n);
+                if (start == -1) {
+                    gone = 1;
+                    break;
+                }
+            }
+            if (start < n && !v->observer && cb)
+                cb(buf+start, n-start, user_data);
+        }
+        if (!gone) gone = viewer_flush(v) == -1;
+        if (gone) viewer_free(j--);
+    }
+}
+
+/* Return the number of attached viewers. */
+int server_viewers(void) {
+    return NumViewers;
+}
+
+/* Return true if some viewer needs a frame of the specified kind, so
+ * that the caller encodes only the frames that will be actually sent. */
+int server_needs(int kind) {
+    int state = (kind == FRAME_CREATE) ? VIEWER_NEW :
+                (kind == FRAME_FULL) ? VIEWER_STALE : VIEWER_SYNCED;
+    for (int j = 0; j < NumViewers; j++)
+        if (Viewers[j].state == state) return 1;
+    return 0;
+}
+
+/* Queue the encoded frames to the viewers, each getting the kind of frame
+ * its state requires. An empty buffer means there is nothing new to send
+ * for this kind of frame. */
+void server_broadcast(obuf *frames) {
+    for (int j = 0; j < NumViewers; j++) {
+        viewer *v = Viewers+j;
+        obuf *frame;
+
+        switch(v->state) {
+        case VIEWER_NEW: frame = frames+FRAME_CREATE; break;
+        case VIEWER_STALE: frame = frames+FRAME_FULL; break;
+        case VIEWER_SYNCED: frame = frames+FRAME_DELTA; break;
+        default: continue;
+        }
+        if (frame->len == 0) continue;
+
+        // Lagging viewer? Skip this frame. Since later deltas would not
+        // make sense without this one, the viewer will need a full frame
+        // once it catches up, unless its policy is to get rid of it.
+        if (v->out.len - v->out_pos > SERVER_MAX_BACKLOG) {
+            if (v->lag_policy == VIEWER_LAG_KICK) {
+                viewer_free(j--);
+            } else if (v->state == VIEWER_SYNCED) {
+                v->state = VIEWER_STALE;
+            }
+            continue;
+        }
+
+        obuf_append(&v->out, frame->buf, frame->len);
+        v->state = VIEWER_SYNCED;
+        if (viewer_flush(v) == -1) viewer_free(j--);
+    }
+}
+
+void server_cleanup(void) {
+    while (NumViewers) viewer_free(0);
+    if (ListenFd != -1) {
+        close(ListenFd);
+        unlink(ListenPath);
+        free(ListenPath);
+        ListenFd = -1;
+    }
+}
+
+/* ================================ Viewer side ============================= */
+
+/* Attach to an emulator listening at 'path', showing its output in this
+ * terminal, and forwarding our keystrokes unless 'observer' is true.
+ * Returns when the user presses ESC or the emulator goes away. */
+int viewer_attach(const char *path, int observer, int lag_policy) {
+    struct sockaddr_un sa;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return 1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+        fprintf(stderr, "Can't attach to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    char hello[64];
+    int hello_len = snprintf(hello, sizeof(hello), VIEWER_HELLO " %d %d\n",
+                             observer, lag_policy);
+    if (write(fd, hello, hello_len) != hello_len) {
+        perror("write");
+        close(fd);
+        return 1;
+    }
+
+    printf("Attached to %s%s. Press 'ESC' to detach.\n", path,
+           observer ? " as observer" : "");
+    fflush(stdout);
+    enable_raw_mode();
+
+    char buf[1<<16];
+    int detached = 0;
+    while (1) {
+        struct pollfd pfd[2] = {
+            {.fd = STDIN_FILENO, .events = POLLIN},
+            {.fd = fd, .events = POLLIN}
+        };
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n == 1 && buf[0] == 27) { // Just ESC.
+                detached = 1;
+                break;
+            }
+            if (n > 0 && !observer && write(fd, buf, n) != n) break;
+        }
+
+        if (pfd[1].revents & (POLLIN|POLLHUP|POLLERR)) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;
+            if (fwrite(buf, n, 1, stdout) != 1) break;
+            fflush(stdout);
+        }
+    }
+
+    close(fd);
+    disable_raw_mode();
+    printf("\r\n%s\n", detached ? "Detached." : "Emulator went away.");
+    return 0;
+}
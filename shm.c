@@ -0,0 +1,88 @@
+/* shm.c
+ * Export the emulated RAM, color RAM, framebuffer and a few registers
+ * into a POSIX shared memory segment, so that external tools can observe
+ * the machine without slowing it down. See c64-shm.h for the layout. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "c64-kitty.h"
+
+static c64_shm_t *Shm = NULL;
+static char *ShmName = NULL;
+
+/* Create the shared memory segment 'name' (something like "/c64").
+ * Returns 0 on success, -1 on error (and errno is set). */
+int shm_export_init(const char *name) {
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    if (ftruncate(fd, sizeof(c64_shm_t)) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = saved_errno;
+        return -1;
+    }
+    void *p = mmap(NULL, sizeof(c64_shm_t), PROT_READ|PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+
+    Shm = p;
+    ShmName = strdup(name);
+    Shm->hdr.magic = C64_SHM_MAGIC;
+    Shm->hdr.version = C64_SHM_VERSION;
+    Shm->hdr.fb_width = C64_SHM_FB_WIDTH;
+    Shm->hdr.fb_height = C64_SHM_FB_HEIGHT;
+    return 0;
+}
+
+/* Copy the state at the end of a frame into the segment. The header
+ * fields in 'hdr' are copied, except for the ones describing the segment
+ * itself. The sequence number is odd while the copy is in progress, so
+ * that readers can detect they raced with us and retry. */
+void shm_export_publish(const c64_shm_header_t *hdr, const uint8_t *ram,
+                        const uint8_t *color_ram, const uint8_t *fb)
+{
+    if (Shm == NULL) return;
+
+    uint32_t seq = Shm->hdr.seq;
+    __atomic_store_n(&Shm->hdr.seq, seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    Shm->hdr.frame = hdr->frame;
+    Shm->hdr.ticks = hdr->ticks;
+    Shm->hdr.pc = hdr->pc;
+    Shm->hdr.a = hdr->a;
+    Shm->hdr.x = hdr->x;
+    Shm->hdr.y = hdr->y;
+    Shm->hdr.s = hdr->s;
+    Shm->hdr.p = hdr->p;
+    Shm->hdr.cpu_port = hdr->cpu_port;
+    Shm->hdr.vic_bank = hdr->vic_bank;
+    memcpy(Shm->hdr.vic_regs, hdr->vic_regs, sizeof(Shm->hdr.vic_regs));
+    memcpy(Shm->ram, ram, sizeof(Shm->ram));
+    memcpy(Shm->color_ram, color_ram, sizeof(Shm->color_ram));
+    memcpy(Shm->fb, fb, sizeof(Shm->fb));
+
+    __atomic_store_n(&Shm->hdr.seq, seq+2, __ATOMIC_RELEASE);
+}
+
+/* Unmap and remove the segment: readers that still have it mapped
+ * can keep reading the last published frame. */
+void shm_export_cleanup(void) {
+    if (Shm == NULL) return;
+    munmap(Shm, sizeof(c64_shm_t));
+    shm_unlink(ShmName);
+    free(ShmName);
+    Shm = NULL;
+}
@@ -0,0 +1,76 @@
+/* trace.c
+ * Save the instruction trace recorded by c64.h (compiled with C64_TRACE)
+ * into a file, that c64-trace.c turns into a disassembled listing. The
+ * layout of the file is described in c64-kitty.h.
+ *
+ * Saving only uses async-signal-safe calls, so that a signal handler can
+ * dump the trace of an emulator that is stuck in the middle of a frame. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "c64-kitty.h"
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+
+/* Write 'len' bytes to 'fd', retrying after short writes. Returns 0 on
+ * success, -1 on error. */
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t nwritten = write(fd, p, len);
+        if (nwritten <= 0) return -1;
+        p += nwritten;
+        len -= nwritten;
+    }
+    return 0;
+}
+
+/* Save the instruction trace of 'c64' into 'filename'. Returns 0 on
+ * success, -1 on error (and errno is set), or if the machine was not
+ * initialized with a trace ring. */
+int trace_save(void *c64, const char *filename) {
+    c64_t *sys = c64;
+    chips_range_t parts[2];
+    int num_parts = c64_trace_parts(sys, parts);
+    if (sys->trace.ring == NULL) return -1;
+
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.entry_size = sizeof(c64_trace_entry_t);
+    for (int j = 0; j < num_parts; j++)
+        hdr.count += parts[j].size / sizeof(c64_trace_entry_t);
+
+    int fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    int retval = write_all(fd, &hdr, sizeof(hdr));
+    // The CPU view of memory goes out in small chunks: a local buffer
+    // keeps this reentrant (the signal handler may interrupt a TRACE
+    // command) without needing much stack.
+    uint8_t mem[1024];
+    for (int addr = 0; addr < 0x10000 && retval == 0; addr += sizeof(mem)) {
+        for (size_t j = 0; j < sizeof(mem); j++)
+            mem[j] = mem_rd(&sys->mem_cpu, addr+j);
+        retval = write_all(fd, mem, sizeof(mem));
+    }
+    for (int j = 0; j < num_parts && retval == 0; j++)
+        retval = write_all(fd, parts[j].ptr, parts[j].size);
+    close(fd);
+    return retval;
+}
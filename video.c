@@ -0,0 +1,74 @@
+/* video.c
+ * Compose the pixels of the emulated screen on their own thread, so that
+ * the emulation only has to record what each raster line displays. The
+ * lines are handed over by c64.h itself (see the "Outputting the Video
+ * on its own Thread" section there), this file just provides the thread. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "c64-kitty.h"
+#include "chips_common.h"
+#include "m6502.h"
+#include "m6526.h"
+#include "m6569.h"
+#include "m6581.h"
+#include "beeper.h"
+#include "kbd.h"
+#include "mem.h"
+#include "clk.h"
+#include "c1530.h"
+#include "m6522.h"
+#include "c1541.h"
+#include "c64.h"
+
+/* Between two frames there are no lines to output: after that many empty
+ * steps the thread starts sleeping VIDEO_NAP_USEC between steps instead
+ * of yielding the CPU. A frame is emulated in a few milliseconds, so the
+ * yielding phase covers it and the lines are output as they come. */
+#define VIDEO_YIELD_STEPS 20000
+#define VIDEO_NAP_USEC 200
+
+static pthread_t VideoThread;
+static volatile int VideoStop = 0;
+static int VideoRunning = 0;
+
+static void *video_thread_main(void *arg) {
+    c64_t *c64 = arg;
+    int idle = 0;
+
+    while (!__atomic_load_n(&VideoStop, __ATOMIC_RELAXED)) {
+        if (c64_video_step(c64)) {
+            idle = 0;
+        } else if (idle < VIDEO_YIELD_STEPS) {
+            idle++;
+            sched_yield();
+        } else {
+            usleep(VIDEO_NAP_USEC);
+        }
+    }
+    return NULL;
+}
+
+/* Start outputting the raster lines of 'c64', initialized with
+ * video_threaded set. Returns 0 on success, -1 if the thread can't be
+ * created. */
+int video_thread_start(void *c64) {
+    VideoStop = 0;
+    if (pthread_create(&VideoThread, NULL, video_thread_main, c64) != 0)
+        return -1;
+    VideoRunning = 1;
+    return 0;
+}
+
+/* Stop the video thread: from now on the C64 can't be ticked anymore. */
+void video_thread_stop(void) {
+    if (!VideoRunning) return;
+    __atomic_store_n(&VideoStop, 1, __ATOMIC_RELAXED);
+    pthread_join(VideoThread, NULL);
+    VideoRunning = 0;
+}